@@ -1,8 +1,11 @@
+#ifndef CTFS_H
+#define CTFS_H
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/statfs.h>
 #include <sys/vfs.h>
+#include <sys/uio.h>
 #include <inttypes.h>
 #include <linux/magic.h>
 #include <linux/falloc.h>
@@ -25,8 +28,81 @@
 
 #define CTFS_MKFS_FLAG_RESET_DAX        0x01
 
+/* ctfs_init flags, the mount options.
+ * Without NOATIME or RELATIME every lookup 
+ * updates the atime of each directory passed.
+ * LAZYTIME keeps atime updates, and the
+ * mtime and ctime updates of writes and
+ * truncates, in DRAM and writes them to pmem
+ * in batches, on fsync, or when the inode is
+ * freed. Other changes stamp pmem directly.
+ */
+#define CTFS_INIT_FLAG_NOATIME          0x01
+#define CTFS_INIT_FLAG_RELATIME         0x02
+#define CTFS_INIT_FLAG_LAZYTIME         0x04
+
 #define CTFS_O_ATOMIC					010
 
+/* page group magazine counters, 
+ * summed over all threads. 
+ * Indexed by page group level.
+ */
+struct ctfs_mag_stat{
+	uint64_t	alloc_hit[10];
+	uint64_t	alloc_miss[10];
+	uint64_t	free_hit[10];
+	uint64_t	free_flush[10];
+};
+
+/* online defragmenter progress */
+struct ctfs_defrag_stat{
+	int			running;
+	uint64_t	passes;
+	// sparse L5 groups evacuated
+	uint64_t	groups_scanned;
+	// page groups freed as a whole
+	uint64_t	groups_reclaimed;
+	uint64_t	files_moved;
+	uint64_t	bytes_moved;
+	// offset of the last group worked on
+	uint64_t	cursor;
+	// sparse directories packed
+	uint64_t	dirs_compacted;
+};
+
+/* sub-PMD package sizing. requests is 
+ * the decayed histogram of requested
+ * L0-L2 levels, carved the packages
+ * built per level.
+ */
+struct ctfs_pgg_hist{
+	uint64_t	requests[3];
+	uint64_t	carved[3];
+};
+
+/* a range of a file borrowed with
+ * ctfs_read_view, read-only
+ */
+struct ctfs_view{
+	const void	*addr;
+	size_t		len;
+	uint64_t	ino;
+};
+
+/* copy routines picked at init */
+struct ctfs_cpy_stat{
+	char		write[16];
+	char		read[16];
+	// smallest write with non-temporal stores
+	uint64_t	nt_min;
+	// smallest read not left to memcpy
+	uint64_t	read_big;
+	uint64_t	prefetch;
+	// helpers of large copies, 0 if off
+	uint32_t	pool_threads;
+	uint64_t	pool_min;
+};
+
 void print_debug(int fd);
 
 int* ctfs_errno();
@@ -37,6 +113,8 @@ int ctfs_init(int flag);
 
 int ctfs_mkdir(const char *pathname, uint16_t mode);
 
+int ctfs_create_many(const char *dirpath, const char *const *names, int count, off_t size);
+
 int ctfs_stat(const char *pathname, struct stat *buf); // TODO
 
 int  ctfs_fstat (int fd, struct stat *buf);// TODO
@@ -63,6 +141,10 @@ int  ctfs_creat (const char *pathname, uint16_t mode);
 
 int  ctfs_close (int fd);
 
+int  ctfs_fsync (int fd);
+
+void ctfs_sync();
+
 ssize_t  ctfs_write(int fd, const void *buf, size_t count); 
 
 ssize_t  ctfs_pwrite(int fd, const void *buf, size_t count, off_t offset);
@@ -71,6 +153,14 @@ ssize_t  ctfs_read(int fd, void *buf, size_t count);
 
 ssize_t  ctfs_pread(int fd, void *buf, size_t count, off_t offset);
 
+ssize_t  ctfs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t  ctfs_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+ssize_t  ctfs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t  ctfs_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
 int  ctfs_link(const char *oldpath, const char *newpath); // TODO
 
 int  ctfs_unlink (const char *pathname); // TODO
@@ -94,3 +184,33 @@ int  ctfs_lseek(int fd, int offset, int whence); // ******
 int  ctfs_access(const char * pathname, int mode); // ******
 
 int ctfs_fcntl(int fd, int cmd, ...);// ******
+
+int ctfs_mag_stat(struct ctfs_mag_stat *stat);
+
+int ctfs_defrag_start(uint64_t rate);
+
+int ctfs_defrag_stop();
+
+int ctfs_defrag_stat(struct ctfs_defrag_stat *stat);
+
+int ctfs_pgg_hist(struct ctfs_pgg_hist *hist);
+
+int ctfs_cpy_stat(struct ctfs_cpy_stat *stat);
+
+int ctfs_cpy_pool_start(int threads, uint64_t min);
+
+int ctfs_cpy_pool_stop();
+
+void *ctfs_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
+
+int ctfs_munmap(void *addr, size_t len);
+
+int ctfs_msync(void *addr, size_t len, int flags);
+
+int ctfs_mmap_owns(const void *addr);
+
+ssize_t ctfs_read_view(int fd, off_t offset, size_t count, struct ctfs_view *view);
+
+void ctfs_read_view_release(struct ctfs_view *view);
+
+#endif
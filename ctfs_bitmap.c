@@ -2,6 +2,10 @@
 // Created by Ding Yuan on 2018-01-10.
 //
 #include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "ctfs_util.h"
 #include "ctfs_type.h"
 
@@ -27,9 +31,72 @@ int get_bit (uint64_t *bitmap, size_t b) {
 
 int64_t find_free_bit_tiny(uint64_t *bitmap, size_t size){
     assert(size <= 64);
-    for(uint8_t i = 0; i < size; i++){
-        if((*bitmap & ((uint64_t)0b01 << i)) == 0){
-            // found
+    uint64_t free = ~*bitmap;
+    if(size < 64){
+        free &= ((uint64_t)0b01 << size) - 1;
+    }
+    return free ? (int64_t)__builtin_ctzll(free) : -1;
+}
+
+/* find a free bit in one word,
+ * at or after hint, wrap around.
+ * @bitmap[in]  pointer ot the bitmap
+ * @size[in]    total number of bits in bitmap, at most 64
+ * @hint[in]    search starting point, in bit
+ * @return      nth bit, -1 if full
+ */
+int64_t find_free_bit_tiny_from(uint64_t *bitmap, size_t size, size_t hint){
+    assert(size <= 64);
+    uint64_t free = ~*bitmap;
+    if(size < 64){
+        free &= ((uint64_t)0b01 << size) - 1;
+    }
+    if(hint >= size){
+        hint = 0;
+    }
+    uint64_t after = free & (~(uint64_t)0 << hint);
+    if(after){
+        return (int64_t)__builtin_ctzll(after);
+    }
+    return free ? (int64_t)__builtin_ctzll(free) : -1;
+}
+
+/* find a word with a free bit, eight
+ * words per compare
+ */
+__attribute__((target("avx512f")))
+static int64_t find_free_word_avx512(uint64_t *bitmap, uint64_t from, uint64_t to){
+    uint64_t i = from;
+    const __m512i full = _mm512_set1_epi64(-1);
+    for(; i + 8 <= to; i += 8){
+        __mmask8 m = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(&bitmap[i]), full);
+        if(m){
+            return (int64_t)(i + __builtin_ctz(m));
+        }
+    }
+    if(i < to){
+        __mmask8 k = (__mmask8)((1u << (to - i)) - 1);
+        __mmask8 m = _mm512_mask_cmpneq_epi64_mask(k, 
+            _mm512_maskz_loadu_epi64(k, &bitmap[i]), full);
+        if(m){
+            return (int64_t)(i + __builtin_ctz(m));
+        }
+    }
+    return -1;
+}
+
+/* find a word with a free bit
+ * @bitmap[in]  pointer ot the bitmap
+ * @from[in]    first word
+ * @to[in]      end word, exclusive
+ * @return      nth word, -1 if all full
+ */
+static int64_t find_free_word(uint64_t *bitmap, uint64_t from, uint64_t to){
+    if(__builtin_cpu_supports("avx512f")){
+        return find_free_word_avx512(bitmap, from, to);
+    }
+    for(uint64_t i = from; i < to; i++){
+        if(bitmap[i] != ~(uint64_t)0x0){
             return (int64_t)i;
         }
     }
@@ -47,81 +114,241 @@ int64_t find_free_bit (uint64_t *bitmap, size_t size, size_t hint){
     assert(size%64 == 0);
     uint64_t limit_64 = size >> 6;
     uint64_t start_64 = hint >> 6;
-    uint64_t nth_64 = start_64;
-    uint64_t ret;
-    do{
-        if(unlikely(nth_64 >= limit_64)){
-            if(start_64 == 0){
-                goto failed;
-            }
-            else{
-                nth_64 = 0;
-            }
+    int64_t nth_64 = -1;
+    if(start_64 >= limit_64){
+        start_64 = 0;
+    }
+    nth_64 = find_free_word(bitmap, start_64, limit_64);
+    if(nth_64 == -1 && start_64 != 0){
+        nth_64 = find_free_word(bitmap, 0, start_64);
+    }
+    if(nth_64 == -1){
+        return -1;
+    }
+    return (nth_64 << 6) + __builtin_ctzll(~bitmap[nth_64]);
+}
+
+/* mark the words with a free bit
+ * in a summary bitmap
+ * @b[out]      summary bitmap, one bit per word
+ * @bitmap[in]  pointer ot the bitmap
+ * @nwords[in]  number of words to scan
+ */
+void ct_sbmp_load_free(ct_sbmp_t *b, uint64_t *bitmap, uint64_t nwords){
+    int64_t word = 0;
+    assert(nwords <= b->nbits);
+    while((uint64_t)word < nwords){
+        word = find_free_word(bitmap, word, nwords);
+        if(word == -1){
+            break;
         }
-        else if(bitmap[nth_64] == ~(uint64_t)0x0){
-            nth_64++;
+        ct_sbmp_set(b, word);
+        word ++;
+    }
+}
+
+/* propagate the change of one word
+ * to the upper levels
+ * @b[in]       summary bitmap
+ * @lvl[in]     level of the changed word
+ * @word[in]    index of the changed word
+ */
+static void ct_sbmp_update(ct_sbmp_t *b, uint8_t lvl, uint64_t word){
+    while(lvl + 1 < b->nlvl){
+        uint64_t *up = &b->map[lvl + 1][word >> 6];
+        uint64_t old = *up;
+        if(b->map[lvl][word]){
+            *up = old | ((uint64_t)0b01 << (word & 63));
         }
         else{
-            goto found_64;
+            *up = old & ~((uint64_t)0b01 << (word & 63));
         }
-    }while(nth_64 != start_64);
-    return -1;
-found_64:
-    // printf("%lx\n", bitmap[nth_64]);
-    for(uint8_t i = 0; i < 64; i++){
-        if((bitmap[nth_64] & ((uint64_t)0b01 << i)) == 0){
-            // found
-            ret = (nth_64 << 6) + i;
-            return (int64_t)ret;
-        }
-    }
-    assert(0);
-    // uint64_t ret = size - 64;
-    // uint64_t *n_bitmap = bitmap + size/64 - 1;
-    // uint8_t* _bitmap;
-    // while(1){
-    //     if(unlikely(ret>=size)){
-    //         goto failed;
-    //     }
-    //     if(*n_bitmap == ~(uint64_t)(0x0)){
-    //         ret -= 64;
-    //         n_bitmap--;
-    //         continue;
-    //     }
-    //     else{
-    //         break;
-    //     }
-    // }
-    // _bitmap = (uint8_t*)n_bitmap;
-    // while(1){
-    //     if(*_bitmap == 0xFF){
-    //         ret+=8;
-    //         _bitmap++;
-    //         continue;
-    //     }
-    //     else{
-    //         break;
-    //     }
-    // }
-    // while(1){
-    //     if( ((*_bitmap) & (1 << BIT_OFFSET(ret))) == 0){
-    //         return ret;
-    //     }
-    //     else{
-    //         ret++;
-    //     }
-    // }
-
-failed:
-    return -1;
+        if((old == 0) == (*up == 0)){
+            return;
+        }
+        word >>= 6;
+        lvl ++;
+    }
+}
+
+/* allocate a summary bitmap, all clear
+ * @b[out]      summary bitmap
+ * @nbits[in]   number of items
+ * @return      0 if success, -1 otherwise
+ */
+int ct_sbmp_init(ct_sbmp_t *b, uint64_t nbits){
+    uint64_t n = (nbits + 63) >> 6;
+    memset(b, 0, sizeof(ct_sbmp_t));
+    b->nbits = nbits;
+    while(1){
+        assert(b->nlvl < CT_SBMP_MAX_LVL);
+        b->nwords[b->nlvl] = n;
+        b->map[b->nlvl] = calloc(n, sizeof(uint64_t));
+        if(b->map[b->nlvl] == NULL){
+            ct_sbmp_destroy(b);
+            return -1;
+        }
+        b->nlvl ++;
+        if(n == 1){
+            break;
+        }
+        n = (n + 63) >> 6;
+    }
+    return 0;
 }
 
-void bitlock_acquire(uint64_t *bitlock, uint64_t location){
-    uint64_t * target = bitlock + (location / 64);
-    uint64_t offset = location % 64;
-    while((((uint64_t)0b01 << offset) & __sync_fetch_and_or(target, (uint64_t)0b01 << offset)) != 0){
-        // pthread_yield();
+void ct_sbmp_destroy(ct_sbmp_t *b){
+    for(uint8_t i = 0; i < b->nlvl; i++){
+        free(b->map[i]);
     }
+    memset(b, 0, sizeof(ct_sbmp_t));
+}
+
+void ct_sbmp_set(ct_sbmp_t *b, uint64_t bit){
+    assert(bit < b->nbits);
+    b->map[0][bit >> 6] |= (uint64_t)0b01 << (bit & 63);
+    ct_sbmp_update(b, 0, bit >> 6);
+}
+
+void ct_sbmp_clear(ct_sbmp_t *b, uint64_t bit){
+    assert(bit < b->nbits);
+    b->map[0][bit >> 6] &= ~((uint64_t)0b01 << (bit & 63));
+    ct_sbmp_update(b, 0, bit >> 6);
+}
+
+int ct_sbmp_test(ct_sbmp_t *b, uint64_t bit){
+    return (b->map[0][bit >> 6] >> (bit & 63)) & 0b01;
+}
+
+/* find the first set bit
+ * @b[in]       summary bitmap
+ * @from[in]    search starting point, in bit
+ * @return      nth bit, -1 if none
+ */
+int64_t ct_sbmp_next(ct_sbmp_t *b, uint64_t from){
+    uint64_t bit = from;
+    uint8_t lvl = 0;
+    if(from >= b->nbits){
+        return -1;
+    }
+    // go up until a set bit at or after the cursor
+    while(1){
+        uint64_t word = bit >> 6;
+        if(word >= b->nwords[lvl]){
+            return -1;
+        }
+        uint64_t val = b->map[lvl][word] & (~(uint64_t)0 << (bit & 63));
+        if(val){
+            bit = (word << 6) + __builtin_ctzll(val);
+            break;
+        }
+        if(lvl + 1 == b->nlvl){
+            return -1;
+        }
+        bit = word + 1;
+        lvl ++;
+    }
+    // go down along the first set bits
+    while(lvl > 0){
+        lvl --;
+        bit = (bit << 6) + __builtin_ctzll(b->map[lvl][bit]);
+    }
+    return (bit < b->nbits) ? (int64_t)bit : -1;
+}
+
+/* clear a set of bits in one word
+ * @b[in]       summary bitmap
+ * @word[in]    index of the level 0 word
+ * @mask[in]    bits to take
+ * @return      the bits that were set
+ */
+uint64_t ct_sbmp_take_word(ct_sbmp_t *b, uint64_t word, uint64_t mask){
+    uint64_t ret = b->map[0][word] & mask;
+    if(ret){
+        b->map[0][word] &= ~mask;
+        ct_sbmp_update(b, 0, word);
+    }
+    return ret;
+}
+
+void ct_sbmp_put_word(ct_sbmp_t *b, uint64_t word, uint64_t bits){
+    if(bits){
+        b->map[0][word] |= bits;
+        ct_sbmp_update(b, 0, word);
+    }
+}
+
+/* Parking lot of the locks. A waiter that spun
+ * too long sleeps on the futex of the bucket its
+ * lock hashes to. Releasers only bump and wake a
+ * bucket with waiters, the uncontended release just
+ * reads one shared line.
+ */
+struct lock_park{
+    uint32_t    seq;
+    uint32_t    waiters;
+    char        padding[56];
+};
+
+static struct lock_park lock_park[CT_LOCK_PARK_BUCKETS];
+
+static inline struct lock_park *lock_park_of(volatile uint32_t *word){
+    uint64_t h = ((uint64_t)word >> 2) * 0x9e3779b97f4a7c15;
+    return &lock_park[(h >> 32) % CT_LOCK_PARK_BUCKETS];
+}
+
+/* wait for the given bits of a lock word to
+ * clear. Spins with growing pauses, then parks.
+ * The caller retries its atomic afterwards.
+ * @param[in] word, the 32-bit word of the lock
+ * @param[in] mask, bits that must be clear
+ * @return LOCK_SPUN or LOCK_PARKED
+ */
+static int lock_wait(volatile uint32_t *word, uint32_t mask){
+    uint32_t pause = 1;
+    for(int i = 0; i < CT_LOCK_SPIN; i++){
+        if((*word & mask) == 0){
+            return LOCK_SPUN;
+        }
+        for(uint32_t j = 0; j < pause; j++){
+            _mm_pause();
+        }
+        if(pause < CT_LOCK_BACKOFF){
+            pause <<= 1;
+        }
+    }
+    struct lock_park *p = lock_park_of(word);
+    __sync_fetch_and_add(&p->waiters, 1);
+    uint32_t seq = *(volatile uint32_t*)&p->seq;
+    // a release after the waiter count is seen
+    // bumps seq, so the futex does not sleep
+    if(*word & mask){
+        syscall(SYS_futex, &p->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    }
+    __sync_fetch_and_sub(&p->waiters, 1);
+    return LOCK_PARKED;
+}
+
+/* wake the parked waiters of a lock. Called
+ * after the locked op that released it.
+ */
+static inline void lock_wake(volatile uint32_t *word){
+    struct lock_park *p = lock_park_of(word);
+    if(*(volatile uint32_t*)&p->waiters){
+        __sync_fetch_and_add(&p->seq, 1);
+        syscall(SYS_futex, &p->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+int bitlock_acquire(uint64_t *bitlock, uint64_t location){
+    volatile uint32_t *word = (uint32_t*)bitlock + (location / 32);
+    uint32_t bit = (uint32_t)0b01 << (location % 32);
+    int ret = LOCK_FREE;
+    while((__sync_fetch_and_or(word, bit) & bit) != 0){
+        int r = lock_wait(word, bit);
+        ret = (r > ret) ? r : ret;
+    }
+    return ret;
 }
 
 int bitlock_try_acquire(uint32_t *bitlock, uint32_t bit, uint32_t tries){
@@ -137,5 +364,79 @@ int bitlock_try_acquire(uint32_t *bitlock, uint32_t bit, uint32_t tries){
 }
 
 void bitlock_release(uint64_t *bitlock, uint64_t location){
-    FETCH_AND_unSET_BIT(bitlock, location);
+    volatile uint32_t *word = (uint32_t*)bitlock + (location / 32);
+    __sync_fetch_and_and(word, ~((uint32_t)0b01 << (location % 32)));
+    lock_wake(word);
+}
+
+int ct_lock_acquire(uint32_t *lock){
+    int ret = LOCK_FREE;
+    while(__sync_lock_test_and_set(lock, 1) != 0){
+        int r = lock_wait(lock, 1);
+        ret = (r > ret) ? r : ret;
+    }
+    return ret;
+}
+
+int ct_lock_try(uint32_t *lock){
+    return *(volatile uint32_t*)lock == 0 && __sync_lock_test_and_set(lock, 1) == 0;
+}
+
+void ct_lock_release(uint32_t *lock){
+    // xchg, so the waiter check is not reordered before it
+    __atomic_exchange_n(lock, 0, __ATOMIC_SEQ_CST);
+    lock_wake(lock);
+}
+
+/* reader-writer lock in one word.
+ * Low bits count readers. A waiting writer
+ * holds back new readers so it is not starved.
+ */
+#define RWLOCK_WRITER   ((uint32_t)0b01 << 31)
+#define RWLOCK_WAITING  ((uint32_t)0b01 << 30)
+
+int rwlock_acquire_shared(uint32_t *lock){
+    int ret = LOCK_FREE;
+    while(1){
+        uint32_t v = *(volatile uint32_t*)lock;
+        if((v & (RWLOCK_WRITER | RWLOCK_WAITING)) == 0){
+            if(__sync_bool_compare_and_swap(lock, v, v + 1)){
+                return ret;
+            }
+            _mm_pause();
+            continue;
+        }
+        int r = lock_wait(lock, RWLOCK_WRITER | RWLOCK_WAITING);
+        ret = (r > ret) ? r : ret;
+    }
+}
+
+void rwlock_release_shared(uint32_t *lock){
+    if(__sync_sub_and_fetch(lock, 1) == RWLOCK_WAITING){
+        lock_wake(lock);
+    }
+}
+
+int rwlock_acquire(uint32_t *lock){
+    int ret = LOCK_FREE;
+    while(1){
+        uint32_t v = *(volatile uint32_t*)lock;
+        if((v & ~RWLOCK_WAITING) == 0){
+            if(__sync_bool_compare_and_swap(lock, v, RWLOCK_WRITER)){
+                return ret;
+            }
+            _mm_pause();
+            continue;
+        }
+        if((v & RWLOCK_WAITING) == 0){
+            __sync_fetch_and_or(lock, RWLOCK_WAITING);
+        }
+        int r = lock_wait(lock, ~RWLOCK_WAITING);
+        ret = (r > ret) ? r : ret;
+    }
+}
+
+void rwlock_release(uint32_t *lock){
+    __sync_fetch_and_and(lock, ~RWLOCK_WRITER);
+    lock_wake(lock);
 }
@@ -3,6 +3,17 @@
 
 // #define CTFS_ATOMIC_WRITE
 // #define CTFS_ATOMIC_WRITE_USE_UNDO
+// count waits per inode lock slot
+// #define CTFS_LOCK_STAT
+
+/* Locks spin CT_LOCK_SPIN rounds with growing
+ * pauses, up to CT_LOCK_BACKOFF each, before the 
+ * waiter parks on a futex. Parked waiters sleep in
+ * CT_LOCK_PARK_BUCKETS buckets hashed by lock address.
+ */
+#define CT_LOCK_SPIN                64
+#define CT_LOCK_BACKOFF             64
+#define CT_LOCK_PARK_BUCKETS        256
 
 #define CT_PAGE_SIZE        		((uint64_t)0x01 << 12)
 #define CT_PGGSIZE_LV0      		(4 * (uint64_t)1024)
@@ -29,6 +40,129 @@
 
 #define CT_ALLOC_PROT_SIZE          64
 
+/* per-cpu pgg arenas. Each arena owns one
+ * L5 subtree and serves L0-L4 allocations
+ */
+#define CT_PGG_ARENAS               64
+#define CT_PGG_ARENA_LVL            5
+#define CT_PGG_ARENA_SIZE           CT_PGGSIZE_LV5
+
+/* per-cpu pools of reserved inode numbers, 
+ * refilled from and drained to the bitmap
+ * CT_INODE_POOL_BATCH at a time. A crash leaks
+ * at most CT_INODE_POOL_SIZE per pool. Each pool
+ * counts its inode_used change and folds it into
+ * the super block once it reaches CT_INODE_USED_FOLD.
+ */
+#define CT_INODE_POOLS              64
+#define CT_INODE_POOL_SIZE          64
+#define CT_INODE_POOL_BATCH         32
+#define CT_INODE_USED_FOLD          64
+
+/* per-thread magazines of freed page groups.
+ * Levels above CT_PGG_MAG_MAX_LVL bypass them,
+ * so a thread holds at most 8 x 2M of L3 until
+ * a flush or the next init. A full magazine returns CT_PGG_MAG_BATCH of
+ * its oldest entries to the tree at once.
+ */
+#define CT_PGG_MAG_SIZE             8
+#define CT_PGG_MAG_BATCH            4
+#define CT_PGG_MAG_MAX_LVL          3
+
+/* a file is moved to a smaller page group
+ * only when it drops CT_PGG_SHRINK_GAP levels
+ * or more. It keeps one level of headroom.
+ */
+#define CT_PGG_SHRINK_GAP           2
+
+/* the sub-PMD request histogram of an arena
+ * is halved once it counts this many requests
+ */
+#define CT_PGG_HIST_WINDOW          4096
+
+/* online defragmenter. A L5 using no more 
+ * than CT_DEFRAG_SPARSE of its 64 L3 units is
+ * evacuated. Up to CT_DEFRAG_BATCH L5s are 
+ * worked on per inode table scan.
+ */
+#define CT_DEFRAG_SPARSE            16
+#define CT_DEFRAG_BATCH             8
+#define CT_DEFRAG_IDLE_MS           1000
+
+/* directories with more dirent slots than 
+ * CT_DIR_HASH_MIN get a hashed index, kept at
+ * or under half load. It is rebuilt when an
+ * insert probes more than CT_DIR_HASH_PROBE
+ * entries, which then only tombstones cause.
+ */
+#define CT_DIR_HASH_MIN             128
+#define CT_DIR_HASH_PROBE           32
+
+/* large directories with less than 1 in
+ * CT_DIR_COMPACT_SPARSE slots in use are packed
+ * into a smaller group by the defrag thread.
+ * Up to CT_DIR_COMPACT_QUEUE wait for it.
+ */
+#define CT_DIR_COMPACT_SPARSE       4
+#define CT_DIR_COMPACT_QUEUE        256
+
+/* files mapped at once by ctfs_mmap,
+ * counting each range separately
+ */
+#define CT_MAX_MMAP                 1024
+
+/* levels of headroom a mapped file gets 
+ * above what the mapping needs, so it can grow
+ * 8x per level while mapped without moving. 
+ * Not past CT_MMAP_HEADROOM_MAX_LVL. Growth
+ * past it fails with EFBIG until unmapped.
+ */
+#define CT_MMAP_HEADROOM_LVL        1
+#define CT_MMAP_HEADROOM_MAX_LVL    PGG_LVL7
+
+/* read views held at once, all threads
+ */
+#define CT_MAX_VIEW                 1024
+
+/* calibration of the copy engine at init:
+ * best of CT_CPY_CALIBRATE_RUNS copies of
+ * a CT_CPY_CALIBRATE_SIZE buffer
+ */
+#define CT_CPY_CALIBRATE_SIZE       ((uint64_t) 8 << 20)
+#define CT_CPY_CALIBRATE_RUNS       2
+
+/* helper threads of large copies. Copies of
+ * CT_CPY_POOL_MIN bytes and more, unless
+ * ctfs_cpy_pool_start is given another size,
+ * are split in chunks of CT_CPY_POOL_CHUNK.
+ */
+#define CT_CPY_POOL_MAX             64
+#define CT_CPY_POOL_MIN             ((uint64_t) 64 << 20)
+#define CT_CPY_POOL_CHUNK           ((uint64_t) 2 << 20)
+
+/* first size of the table of page groups
+ * kept for read views, doubled when full.
+ */
+#define CT_VIEW_RETIRED_INIT        256
+
+/* per-process dentry cache of path lookups,
+ * CT_DCACHE_SETS sets of CT_DCACHE_WAYS entries.
+ * Longer names are not cached.
+ */
+#define CT_DCACHE_SETS              16384
+#define CT_DCACHE_WAYS              4
+#define CT_DCACHE_NAME              43
+
+/* lazytime: pending times are kept in a
+ * direct mapped table of CT_LAZYTIME_SLOTS and
+ * all written back once CT_LAZYTIME_BATCH are
+ * pending. relatime: an atime older than 
+ * CT_RELATIME_SEC is always updated.
+ */
+#define CT_LAZYTIME_SLOTS           4096
+#define CT_LAZYTIME_BATCH           1024
+#define CT_RELATIME_SEC             (24 * 3600)
+
 #define CT_DAX_ALLOC_SIZE  			((uint64_t)0x01 << 41)  // 2TB
 
 #define CT_OFFSET_IBMP              ((uint64_t) 512 << 10)  // 512KB
@@ -38,10 +172,14 @@
 #define CT_OFFSET_1_PGG  			((uint64_t) 0x01 << 39) // 512GB
 
 #define CT_SIZE_MAX_INODE           ((CT_OFFSET_ITABLE - CT_OFFSET_IBMP) << 3)
-#define CT_INODE_BITLOCK_SLOTS      65536
-#define CT_INODE_RW_SLOTS			65536
+/* inode lock slots, one cache line each.
+ * Inodes hash to a slot by number.
+ */
+#define CT_INODE_LOCK_SLOTS         16384
+// optimistic preads that raced this many times take the rw lock
+#define CT_PREAD_RETRY				8
 #define CT_MAX_NAME					231
-#define CT_MAGIC            		"ctfs_v1"
+#define CT_MAGIC            		"ctfs_v2"
 #define CT_MAX_FD					4096
 
 #define CT_FAILSAFE_NFRAMES			32
@@ -89,7 +227,6 @@
 #define	EPIPE		32	/* Broken pipe */
 #define	EDOM		33	/* Math argument out of domain of func */
 #define	ERANGE		34	/* Math result not representable */
-#define CTFS_HACK
 
 // #define DAX_DEBUGGING 1
 
@@ -1,130 +1,559 @@
+/*****************************
+ *
+ * Copy engine. The routines are picked by
+ * cpy_init from the cpu features and a short
+ * calibration run:
+ *  - pmem writes (avx_cpy): temporal stores and
+ *    a write back below nt_min, non-temporal
+ *    stores of the fastest width above.
+ *  - pmem reads (cpy_read): glibc memcpy below
+ *    read_big, then rep movsb or vector loads
+ *    with a software prefetch, the faster one.
+ * Partial lines at the ends of a write are
+ * masked stores with AVX-512BW.
+ * Until cpy_init runs, SSE2 and memcpy.
+ *
+ * Copies of pool.min bytes and more are split
+ * into chunks shared with a pool of helper
+ * threads, if ctfs_cpy_pool_start started
+ * one. The helpers run on the cpus of the
+ * node of the DAX device. One copy at a time
+ * uses the pool, others run alone.
+ *
+ ****************************/
+#define _GNU_SOURCE
+#include <cpuid.h>
+#include <limits.h>
+#include <sched.h>
+#include "ctfs.h"
 #include "ctfs_runtime.h"
 
 #define FLUSH_ALIGN (uint64_t)64
 #define ALIGN_MASK	(FLUSH_ALIGN - 1)
 
+typedef void (*cpy_fn_t)(void *dest, const void *src, size_t size);
 
-inline void avx_cpy(void *dest, const void *src, size_t size)
-{
-	/*
-			* Copy the range in the forward direction.
-			*
-			* This is the most common, most optimized case, used unless
-			* the overlap specifically prevents it.
-			*/
-	/* copy up to FLUSH_ALIGN boundary */
-
-	
-	size_t cnt = (uint64_t)dest & ALIGN_MASK;
-	if (unlikely(cnt > 0))
-	{
-		cnt = FLUSH_ALIGN - cnt;
-		if(cnt > size){
-			cnt = size;
-			size = 0;
-		}
-		else{
-			size -= cnt;
-		}
-		/* never try to copy more the len bytes */
-		// register uint32_t d;
-		register uint8_t d8;
-		// while(cnt > 3){
-		// 	d = *(uint32_t*)(src);
-		// 	_mm_stream_si32(dest, d);
-		// 	src += 4;
-		// 	dest += 4;
-		// 	cnt -= 4;
-		// }
-		// if(unlikely(cnt > 0)){
-		while(cnt){
-			d8 = *(uint8_t*)(src);
-			*(uint8_t*)dest = d8;
-			cnt --;
-			src ++;
-			dest ++;
-		}
-		cache_wb_one(dest);
-		// }
-		if(size == 0){
-			return;
-		}
-	}
-	assert((uint64_t)dest % 64 == 0);
-	register __m512i xmm0;
-	while(size >= 64){
-		xmm0 = _mm512_loadu_si512(src);
-		_mm512_stream_si512(dest, xmm0);
-		dest += 64;
-		src += 64;
-		size -= 64;
-	}
-	
-	/* copy the tail (<512 bit)  */
-	size &= ALIGN_MASK;
-	if (unlikely(size != 0))
-	{
-		while(size > 0){
-			*(uint8_t*)dest = *(uint8_t*)src;
-			size --;
-			dest ++;
-			src ++;
-		}
-		cache_wb_one(dest - 1);
-	}
-}
-
-
-inline void avx_cpyt(void *dest, void *src, size_t size)
-{
-	/*
-			* Copy the range in the forward direction.
-			*
-			* This is the most common, most optimized case, used unless
-			* the overlap specifically prevents it.
-			*/
-	/* copy up to FLUSH_ALIGN boundary */
-	
-	register __m512i xmm0;
-	while(size >= 512){
-		xmm0 = _mm512_loadu_si512(src);
-		_mm512_storeu_si512(dest, xmm0);
-		xmm0 = _mm512_loadu_si512(src + 64);
-		_mm512_storeu_si512(dest + 64, xmm0);
-		xmm0 = _mm512_loadu_si512(src + 128);
-		_mm512_storeu_si512(dest + 128, xmm0);
-		xmm0 = _mm512_loadu_si512(src + 192);
-		_mm512_storeu_si512(dest + 192, xmm0);
-		xmm0 = _mm512_loadu_si512(src + 256);
-		_mm512_storeu_si512(dest + 256, xmm0);
-		xmm0 = _mm512_loadu_si512(src + 320);
-		_mm512_storeu_si512(dest + 320, xmm0);
-		xmm0 = _mm512_loadu_si512(src + 384);
-		_mm512_storeu_si512(dest + 384, xmm0);
-		xmm0 = _mm512_loadu_si512(src + 448);
-		_mm512_storeu_si512(dest + 448, xmm0);
-		dest += 512;
-		src += 512;
-		size -= 512;
-	}
-	while(size >= 64){
-		xmm0 = _mm512_loadu_si512(src);
-		_mm512_storeu_si512(dest, xmm0);
-		dest += 64;
-		src += 64;
-		size -= 64;
-	}
-	
-	/* copy the tail  */
-	size &= ALIGN_MASK;
-	if (unlikely(size != 0))
-	{
-		while(size > 0){
-			*(uint8_t*)dest = *(uint8_t*)src;
-			size --;
-			dest ++;
-			src ++;
+/* bytes of a write within one line of dest,
+ * temporal, then written back
+ */
+static void cpy_edge(void *dest, const void *src, size_t size){
+	memcpy(dest, src, size);
+	cache_wb_one(dest);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void cpy_edge_avx512(void *dest, const void *src, size_t size){
+	__mmask64 k = ((uint64_t)1 << size) - 1;
+	_mm512_mask_storeu_epi8(dest, k, _mm512_maskz_loadu_epi8(k, src));
+	cache_wb_one(dest);
+}
+
+static void cpy_rd_libc(void *dest, const void *src, size_t size){
+	memcpy(dest, src, size);
+}
+
+static void cpy_nt_sse2(void *dest, const void *src, size_t size);
+
+static struct{
+	// non-temporal writes to pmem
+	cpy_fn_t		nt;
+	cpy_fn_t		edge;
+	// reads from pmem
+	cpy_fn_t		read;
+	const char		*nt_name;
+	const char		*read_name;
+	// smaller writes use temporal stores
+	size_t			nt_min;
+	// smaller reads use memcpy
+	size_t			read_big;
+	// bytes the vector read loop prefetches ahead
+	size_t			prefetch;
+} cpy = {
+	.nt = cpy_nt_sse2,
+	.edge = cpy_edge,
+	.read = cpy_rd_libc,
+	.nt_name = "sse2",
+	.read_name = "memcpy",
+	.nt_min = 0,
+	.read_big = SIZE_MAX,
+	.prefetch = 0
+};
+
+/* the line aligned middle of a non-temporal
+ * write, the ends go through cpy.edge
+ */
+#define CPY_NT_BODY(store)											\
+	do{																\
+		size_t head = (-(uint64_t)dest) & ALIGN_MASK;				\
+		if(head){													\
+			head = (head < size) ? head : size;						\
+			cpy.edge(dest, src, head);								\
+			dest += head;											\
+			src += head;											\
+			size -= head;											\
+		}															\
+		for(; size >= FLUSH_ALIGN; size -= FLUSH_ALIGN){			\
+			store;													\
+			dest += FLUSH_ALIGN;									\
+			src += FLUSH_ALIGN;										\
+		}															\
+		if(size){													\
+			cpy.edge(dest, src, size);								\
+		}															\
+	}while(0)
+
+static void cpy_nt_sse2(void *dest, const void *src, size_t size){
+	CPY_NT_BODY({
+		for(int i = 0; i < 64; i += 16){
+			_mm_stream_si128(dest + i, _mm_loadu_si128(src + i));
 		}
+	});
+}
+
+__attribute__((target("avx2")))
+static void cpy_nt_avx2(void *dest, const void *src, size_t size){
+	CPY_NT_BODY({
+		_mm256_stream_si256(dest, _mm256_loadu_si256(src));
+		_mm256_stream_si256(dest + 32, _mm256_loadu_si256(src + 32));
+	});
+}
+
+__attribute__((target("avx512f")))
+static void cpy_nt_avx512(void *dest, const void *src, size_t size){
+	CPY_NT_BODY(_mm512_stream_si512(dest, _mm512_loadu_si512(src)));
+}
+
+__attribute__((target("movdir64b")))
+static void cpy_nt_movdir64b(void *dest, const void *src, size_t size){
+	CPY_NT_BODY(_movdir64b(dest, src));
+}
+
+/* temporal stores, then write back.
+ * Cheaper for short writes.
+ */
+static void cpy_wb(void *dest, const void *src, size_t size){
+	if(size){
+		memcpy(dest, src, size);
+		cache_wb(dest, size);
+	}
+}
+
+static void cpy_rd_erms(void *dest, const void *src, size_t size){
+	__asm__ __volatile__("rep movsb"
+		: "+D" (dest), "+S" (src), "+c" (size) : : "memory");
+}
+
+__attribute__((target("avx2")))
+static void cpy_rd_avx2(void *dest, const void *src, size_t size){
+	size_t pf = cpy.prefetch;
+	for(; size >= 128; size -= 128){
+		if(pf){
+			_mm_prefetch(src + pf, _MM_HINT_T0);
+			_mm_prefetch(src + pf + 64, _MM_HINT_T0);
+		}
+		__m256i a = _mm256_loadu_si256(src);
+		__m256i b = _mm256_loadu_si256(src + 32);
+		__m256i c = _mm256_loadu_si256(src + 64);
+		__m256i d = _mm256_loadu_si256(src + 96);
+		_mm256_storeu_si256(dest, a);
+		_mm256_storeu_si256(dest + 32, b);
+		_mm256_storeu_si256(dest + 64, c);
+		_mm256_storeu_si256(dest + 96, d);
+		dest += 128;
+		src += 128;
 	}
+	memcpy(dest, src, size);
+}
 
+__attribute__((target("avx512f,avx512bw")))
+static void cpy_rd_avx512(void *dest, const void *src, size_t size){
+	size_t pf = cpy.prefetch;
+	// align the stores
+	size_t head = (-(uint64_t)dest) & ALIGN_MASK;
+	if(head && size >= FLUSH_ALIGN){
+		__mmask64 k = ((uint64_t)1 << head) - 1;
+		_mm512_mask_storeu_epi8(dest, k, _mm512_maskz_loadu_epi8(k, src));
+		dest += head;
+		src += head;
+		size -= head;
+	}
+	for(; size >= 128; size -= 128){
+		if(pf){
+			_mm_prefetch(src + pf, _MM_HINT_T0);
+			_mm_prefetch(src + pf + 64, _MM_HINT_T0);
+		}
+		__m512i a = _mm512_loadu_si512(src);
+		__m512i b = _mm512_loadu_si512(src + 64);
+		_mm512_storeu_si512(dest, a);
+		_mm512_storeu_si512(dest + 64, b);
+		dest += 128;
+		src += 128;
+	}
+	while(size){
+		size_t n = (size < FLUSH_ALIGN) ? size : FLUSH_ALIGN;
+		__mmask64 k = (n == FLUSH_ALIGN) ? ~(__mmask64)0 : ((uint64_t)1 << n) - 1;
+		_mm512_mask_storeu_epi8(dest, k, _mm512_maskz_loadu_epi8(k, src));
+		dest += n;
+		src += n;
+		size -= n;
+	}
+}
+
+static struct{
+	pthread_t		thread[CT_CPY_POOL_MAX];
+	uint32_t		n;
+	// copies split from this size on
+	size_t			min;
+	// one copy in the pool at a time
+	uint32_t		busy;
+	pthread_mutex_t	lock;
+	pthread_cond_t	go;
+	pthread_cond_t	done;
+	uint64_t		gen;
+	uint32_t		running;
+	int				stop;
+	// the copy, chunks aligned on the pmem side
+	cpy_fn_t		f;
+	void			*dest;
+	const void		*src;
+	size_t			size;
+	int64_t			first;
+	uint64_t		next;
+	uint64_t		nchunk;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.go = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+};
+
+/* take chunks of the pool copy until
+ * none is left, then fence the stores
+ */
+static void cpy_pool_work(){
+	uint64_t i;
+	while((i = __sync_fetch_and_add(&pool.next, 1)) < pool.nchunk){
+		int64_t lo = pool.first + (int64_t)(i * CT_CPY_POOL_CHUNK);
+		int64_t hi = lo + CT_CPY_POOL_CHUNK;
+		lo = (lo < 0) ? 0 : lo;
+		hi = (hi > (int64_t)pool.size) ? (int64_t)pool.size : hi;
+		pool.f(pool.dest + lo, pool.src + lo, hi - lo);
+	}
+	_mm_sfence();
+}
+
+static void *cpy_pool_thread(void *arg){
+	uint64_t gen = 0;
+	pthread_mutex_lock(&pool.lock);
+	while(1){
+		while(!pool.stop && pool.gen == gen){
+			pthread_cond_wait(&pool.go, &pool.lock);
+		}
+		if(pool.stop){
+			break;
+		}
+		gen = pool.gen;
+		pthread_mutex_unlock(&pool.lock);
+		dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		cpy_pool_work();
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		pthread_mutex_lock(&pool.lock);
+		if(-- pool.running == 0){
+			pthread_cond_signal(&pool.done);
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+/* split a copy with the pool, joined
+ * before returning
+ * @param[in] pm, the pmem side of the copy
+ * @return 1 if copied, 0 if the pool is busy
+ */
+static int cpy_pool(cpy_fn_t f, void *dest, const void *src, size_t size, const void *pm){
+	if(!ct_lock_try(&pool.busy)){
+		return 0;
+	}
+	uint64_t head = (-(uint64_t)pm) & (CT_CPY_POOL_CHUNK - 1);
+	pthread_mutex_lock(&pool.lock);
+	pool.f = f;
+	pool.dest = dest;
+	pool.src = src;
+	pool.size = size;
+	pool.first = head ? (int64_t)head - CT_CPY_POOL_CHUNK : 0;
+	pool.nchunk = (size - pool.first + CT_CPY_POOL_CHUNK - 1) / CT_CPY_POOL_CHUNK;
+	pool.next = 0;
+	pool.running = pool.n;
+	pool.gen ++;
+	pthread_cond_broadcast(&pool.go);
+	pthread_mutex_unlock(&pool.lock);
+	cpy_pool_work();
+	pthread_mutex_lock(&pool.lock);
+	while(pool.running){
+		pthread_cond_wait(&pool.done, &pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	ct_lock_release(&pool.busy);
+	return 1;
+}
+
+/* copy to pmem, written back once the
+ * caller fences
+ */
+void avx_cpy(void *dest, const void *src, size_t size){
+	if(size < cpy.nt_min){
+		cpy_wb(dest, src, size);
+		return;
+	}
+	if(unlikely(pool.n && size >= pool.min) && cpy_pool(cpy.nt, dest, src, size, dest)){
+		return;
+	}
+	cpy.nt(dest, src, size);
+}
+
+/* copy with temporal stores, not written back */
+void avx_cpyt(void *dest, void *src, size_t size){
+	memcpy(dest, src, size);
+}
+
+/* copy from pmem */
+void cpy_read(void *dest, const void *src, size_t size){
+	if(size < cpy.read_big){
+		memcpy(dest, src, size);
+		return;
+	}
+	if(unlikely(pool.n && size >= pool.min) && cpy_pool(cpy.read, dest, src, size, src)){
+		return;
+	}
+	cpy.read(dest, src, size);
+}
+
+/* best of a few runs copying the whole
+ * buffer in pieces of size
+ * @return ns
+ */
+static long cpy_time(cpy_fn_t f, void *dest, const void *src, size_t size){
+	long best = LONG_MAX;
+	struct timespec start, stop;
+	for(int r = 0; r < CT_CPY_CALIBRATE_RUNS; r++){
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(size_t off = 0; off + size <= CT_CPY_CALIBRATE_SIZE; off += size){
+			f(dest + off, src + off, size);
+		}
+		_mm_sfence();
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		long t = calc_diff(start, stop);
+		best = (t < best) ? t : best;
+	}
+	return best;
+}
+
+/* pick the copy routines. The calibration
+ * runs on DRAM, it ranks the routines rather
+ * than predicting pmem bandwidth.
+ */
+void cpy_init(){
+	unsigned int eax, ebx = 0, ecx = 0, edx;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	int erms = (ebx >> 9) & 0b01;
+	int movdir64b = (ecx >> 28) & 0b01;
+	int avx2 = __builtin_cpu_supports("avx2");
+	int avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	char *src = aligned_alloc(CT_PAGE_SIZE, CT_CPY_CALIBRATE_SIZE);
+	char *dest = aligned_alloc(CT_PAGE_SIZE, CT_CPY_CALIBRATE_SIZE);
+	if(src == NULL || dest == NULL){
+		free(src);
+		free(dest);
+		return;
+	}
+	memset(src, 0x5a, CT_CPY_CALIBRATE_SIZE);
+	memset(dest, 0, CT_CPY_CALIBRATE_SIZE);
+	if(avx512){
+		cpy.edge = cpy_edge_avx512;
+	}
+
+	// writes: widest store that is fastest
+	struct{cpy_fn_t f; const char *name; int ok;} nt[] = {
+		{cpy_nt_sse2, "sse2", 1},
+		{cpy_nt_avx2, "avx2", avx2},
+		{cpy_nt_avx512, "avx512", avx512},
+		{cpy_nt_movdir64b, "movdir64b", movdir64b}
+	};
+	long best = LONG_MAX;
+	for(int i = 0; i < sizeof(nt) / sizeof(nt[0]); i++){
+		long t = nt[i].ok ? cpy_time(nt[i].f, dest, src, CT_CPY_CALIBRATE_SIZE) : LONG_MAX;
+		if(t < best){
+			best = t;
+			cpy.nt = nt[i].f;
+			cpy.nt_name = nt[i].name;
+		}
+	}
+	// the smallest write that non-temporal wins
+	cpy.nt_min = CT_CPY_CALIBRATE_SIZE;
+	for(size_t size = 256; size < CT_CPY_CALIBRATE_SIZE; size <<= 2){
+		if(cpy_time(cpy.nt, dest, src, size) <= cpy_time(cpy_wb, dest, src, size)){
+			cpy.nt_min = size;
+			break;
+		}
+	}
+
+	// large reads, each prefetch distance
+	struct{cpy_fn_t f; const char *name; int ok; size_t prefetch;} rd[] = {
+		{cpy_rd_libc, "memcpy", 1, 0},
+		{cpy_rd_erms, "erms", erms, 0},
+		{cpy_rd_avx2, "avx2", avx2, 0},
+		{cpy_rd_avx2, "avx2", avx2, 512},
+		{cpy_rd_avx2, "avx2", avx2, 2048},
+		{cpy_rd_avx512, "avx512", avx512, 0},
+		{cpy_rd_avx512, "avx512", avx512, 512},
+		{cpy_rd_avx512, "avx512", avx512, 2048}
+	};
+	best = LONG_MAX;
+	size_t prefetch = 0;
+	for(int i = 0; i < sizeof(rd) / sizeof(rd[0]); i++){
+		if(!rd[i].ok){
+			continue;
+		}
+		cpy.prefetch = rd[i].prefetch;
+		long t = cpy_time(rd[i].f, dest, src, CT_CPY_CALIBRATE_SIZE);
+		if(t < best){
+			best = t;
+			prefetch = rd[i].prefetch;
+			cpy.read = rd[i].f;
+			cpy.read_name = rd[i].name;
+		}
+	}
+	cpy.prefetch = prefetch;
+	// and from where it beats memcpy
+	cpy.read_big = SIZE_MAX;
+	if(cpy.read != cpy_rd_libc){
+		cpy.read_big = PMD_SIZE;
+		for(size_t size = 16 << 10; size < PMD_SIZE; size <<= 2){
+			if(cpy_time(cpy.read, dest, src, size) < cpy_time(cpy_rd_libc, dest, src, size)){
+				cpy.read_big = size;
+				break;
+			}
+		}
+	}
+	free(src);
+	free(dest);
+}
+
+int ctfs_cpy_stat(struct ctfs_cpy_stat *stat){
+	*stat = (struct ctfs_cpy_stat){0};
+	strncpy(stat->write, cpy.nt_name, sizeof(stat->write) - 1);
+	strncpy(stat->read, cpy.read_name, sizeof(stat->read) - 1);
+	stat->nt_min = cpy.nt_min;
+	stat->read_big = cpy.read_big;
+	stat->prefetch = cpy.prefetch;
+	stat->pool_threads = pool.n;
+	stat->pool_min = pool.min;
+	return 0;
+}
+
+/* read an integer from a sysfs file
+ * @return the value, -1 if unreadable
+ */
+static long cpy_sysfs_long(const char *path){
+	long v = -1;
+	FILE *f = fopen(path, "r");
+	if(f){
+		if(fscanf(f, "%ld", &v) != 1){
+			v = -1;
+		}
+		fclose(f);
+	}
+	return v;
+}
+
+/* the cpus of the node of the DAX device,
+ * or of the calling thread
+ * @return 0 if found, -1 otherwise
+ */
+static int cpy_pool_cpus(cpu_set_t *set){
+	char path[64];
+	unsigned int cpu, node;
+	long n = cpy_sysfs_long("/sys/bus/dax/devices/dax0.0/numa_node");
+	if(n < 0){
+		if(getcpu(&cpu, &node)){
+			return -1;
+		}
+		n = node;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", n);
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return -1;
+	}
+	// ranges like 0-23,48-71
+	CPU_ZERO(set);
+	unsigned int lo, hi;
+	int got;
+	while((got = fscanf(f, "%u-%u", &lo, &hi)) >= 1){
+		hi = (got == 2) ? hi : lo;
+		for(; lo <= hi && lo < CPU_SETSIZE; lo++){
+			CPU_SET(lo, set);
+		}
+		if(fgetc(f) != ','){
+			break;
+		}
+	}
+	fclose(f);
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+/* start the helper threads of large copies
+ * @param[in] threads, helpers besides the caller
+ * @param[in] min, smallest copy to split,
+ *            0 for CT_CPY_POOL_MIN
+ * @return 0 if success, -1 otherwise
+ */
+int ctfs_cpy_pool_start(int threads, uint64_t min){
+	cpu_set_t set;
+	if(pool.n){
+		ct_rt.errorn = EBUSY;
+		return -1;
+	}
+	if(threads < 1 || threads > CT_CPY_POOL_MAX){
+		ct_rt.errorn = EINVAL;
+		return -1;
+	}
+	int pin = cpy_pool_cpus(&set) == 0;
+	pool.min = min ? min : CT_CPY_POOL_MIN;
+	pool.stop = 0;
+	for(int i = 0; i < threads; i++){
+		if(pthread_create(&pool.thread[i], NULL, cpy_pool_thread, NULL)){
+			break;
+		}
+		if(pin){
+			pthread_setaffinity_np(pool.thread[i], sizeof(set), &set);
+		}
+		pool.n ++;
+	}
+	if(pool.n == 0){
+		ct_rt.errorn = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+/* stop the helper threads, after
+ * the copy in flight
+ */
+int ctfs_cpy_pool_stop(){
+	if(pool.n == 0){
+		return 0;
+	}
+	ct_lock_acquire(&pool.busy);
+	uint32_t n = pool.n;
+	pool.n = 0;
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.go);
+	pthread_mutex_unlock(&pool.lock);
+	for(uint32_t i = 0; i < n; i++){
+		pthread_join(pool.thread[i], NULL);
+	}
+	ct_lock_release(&pool.busy);
+	return 0;
 }
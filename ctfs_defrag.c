@@ -0,0 +1,287 @@
+/*****************************
+ * 
+ * Online defragmenter.
+ * A background thread evacuates sparsely
+ * used L5 page groups by moving their files
+ * out with pswap, so that the groups (and
+ * the levels above) can be freed as a whole.
+ * It also packs directories gone sparse,
+ * see dir_compact.
+ * 
+ ****************************/
+#include "ctfs.h"
+#include "ctfs_pgg.h"
+#include "ctfs_runtime.h"
+
+#define DEFRAG_NAP_NS	(10 * 1000 * 1000)
+
+/* sleep in short naps so 
+ * that stop is noticed soon
+ * @param[in] ns
+ */
+static void defrag_sleep(uint64_t ns){
+	while(ns && !ct_rt.defrag.stop){
+		uint64_t nap = (ns < DEFRAG_NAP_NS) ? ns : DEFRAG_NAP_NS;
+		struct timespec t = {.tv_sec = 0, .tv_nsec = nap};
+		nanosleep(&t, NULL);
+		ns -= nap;
+	}
+}
+
+/* move one file out of the L5s
+ * being evacuated. Holds both locks
+ * of the inode while moving.
+ * @param[in] index, inode number
+ * @param[in] roots, the L5s
+ * @param[in] n, number of L5s
+ * @param[out] bytes, bytes moved
+ * @return 1 if moved, 0 otherwise
+ */
+static int defrag_move(index_t index, relptr_t *roots, uint16_t n, uint64_t *bytes){
+	ct_inode_pt inode = &ct_rt.inode_start[index];
+	int ret = 0;
+	inode_rt_lock(index);
+	inode_rw_lock(index);
+	// it may have been moved or deleted meanwhile
+	if(!((((uint64_t*)ct_rt.inode_bmp)[index / 64] >> (index % 64)) & 0b01) ||
+		inode->i_level == PGG_LVL_NONE || inode->i_level >= CT_PGG_ARENA_LVL ||
+		inode_mapped(index)){
+		goto out;
+	}
+	relptr_t old = inode->i_block;
+	uint16_t i;
+	for(i = 0; i < n; i++){
+		if(old >= roots[i] && old < roots[i] + CT_PGG_ARENA_SIZE){
+			break;
+		}
+	}
+	if(i == n){
+		goto out;
+	}
+	pgg_level_t lvl = inode->i_level;
+	// only move downwards, or it never settles
+	relptr_t new = pgg_allocate_below(lvl, roots[i]);
+	if(new == 0){
+		goto out;
+	}
+	uint64_t size = (inode->i_size < pgg_lvl_size(lvl)) ? inode->i_size : pgg_lvl_size(lvl);
+	if(inode->i_hash_bits){
+		// the directory index sits at the tail
+		size = pgg_lvl_size(lvl);
+	}
+	if(size){
+		view_move(index, new, old, (size + CT_PAGE_SIZE - 1) >> 12);
+	}
+	inode->i_block = new;
+	cache_wb_one(inode);
+	if(!view_retire(index, lvl, old)){
+		pgg_deallocate_direct(lvl, old);
+	}
+	*bytes = (size + CT_PAGE_SIZE - 1) & PAGE_MASK;
+	ret = 1;
+out:
+	inode_rw_unlock(index);
+	inode_rt_unlock(index);
+	return ret;
+}
+
+/* a file below the L5s, for finding 
+ * the files of a batch without a scan
+ */
+struct defrag_ref{
+	relptr_t	root;
+	index_t		ino;
+};
+
+static int defrag_ref_cmp(const void *a, const void *b){
+	const struct defrag_ref *x = a, *y = b;
+	if(x->root != y->root){
+		return (x->root > y->root) - (x->root < y->root);
+	}
+	return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+/* map every file below the L5s to its L5,
+ * sorted by L5. One scan of the inode table
+ * per pass, defrag_move checks again.
+ * @param[out] n, number of entries
+ * @return the map, NULL if out of memory or empty
+ */
+static struct defrag_ref *defrag_map(uint64_t *n){
+	uint64_t touched = ct_super->inode_bmp_touched;
+	uint64_t cap = 1024;
+	struct defrag_ref *map = malloc(cap * sizeof(struct defrag_ref));
+	*n = 0;
+	if(map == NULL){
+		return NULL;
+	}
+	for(index_t i = 0; i < touched && !ct_rt.defrag.stop; i++){
+		uint64_t word = ((uint64_t*)ct_rt.inode_bmp)[i / 64];
+		if(word == 0){
+			i |= 63;
+			continue;
+		}
+		if(!((word >> (i % 64)) & 0b01)){
+			continue;
+		}
+		ct_inode_pt inode = &ct_rt.inode_start[i];
+		if(inode->i_level == PGG_LVL_NONE || inode->i_level >= CT_PGG_ARENA_LVL){
+			continue;
+		}
+		if(*n == cap){
+			struct defrag_ref *t = realloc(map, (cap *= 2) * sizeof(struct defrag_ref));
+			if(t == NULL){
+				break;
+			}
+			map = t;
+		}
+		map[(*n) ++] = (struct defrag_ref){
+			.root = inode->i_block & ~(CT_PGG_ARENA_SIZE - 1),
+			.ino = i
+		};
+	}
+	qsort(map, *n, sizeof(struct defrag_ref), defrag_ref_cmp);
+	return map;
+}
+
+/* one pass over the whole space
+ * @return whether anything was moved or freed
+ */
+static int defrag_pass(){
+	relptr_t roots[CT_DEFRAG_BATCH];
+	relptr_t cursor = CT_DAX_ALLOC_SIZE - CT_PGG_ARENA_SIZE;
+	int progress = 0;
+	struct timespec start, now;
+	uint64_t bytes = 0;
+	// built with the first batch, a file landing
+	// in a L5 later waits for the next pass
+	struct defrag_ref *map = NULL;
+	uint64_t nmap = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while(!ct_rt.defrag.stop){
+		uint16_t n = 0;
+		// pick a batch of sparse L5s
+		while(n < CT_DEFRAG_BATCH){
+			cursor = pgg_defrag_next(cursor, CT_DEFRAG_SPARSE);
+			if(cursor == 0){
+				break;
+			}
+			if(pgg_defrag_own(cursor) == 0){
+				roots[n++] = cursor;
+			}
+			cursor -= CT_PGG_ARENA_SIZE;
+		}
+		if(n == 0){
+			break;
+		}
+		ct_rt.defrag.scanned += n;
+		ct_rt.defrag.cursor = roots[n - 1];
+		if(map == NULL){
+			map = defrag_map(&nmap);
+		}
+		for(uint16_t r = 0; r < n && map != NULL && !ct_rt.defrag.stop; r++){
+			// first file of this L5
+			uint64_t lo = 0, hi = nmap;
+			while(lo < hi){
+				uint64_t mid = (lo + hi) / 2;
+				if(map[mid].root < roots[r]){
+					lo = mid + 1;
+				}
+				else{
+					hi = mid;
+				}
+			}
+			for(; lo < nmap && map[lo].root == roots[r] && !ct_rt.defrag.stop; lo++){
+				uint64_t moved;
+				if(!defrag_move(map[lo].ino, roots, n, &moved)){
+					continue;
+				}
+				progress = 1;
+				ct_rt.defrag.files_moved ++;
+				ct_rt.defrag.bytes_moved += moved;
+				bytes += moved;
+				if(ct_rt.defrag.rate){
+					// stay under the rate since the pass started
+					clock_gettime(CLOCK_MONOTONIC, &now);
+					uint64_t due = bytes * 1000000000 / ct_rt.defrag.rate;
+					uint64_t spent = calc_diff(start, now);
+					if(due > spent){
+						defrag_sleep(due - spent);
+					}
+				}
+			}
+		}
+		for(uint16_t i = 0; i < n; i++){
+			int freed = pgg_defrag_release(roots[i]);
+			ct_rt.defrag.reclaimed += freed;
+			progress |= freed;
+		}
+	}
+	free(map);
+	return progress;
+}
+
+static void * defrag_thread(void *arg){
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	while(!ct_rt.defrag.stop){
+		int progress = defrag_pass();
+		uint64_t dirs = dir_compact_pending();
+		ct_rt.defrag.dirs_compacted += dirs;
+		progress |= (dirs != 0);
+		ct_rt.defrag.passes ++;
+		if(!progress){
+			defrag_sleep((uint64_t)CT_DEFRAG_IDLE_MS * 1000 * 1000);
+		}
+	}
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	return NULL;
+}
+
+/* start the background defragmenter
+ * @param[in] rate, bytes moved per second, 0 for unlimited
+ * @return 0 if success, -1 otherwise
+ */
+int ctfs_defrag_start(uint64_t rate){
+	if(ct_rt.defrag.running){
+		ct_rt.errorn = EBUSY;
+		return -1;
+	}
+	ct_rt.defrag.rate = rate;
+	ct_rt.defrag.stop = 0;
+	ct_rt.defrag.running = 1;
+	if(pthread_create(&ct_rt.defrag.thread, NULL, defrag_thread, NULL)){
+		ct_rt.defrag.running = 0;
+		ct_rt.errorn = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+/* stop the defragmenter and wait 
+ * for the current file move to finish
+ */
+int ctfs_defrag_stop(){
+	if(!ct_rt.defrag.running){
+		return 0;
+	}
+	ct_rt.defrag.stop = 1;
+	pthread_join(ct_rt.defrag.thread, NULL);
+	ct_rt.defrag.running = 0;
+	return 0;
+}
+
+int ctfs_defrag_stat(struct ctfs_defrag_stat *stat){
+	if(stat == NULL){
+		ct_rt.errorn = EINVAL;
+		return -1;
+	}
+	stat->running = ct_rt.defrag.running;
+	stat->passes = ct_rt.defrag.passes;
+	stat->groups_scanned = ct_rt.defrag.scanned;
+	stat->groups_reclaimed = ct_rt.defrag.reclaimed;
+	stat->files_moved = ct_rt.defrag.files_moved;
+	stat->bytes_moved = ct_rt.defrag.bytes_moved;
+	stat->cursor = ct_rt.defrag.cursor;
+	stat->dirs_compacted = ct_rt.defrag.dirs_compacted;
+	return 0;
+}
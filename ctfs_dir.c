@@ -0,0 +1,791 @@
+/*****************************
+ *
+ * Directories. The dirents are packed
+ * into 32B slots, see ct_dirent. Free 
+ * entries are reused by names that fit,
+ * the rest of the entry is split off.
+ * Entries are never merged, so a slot that
+ * starts an entry keeps starting one and
+ * readdir offsets stay valid. Directories
+ * left mostly free are repacked by the
+ * defrag thread while nobody has them open.
+ *
+ * Hashed directory index.
+ * Small directories are scanned linearly.
+ * Once a directory holds more than
+ * CT_DIR_HASH_MIN slots, an open addressing
+ * table of dirent slots is kept in the last
+ * 1/4 of its page group, the dirents stay in
+ * the first half and keep their slots. The
+ * table has twice as many entries as there
+ * are dirent slots, so it is at most half
+ * full and probe runs stay short.
+ *
+ * The table only ever holds a superset of the
+ * live dirents: an entry is written before
+ * the dirent gets its inode number and removed
+ * after the dirent is cleared. Lookups verify
+ * the name, so stale entries are harmless.
+ * While the table is rebuilt i_hash_bits is 0
+ * and the directory is scanned linearly.
+ *
+ ****************************/
+#include "ctfs.h"
+#include "ctfs_pgg.h"
+#include "ctfs_runtime.h"
+
+#define DIR_SLOT(e)			((uint32_t)(e))
+#define DIR_TAG(e)			((uint32_t)((e) >> 32))
+#define DIR_ENTRY(slot, h)	(((h) & ~(uint64_t)0xFFFFFFFF) | (slot))
+#define DIR_EMPTY			0
+#define DIR_TOMB			0xFFFFFFFF
+
+/* offset of the table in a group of size
+ * group_size, and the bytes at the front
+ * that can hold dirents when it is there.
+ * Directories hashed with the dirents up to
+ * the table are still read, they move to
+ * the half load layout when they next grow.
+ */
+#define DIR_TABLE_OFF(group_size)		((group_size) - ((group_size) >> 2))
+#define DIR_DIRENT_SPACE(group_size)	((group_size) >> 1)
+
+uint64_t dir_name_hash(const char *name, size_t len){
+	uint64_t h = 0xcbf29ce484222325;
+	for(size_t i = 0; i < len; i++){
+		h = (h ^ (uint8_t)name[i]) * 0x100000001b3;
+	}
+	return h;
+}
+
+static inline uint64_t* dir_table(ct_inode_pt dir){
+	uint64_t group = pgg_lvl_size(dir->i_level);
+	return (uint64_t*)((uint64_t)CT_REL2ABS(dir->i_block) + DIR_TABLE_OFF(group));
+}
+
+/* compare the name of a dirent with a name
+ * of the same length, 16B at a time. The 
+ * dirent side is padded by its slots, name
+ * is not read past its own page.
+ * @param[in] d_name, of a dirent
+ * @param[in] name, not necessarily terminated
+ * @param[in] len, length of both
+ */
+static inline int dir_name_eq(const char *d_name, const char *name, size_t len){
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16){
+		__m128i a = _mm_loadu_si128((const __m128i*)(d_name + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(name + i));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF){
+			return 0;
+		}
+	}
+	if(i == len){
+		return 1;
+	}
+	__m128i b;
+	if(((uint64_t)(name + i) & (CT_PAGE_SIZE - 1)) <= CT_PAGE_SIZE - 16){
+		b = _mm_loadu_si128((const __m128i*)(name + i));
+	}
+	else{
+		char tail[16] = {0};
+		memcpy(tail, name + i, len - i);
+		b = _mm_loadu_si128((const __m128i*)tail);
+	}
+	__m128i a = _mm_loadu_si128((const __m128i*)(d_name + i));
+	uint32_t mask = ((uint32_t)0b01 << (len - i)) - 1;
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & mask) == mask;
+}
+
+/* @return whether dirent d holds the name
+ *         with hash h
+ */
+static inline int dir_match(ct_dirent_pt d, const char *name, size_t len, uint64_t h){
+	return d->d_ino != 0 && d->d_hash == DIR_TAG(h) && d->d_namelen == len &&
+		dir_name_eq(d->d_name, name, len);
+}
+
+/* put a slot in the table, no flush
+ * @return number of probes
+ */
+static uint64_t dir_table_put(uint64_t *table, uint64_t mask, uint64_t h, uint32_t slot){
+	uint64_t i = h & mask, n = 0;
+	while(DIR_SLOT(table[i]) != DIR_EMPTY && DIR_SLOT(table[i]) != DIR_TOMB){
+		i = (i + 1) & mask;
+		n ++;
+	}
+	table[i] = DIR_ENTRY(slot, h);
+	return n;
+}
+
+/* (re)build the table of a directory whose
+ * dirents fit in front of it. Scanned
+ * linearly until the new table is in place.
+ * @param[in] dir
+ */
+static void dir_index_build(ct_inode_pt dir){
+	uint64_t group = pgg_lvl_size(dir->i_level);
+	uint64_t nd = dir->i_size / sizeof(ct_dirent_t);
+	ct_dirent_pt d = CT_REL2ABS(dir->i_block);
+	assert(dir->i_size <= DIR_TABLE_OFF(group));
+	dir->i_hash_bits = 0;
+	cache_wb_one(&dir->i_hash_bits);
+	_mm_sfence();
+	// 8B entries, the last 1/4 of the group
+	uint8_t bits = __builtin_ctzll(group) - 5;
+	uint64_t *table = dir_table(dir);
+	uint64_t mask = ((uint64_t)0b01 << bits) - 1;
+	memset(table, 0, (mask + 1) * sizeof(uint64_t));
+	for(uint64_t i = 2; i < nd; i += CT_DIRENT_NSLOT(&d[i])){
+		if(d[i].d_ino != 0){
+			dir_table_put(table, mask, dir_name_hash(d[i].d_name, d[i].d_namelen), i);
+		}
+	}
+	cache_wb(table, (mask + 1) * sizeof(uint64_t));
+	_mm_sfence();
+	dir->i_hash_bits = bits;
+	cache_wb_one(&dir->i_hash_bits);
+}
+
+/* look up one path component
+ * @param[in] dir, rt locked
+ * @param[in] name, not necessarily terminated
+ * @param[in] len, length of name
+ * @return dirent slot, -1 if not found
+ */
+int64_t dir_lookup(ct_inode_pt dir, const char *name, size_t len){
+	ct_dirent_pt d = CT_REL2ABS(dir->i_block);
+	uint64_t nd = dir->i_size / sizeof(ct_dirent_t);
+	if(len == 0 || len > CT_MAX_NAME){
+		return -1;
+	}
+	if(name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))){
+		return len - 1;
+	}
+	uint64_t h = dir_name_hash(name, len);
+	if(dir->i_hash_bits == 0){
+		for(uint64_t i = 2; i < nd; i += CT_DIRENT_NSLOT(&d[i])){
+			if(dir_match(&d[i], name, len, h)){
+				return i;
+			}
+		}
+		return -1;
+	}
+	uint64_t *table = dir_table(dir);
+	uint64_t mask = ((uint64_t)0b01 << dir->i_hash_bits) - 1;
+	uint64_t i = h & mask;
+	for(uint64_t n = 0; n <= mask; n++, i = (i + 1) & mask){
+		uint64_t e = table[i];
+		uint32_t slot = DIR_SLOT(e);
+		if(slot == DIR_EMPTY){
+			break;
+		}
+		if(slot != DIR_TOMB && DIR_TAG(e) == DIR_TAG(h) && slot < nd &&
+			dir_match(&d[slot], name, len, h)){
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* index a dirent whose name is written,
+ * before its d_ino is set. Also drops the
+ * name from the dentry cache.
+ * @param[in] dir, rt locked
+ * @param[in] dirent
+ */
+void dir_index_add(ct_inode_pt dir, ct_dirent_pt dirent){
+	dcache_invalidate(dir->i_number, dirent->d_name, dirent->d_namelen);
+	if(dir->i_hash_bits == 0){
+		return;
+	}
+	uint32_t slot = dirent - (ct_dirent_pt)CT_REL2ABS(dir->i_block);
+	uint64_t h = dir_name_hash(dirent->d_name, dirent->d_namelen);
+	uint64_t *table = dir_table(dir);
+	uint64_t mask = ((uint64_t)0b01 << dir->i_hash_bits) - 1;
+	uint64_t n = dir_table_put(table, mask, h, slot);
+	cache_wb_one(&table[(h + n) & mask]);
+	_mm_sfence();
+	if(n > CT_DIR_HASH_PROBE){
+		// too many tombstones and stale entries. The
+		// rebuild skips this dirent, d_ino is not set yet
+		dir_index_build(dir);
+		n = dir_table_put(table, mask, h, slot);
+		cache_wb_one(&table[(h + n) & mask]);
+		_mm_sfence();
+	}
+}
+
+/* drop a dirent from the index and the
+ * dentry cache, after its d_ino is cleared
+ * @param[in] dir, rt locked
+ * @param[in] dirent
+ */
+void dir_index_del(ct_inode_pt dir, ct_dirent_pt dirent){
+	uint32_t slot = dirent - (ct_dirent_pt)CT_REL2ABS(dir->i_block);
+	dcache_invalidate(dir->i_number, dirent->d_name, dirent->d_namelen);
+	dir_free_put(dir, slot);
+	if(dir->i_hash_bits == 0){
+		return;
+	}
+	uint64_t h = dir_name_hash(dirent->d_name, dirent->d_namelen);
+	uint64_t *table = dir_table(dir);
+	uint64_t mask = ((uint64_t)0b01 << dir->i_hash_bits) - 1;
+	uint64_t i = h & mask;
+	for(uint64_t n = 0; n <= mask; n++, i = (i + 1) & mask){
+		if(DIR_SLOT(table[i]) == DIR_EMPTY){
+			return;
+		}
+		if(DIR_SLOT(table[i]) == slot && DIR_TAG(table[i]) == DIR_TAG(h)){
+			table[i] = DIR_ENTRY(DIR_TOMB, h);
+			cache_wb_one(&table[i]);
+			return;
+		}
+	}
+}
+
+/* cut a free entry down to n slots, the
+ * rest becomes a free entry of its own.
+ * Persisted before the entry shrinks, so
+ * a scan never lands inside a name.
+ * @param[in] d, the free entry
+ * @param[in] n
+ */
+static void dir_split(ct_dirent_pt d, uint32_t n){
+	uint32_t k = CT_DIRENT_NSLOT(d);
+	if(k <= n){
+		return;
+	}
+	ct_dirent_pt rest = d + n;
+	memset(rest, 0, offsetof(ct_dirent_t, d_name));
+	rest->d_nslot = k - n;
+	cache_wb_one(rest);
+	_mm_sfence();
+	d->d_nslot = n;
+	cache_wb_one(&d->d_nslot);
+}
+
+/* write the name of a new dirent, d_ino
+ * stays 0 until the caller links it after
+ * dir_index_add. d is a free entry of at
+ * least CT_DIRENT_SLOTS(len) slots, or
+ * zeroed space. The rest of a larger entry
+ * is split off as a free one first, so a 
+ * scan never lands inside a name.
+ * Flushed, not fenced.
+ * @param[in] d, the first slot
+ * @param[in] name, not necessarily terminated
+ * @param[in] len, at most CT_MAX_NAME
+ * @param[in] type, DT_*
+ */
+void dir_dirent_set(ct_dirent_pt d, const char *name, size_t len, uint8_t type){
+	uint32_t n = CT_DIRENT_SLOTS(len);
+	dir_split(d, n);
+	d->d_hash = DIR_TAG(dir_name_hash(name, len));
+	d->d_namelen = len;
+	d->d_type = type;
+	d->d_nslot = n;
+	memcpy(d->d_name, name, len);
+	d->d_name[len] = '\0';
+	cache_wb(d, n * sizeof(ct_dirent_t));
+}
+
+/* write "." and ".." of a new directory
+ * @param[in] dir, with a page group of at
+ *            least two slots
+ * @param[in] parent
+ */
+void dir_init(ct_inode_pt dir, index_t parent){
+	ct_dirent_pt d = CT_REL2ABS(dir->i_block);
+	memset(d, 0, 2 * sizeof(ct_dirent_t));
+	dir_dirent_set(&d[0], ".", 1, DT_DIR);
+	dir_dirent_set(&d[1], "..", 2, DT_DIR);
+	d[0].d_ino = dir->i_number;
+	d[1].d_ino = parent;
+	cache_wb(d, 2 * sizeof(ct_dirent_t));
+	dir->i_size = 2 * sizeof(ct_dirent_t);
+	dir->i_ndirent = 2;
+}
+
+/* find free dirent slots for a name,
+ * growing the directory if needed. A
+ * reused entry is cut to size.
+ * @param[in] dir, rt locked
+ * @param[in] len, length of the name
+ * @return first slot, -1 if out of space
+ */
+int64_t dir_alloc(ct_inode_pt dir, size_t len){
+	uint64_t nd = dir->i_size / sizeof(ct_dirent_t);
+	uint32_t n = CT_DIRENT_SLOTS(len);
+	int64_t slot = dir_free_take(dir, n);
+	if(slot >= 0){
+		return slot;
+	}
+	if(dir_grow(dir, nd + n)){
+		return -1;
+	}
+	return nd;
+}
+
+/* hand back the slots of dir_alloc when
+ * the dirent is not linked after all
+ * @param[in] dir, rt locked
+ * @param[in] slot, from dir_alloc
+ * @param[in] len, as given to dir_alloc
+ */
+void dir_unalloc(ct_inode_pt dir, int64_t slot, size_t len){
+	ct_dirent_pt d = &((ct_dirent_pt)CT_REL2ABS(dir->i_block))[slot];
+	// grown space is zeroed, keep it one entry
+	d->d_nslot = CT_DIRENT_SLOTS(len);
+	cache_wb_one(&d->d_nslot);
+	_mm_sfence();
+	dir_free_put(dir, slot);
+}
+
+/* groups are not zeroed on allocation,
+ * new dirents must not show stale inodes
+ * @param[in] dir
+ * @param[in] from, to: byte range of the dirents
+ */
+static void dir_clear(ct_inode_pt dir, size_t from, size_t to){
+	void *d = (void*)((uint64_t)CT_REL2ABS(dir->i_block) + from);
+	memset(d, 0, to - from);
+	cache_wb(d, to - from);
+	_mm_sfence();
+}
+
+/* bytes of a group that can hold dirents
+ * @param[in] lvl
+ * @param[in] hashed, table at the tail
+ */
+static inline uint64_t dir_space(pgg_level_t lvl, int hashed){
+	uint64_t group = pgg_lvl_size(lvl);
+	return hashed ? DIR_DIRENT_SPACE(group) : group;
+}
+
+/* make room for nslots dirents. Large
+ * directories move to the hashed format,
+ * the table is rebuilt when the group moves.
+ * The caller reloads its dirent pointers.
+ * @param[in] dir, rt locked
+ * @param[in] nslots
+ * @return 0 if success, -1 if out of space
+ */
+int dir_grow(ct_inode_pt dir, uint64_t nslots){
+	size_t need = nslots * sizeof(ct_dirent_t);
+	size_t old = dir->i_size;
+	if(need <= old){
+		return 0;
+	}
+	uint8_t old_bits = dir->i_hash_bits;
+	int hashed = old_bits != 0 || nslots > CT_DIR_HASH_MIN;
+	// readdir holds it shared
+	inode_rw_lock(dir->i_number);
+	if(dir->i_level == PGG_LVL_NONE || need > dir_space(dir->i_level, hashed)){
+		pgg_level_t lvl = pgg_get_lvl(need);
+		while(need > dir_space(lvl, hashed)){
+			lvl ++;
+		}
+		// the old table is left behind in the middle
+		dir->i_hash_bits = 0;
+		cache_wb_one(&dir->i_hash_bits);
+		_mm_sfence();
+		if(inode_resize_lvl(dir, lvl, old) < 0){
+			inode_rw_unlock(dir->i_number);
+			if(old_bits){
+				dir_index_build(dir);
+			}
+			ct_rt.errorn = ENOSPC;
+			return -1;
+		}
+	}
+	dir_clear(dir, old, need);
+	dir->i_size = need;
+	ct_time_stamp(&dir->i_ctim);
+	ct_time_stamp(&dir->i_mtim);
+	inode_wb(dir);
+	inode_rw_unlock(dir->i_number);
+	if(hashed && dir->i_hash_bits == 0){
+		dir_index_build(dir);
+	}
+	return 0;
+}
+
+/*****************************
+ *
+ * Free dirents of large directories.
+ * Built from the dirents on first use, then
+ * kept up to date by dir_free_take and
+ * dir_index_del, so a create finds a slot
+ * in constant time. One directory per inode
+ * lock slot, guarded by that rt lock, a
+ * directory of the same slot takes it over.
+ * Entries are checked against the dirents
+ * when taken. Small directories are scanned.
+ *
+ ****************************/
+
+#define DIR_FREE_OF(ino)	ct_rt.dir_free[(ino) % CT_INODE_LOCK_SLOTS]
+
+static void dir_free_destroy(dir_free_t *f){
+	for(int k = 0; k <= CT_DIRENT_MAX_SLOTS; k++){
+		free(f->slot[k]);
+	}
+	free(f);
+}
+
+/* @return 0 if success, -1 if out of memory */
+static int dir_free_push(dir_free_t *f, uint32_t slot, uint32_t k){
+	if(f->count[k] == f->cap[k]){
+		uint32_t cap = f->cap[k] ? 2 * f->cap[k] : 64;
+		uint32_t *s = realloc(f->slot[k], cap * sizeof(uint32_t));
+		if(s == NULL){
+			return -1;
+		}
+		f->slot[k] = s;
+		f->cap[k] = cap;
+	}
+	f->slot[k][f->count[k]++] = slot;
+	f->nfree += k;
+	return 0;
+}
+
+/* the free dirents of a large directory,
+ * built if not there
+ * @param[in] dir, rt locked
+ * @param[out] built, set if built by this call
+ * @return NULL if small or out of memory
+ */
+static dir_free_t* dir_free_get(ct_inode_pt dir, int *built){
+	uint64_t nd = dir->i_size / sizeof(ct_dirent_t);
+	dir_free_t *f = DIR_FREE_OF(dir->i_number);
+	*built = 0;
+	if(f != NULL && f->ino == dir->i_number){
+		return f;
+	}
+	if(nd <= CT_DIR_HASH_MIN){
+		return NULL;
+	}
+	if(f != NULL){
+		dir_free_destroy(f);
+		DIR_FREE_OF(dir->i_number) = NULL;
+	}
+	f = calloc(1, sizeof(dir_free_t));
+	if(f == NULL){
+		return NULL;
+	}
+	f->ino = dir->i_number;
+	ct_dirent_pt d = CT_REL2ABS(dir->i_block);
+	for(uint64_t i = 2; i < nd; i += CT_DIRENT_NSLOT(&d[i])){
+		uint32_t k = CT_DIRENT_NSLOT(&d[i]);
+		if(d[i].d_ino == 0 && k <= CT_DIRENT_MAX_SLOTS && dir_free_push(f, i, k)){
+			dir_free_destroy(f);
+			return NULL;
+		}
+	}
+	DIR_FREE_OF(dir->i_number) = f;
+	*built = 1;
+	return f;
+}
+
+/* take a free entry of at least n slots,
+ * cut to n slots
+ * @param[in] dir, rt locked
+ * @param[in] n
+ * @return first slot, -1 if none
+ */
+int64_t dir_free_take(ct_inode_pt dir, uint32_t n){
+	uint64_t nd = dir->i_size / sizeof(ct_dirent_t);
+	ct_dirent_pt d = CT_REL2ABS(dir->i_block);
+	int built;
+	dir_free_t *f = dir_free_get(dir, &built);
+	if(f == NULL){
+		for(uint64_t i = 2; i < nd; i += CT_DIRENT_NSLOT(&d[i])){
+			if(d[i].d_ino == 0 && CT_DIRENT_NSLOT(&d[i]) >= n){
+				dir_split(&d[i], n);
+				return i;
+			}
+		}
+		return -1;
+	}
+	// the smallest that fits
+	for(uint32_t k = n; k <= CT_DIRENT_MAX_SLOTS; k++){
+		while(f->count[k]){
+			uint32_t slot = f->slot[k][--f->count[k]];
+			f->nfree -= k;
+			if(slot + k > nd || d[slot].d_ino != 0 || CT_DIRENT_NSLOT(&d[slot]) != k){
+				continue;
+			}
+			if(k > n){
+				dir_split(&d[slot], n);
+				dir_free_push(f, slot + n, k - n);
+			}
+			return slot;
+		}
+	}
+	return -1;
+}
+
+/* record a dirent freed in a large directory,
+ * and queue the directory for the compactor
+ * once it is mostly free
+ * @param[in] dir, rt locked
+ * @param[in] slot, d_ino already cleared
+ */
+void dir_free_put(ct_inode_pt dir, uint64_t slot){
+	uint64_t nd = dir->i_size / sizeof(ct_dirent_t);
+	ct_dirent_pt d = CT_REL2ABS(dir->i_block);
+	int built;
+	dir_free_t *f = dir_free_get(dir, &built);
+	if(f == NULL){
+		return;
+	}
+	if(!built && dir_free_push(f, slot, CT_DIRENT_NSLOT(&d[slot]))){
+		// out of memory, rebuilt on next use
+		dir_free_forget(dir->i_number);
+		return;
+	}
+	if(f->queued || (nd - f->nfree) * CT_DIR_COMPACT_SPARSE >= nd){
+		return;
+	}
+	bitlock_acquire(&ct_rt.dir_sparse_lock, 0);
+	if(ct_rt.dir_sparse_n < CT_DIR_COMPACT_QUEUE){
+		ct_rt.dir_sparse[ct_rt.dir_sparse_n++] = dir->i_number;
+		f->queued = 1;
+	}
+	bitlock_release(&ct_rt.dir_sparse_lock, 0);
+}
+
+/* drop the free dirents of a directory that
+ * is removed or repacked
+ * @param[in] ino, rt locked
+ */
+void dir_free_forget(index_t ino){
+	dir_free_t *f = DIR_FREE_OF(ino);
+	if(f != NULL && f->ino == ino){
+		dir_free_destroy(f);
+		DIR_FREE_OF(ino) = NULL;
+	}
+}
+
+/* pack the live dirents of a sparse directory
+ * into a new page group sized for them. Skipped
+ * while the directory is open, since readdir
+ * keeps a slot offset.
+ * @param[in] ino
+ * @return 1 if compacted, 0 if not
+ */
+int dir_compact(index_t ino){
+	ct_inode_pt dir = &ct_rt.inode_start[ino];
+	ct_dirent_pt d;
+	uint64_t nd, live = 0, n = 0, i;
+	int ret = 0;
+	inode_rt_lock(ino);
+	// readdir holds it shared
+	inode_rw_lock(ino);
+	dir_free_t *f = DIR_FREE_OF(ino);
+	if(f != NULL && f->ino == ino){
+		f->queued = 0;
+	}
+	// it may have been removed meanwhile
+	if(!((((uint64_t*)ct_rt.inode_bmp)[ino / 64] >> (ino % 64)) & 0b01) ||
+		(dir->i_mode & S_IFMT) != S_IFDIR || dir->i_level == PGG_LVL_NONE){
+		goto out;
+	}
+	for(int fd = 0; fd < CT_MAX_FD; fd++){
+		if(ct_rt.fd[fd].inode == dir){
+			goto out;
+		}
+	}
+	nd = dir->i_size / sizeof(ct_dirent_t);
+	d = CT_REL2ABS(dir->i_block);
+	for(i = 0; i < nd; i += CT_DIRENT_NSLOT(&d[i])){
+		if(d[i].d_ino != 0){
+			live += CT_DIRENT_NSLOT(&d[i]);
+		}
+	}
+	if(live * CT_DIR_COMPACT_SPARSE >= nd){
+		goto out;
+	}
+	int hashed = live > CT_DIR_HASH_MIN;
+	size_t need = live * sizeof(ct_dirent_t);
+	pgg_level_t lvl = pgg_get_lvl(need);
+	while(need > dir_space(lvl, hashed)){
+		lvl ++;
+	}
+	relptr_t blk = pgg_allocate(lvl);
+	if(blk == 0){
+		goto out;
+	}
+	ct_dirent_pt to = CT_REL2ABS(blk);
+	for(i = 0; i < nd; i += CT_DIRENT_NSLOT(&d[i])){
+		if(d[i].d_ino == 0){
+			continue;
+		}
+		if(i >= 2){
+			// cached slots move
+			dcache_invalidate(ino, d[i].d_name, d[i].d_namelen);
+		}
+		memcpy(&to[n], &d[i], CT_DIRENT_NSLOT(&d[i]) * sizeof(ct_dirent_t));
+		n += CT_DIRENT_NSLOT(&d[i]);
+	}
+	cache_wb(to, n * sizeof(ct_dirent_t));
+	_mm_sfence();
+	relptr_t old = dir->i_block;
+	pgg_level_t old_lvl = dir->i_level;
+	dir->i_hash_bits = 0;
+	dir->i_block = blk;
+	dir->i_level = lvl;
+	dir->i_size = n * sizeof(ct_dirent_t);
+	inode_wb(dir);
+	_mm_sfence();
+	// runs on the defragmenter, keep it out of its magazine
+	pgg_deallocate_direct(old_lvl, old);
+	if(hashed){
+		dir_index_build(dir);
+	}
+	dir_free_forget(ino);
+	ret = 1;
+out:
+	inode_rw_unlock(ino);
+	inode_rt_unlock(ino);
+	return ret;
+}
+
+/* compact the directories queued so far
+ * @return number compacted
+ */
+uint64_t dir_compact_pending(){
+	index_t queue[CT_DIR_COMPACT_QUEUE];
+	uint64_t n, done = 0;
+	bitlock_acquire(&ct_rt.dir_sparse_lock, 0);
+	n = ct_rt.dir_sparse_n;
+	memcpy(queue, ct_rt.dir_sparse, n * sizeof(index_t));
+	ct_rt.dir_sparse_n = 0;
+	bitlock_release(&ct_rt.dir_sparse_lock, 0);
+	for(uint64_t i = 0; i < n; i++){
+		done += dir_compact(queue[i]);
+	}
+	return done;
+}
+
+/*****************************
+ *
+ * Dentry cache. Volatile, per process.
+ * Maps (parent inode, name) to the dirent
+ * slot of name, or to "does not exist".
+ * Lookups and fills happen under the rt lock
+ * of the parent, and every change to the
+ * dirents of a parent drops its entries
+ * through dir_index_add/dir_index_del, so a 
+ * hit is always current. The set lock only 
+ * guards the entries of unrelated parents
+ * sharing a set.
+ *
+ ****************************/
+
+void dcache_init(){
+	ct_rt.dcache = calloc(CT_DCACHE_SETS * CT_DCACHE_WAYS, sizeof(ct_dentry_t));
+	ct_rt.dcache_clock = calloc(CT_DCACHE_SETS, sizeof(uint8_t));
+	if(ct_rt.dcache == NULL || ct_rt.dcache_clock == NULL){
+		// run without it
+		free(ct_rt.dcache);
+		free(ct_rt.dcache_clock);
+		ct_rt.dcache = NULL;
+		ct_rt.dcache_clock = NULL;
+	}
+	memset(ct_rt.dcache_lock, 0, sizeof(ct_rt.dcache_lock));
+}
+
+static inline int dcache_cacheable(const char *name, size_t len){
+	if(ct_rt.dcache == NULL || len == 0 || len > CT_DCACHE_NAME){
+		return 0;
+	}
+	// "." and ".." are found in place
+	return !(name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')));
+}
+
+static inline uint64_t dcache_set(index_t parent, const char *name, size_t len){
+	return (dir_name_hash(name, len) ^ (parent * 0x9e3779b97f4a7c15)) % CT_DCACHE_SETS;
+}
+
+static inline ct_dentry_t* dcache_find(ct_dentry_t *set, index_t parent, const char *name, size_t len){
+	for(int w = 0; w < CT_DCACHE_WAYS; w++){
+		if(set[w].parent == parent && set[w].len == len && memcmp(set[w].name, name, len) == 0){
+			return &set[w];
+		}
+	}
+	return NULL;
+}
+
+/* @param[in] parent, rt locked
+ * @param[in] name, not necessarily terminated
+ * @param[in] len, length of name
+ * @param[out] ino, slot: the cached dirent
+ * @return 1 if found, 0 if known not to exist,
+ *         -1 if not cached
+ */
+int dcache_lookup(index_t parent, const char *name, size_t len, index_t *ino, uint32_t *slot){
+	if(!dcache_cacheable(name, len)){
+		return -1;
+	}
+	uint64_t s = dcache_set(parent, name, len);
+	int ret = -1;
+	bitlock_acquire(ct_rt.dcache_lock, s);
+	ct_dentry_t *e = dcache_find(&ct_rt.dcache[s * CT_DCACHE_WAYS], parent, name, len);
+	if(e){
+		*ino = e->ino;
+		*slot = e->slot;
+		ret = (e->ino != 0);
+	}
+	bitlock_release(ct_rt.dcache_lock, s);
+	return ret;
+}
+
+/* cache the result of a directory lookup
+ * @param[in] parent, rt locked
+ * @param[in] name, len
+ * @param[in] ino, 0 if name does not exist
+ * @param[in] slot, dirent slot of name
+ */
+void dcache_insert(index_t parent, const char *name, size_t len, index_t ino, uint32_t slot){
+	if(!dcache_cacheable(name, len)){
+		return;
+	}
+	uint64_t s = dcache_set(parent, name, len);
+	ct_dentry_t *set = &ct_rt.dcache[s * CT_DCACHE_WAYS];
+	bitlock_acquire(ct_rt.dcache_lock, s);
+	ct_dentry_t *e = dcache_find(set, parent, name, len);
+	for(int w = 0; e == NULL && w < CT_DCACHE_WAYS; w++){
+		if(set[w].parent == 0){
+			e = &set[w];
+		}
+	}
+	if(e == NULL){
+		e = &set[ct_rt.dcache_clock[s]++ % CT_DCACHE_WAYS];
+	}
+	e->parent = parent;
+	e->ino = ino;
+	e->slot = slot;
+	e->len = len;
+	memcpy(e->name, name, len);
+	bitlock_release(ct_rt.dcache_lock, s);
+}
+
+/* drop the entry of a name about to be 
+ * added to or removed from parent
+ * @param[in] parent, rt locked
+ * @param[in] name, len
+ */
+void dcache_invalidate(index_t parent, const char *name, size_t len){
+	if(!dcache_cacheable(name, len)){
+		return;
+	}
+	uint64_t s = dcache_set(parent, name, len);
+	bitlock_acquire(ct_rt.dcache_lock, s);
+	ct_dentry_t *e = dcache_find(&ct_rt.dcache[s * CT_DCACHE_WAYS], parent, name, len);
+	if(e){
+		e->parent = 0;
+	}
+	bitlock_release(ct_rt.dcache_lock, s);
+}
@@ -56,6 +56,10 @@ typedef pgg_subpmd_header_t* pgg_subpmd_header_pt;
 #define PGG_LVL8        8
 #define PGG_LVL9        9
 #define PGG_LVL10       10
+/* Levels above 9 are runs of (level - 8)
+ * contiguous L9s, for files > 512G.
+ */
+#define PGG_LVL_MAX     (PGG_LVL8 + (pgg_level_t)(CT_DAX_ALLOC_SIZE / CT_PGGSIZE_LV9))
 #define PGG_LVL_NONE    -1
 
 
@@ -108,11 +112,16 @@ struct pgg_header {
      * Indicating the largest 
      * page group it is able 
      * to allocate.
+     * Not maintained any more, the 
+     * DRAM index (ct_rt.pgg_free) is
+     * rebuilt from state_map at init.
      */
     pgg_level_t     cap_lvl;
     /* Indicating the capability 
      * of sub-PMD allocation. 
      * 4-bit preferred + 4-bit available.
+     * Not maintained any more, see 
+     * ct_rt.pgg_pkg.
      */
     uint8_t     sub_pmd_cap;
     /* (Only in L4 header) Indicating 
@@ -181,6 +190,8 @@ typedef pgg_hd_group_t* pgg_hd_group_pt;
  * metadata mirror    (512B - 1k)
  * allocation protector (1K - 2K)
  * lvl9 pgg bit map   (2K - 4K)
+ *  one bit per 512G of the window, set if
+ *  the L9 is a pgg tree or part of a file
  ******************************************/
 
 /* Super block
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include "ctfs.h"
 #include "ctfs_pgg.h"
 #include "ctfs_runtime.h"
@@ -6,19 +7,6 @@
 #ifdef CTFS_DEBUG
 int ctfs_pause = 1;
 #endif
-static inline void big_memcpy(void *dest, const void *src, size_t n)
-{
-	long d0, d1, d2;
-	asm volatile(
-		"rep ; movsq\n\t"
-		"movq %4,%%rcx\n\t"
-		"rep ; movsb\n\t"
-		: "=&c" (d0), "=&D" (d1), "=&S" (d2)
-		: "0" (n >> 3), "g" (n & 7), "1" (dest), "2" (src)
-		: "memory");
-
-}
-
 static inline void *intel_memcpy(void * __restrict__ b, const void * __restrict__ a, size_t n){
 	char *s1 = b;
 	const char *s2 = a;
@@ -73,6 +61,10 @@ int ctfs_mkfs(int flag){
 	ct_rt.inode_bmp = CT_REL2ABS(CT_OFFSET_IBMP);
 	ct_rt.inode_start = CT_REL2ABS(CT_OFFSET_ITABLE);
 	ctfs_lock_init(ct_rt.inode_bmp_lock);
+	if(inode_index_rebuild()){
+		dax_end();
+		return -1;
+	}
 
 	// allocate inode
 	index_t root_i = inode_alloc();
@@ -83,6 +75,7 @@ int ctfs_mkfs(int flag){
 	// ct_inode_pt root = &ct_rt.inode_start[root_i];
 	// fill the inode
 	inode_set_root();
+	inode_pool_drain();
 
 
 	dax_end();
@@ -91,6 +84,7 @@ int ctfs_mkfs(int flag){
 
 int ctfs_init(int flag){
 	memset(&ct_rt, 0, sizeof(ct_rt));
+	ct_rt.mount_flags = flag;
 	dax_ioctl_init_t frame = {.size = CT_DAX_ALLOC_SIZE};
 	ct_rt.base_addr = (uint64_t)dax_start("/dev/dax0.0", &frame);
 	ct_rt.super_blk = (ct_super_blk_pt)(ct_rt.base_addr);
@@ -109,6 +103,17 @@ int ctfs_init(int flag){
 	ct_rt.current_dir = &ct_rt.inode_start[ct_rt.super_blk->root_inode];
 	ctfs_lock_init(ct_rt.open_lock);
 	ctfs_lock_init(ct_rt.inode_bmp_lock);
+	// groups a crash left taken go back before the index is built
+	if(inode_index_rebuild() || inode_reclaim_groups() || pgg_index_rebuild()){
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		return -1;
+	}
+	dcache_init();
+	cpy_init();
+	// mapped files and read views, threads
+	// created later inherit it
+	dax_grant_access(ct_rt.mpk[DAX_MPK_FILE]);
+	dax_stop_write(ct_rt.mpk[DAX_MPK_VIEW]);
 	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
 	return 0;
 }
@@ -255,6 +260,36 @@ int ctfs_close(int fd){
 	return 0;
 }
 
+/* data and metadata reach pmem as they are
+ * written, only lazy times may be pending
+ */
+int ctfs_fsync(int fd){
+	if(fd >= CT_MAX_FD || ct_rt.fd[fd].inode == NULL){
+		ct_rt.errorn = EBADF;
+		return -1;
+	}
+	if(ct_rt.mount_flags & CTFS_INIT_FLAG_LAZYTIME){
+		dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		inode_lazy_flush(ct_rt.fd[fd].inode->i_number);
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	}
+	return 0;
+}
+
+/* write back everything still in DRAM and
+ * return pooled inodes and page groups,
+ * for a clean exit
+ */
+void ctfs_sync(){
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	if(ct_rt.mount_flags & CTFS_INIT_FLAG_LAZYTIME){
+		inode_lazy_flush_all();
+	}
+	inode_pool_drain();
+	pgg_mag_flush_all();
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+}
+
 ssize_t  ctfs_pread(int fd, void *buf, size_t count, off_t offset){
 	if(fd >= CT_MAX_FD || ct_rt.fd[fd].inode == NULL){
 		ct_rt.errorn = EBADF;
@@ -269,31 +304,54 @@ ssize_t  ctfs_pread(int fd, void *buf, size_t count, off_t offset){
 #ifdef CTFS_DEBUG
 	ct_inode_t ino = *ct_rt.fd[fd].inode;
 #endif
-	inode_rw_lock(inode_n);
-	if(offset >= ct_rt.fd[fd].inode->i_size){
-		inode_rw_unlock(inode_n);
-		return 0;
-	}
-	else if(offset + count >= ct_rt.fd[fd].inode->i_size){
-		count = ct_rt.fd[fd].inode->i_size - offset;
-	}
-	
-	void* target = CT_REL2ABS(ct_rt.fd[fd].inode->i_block);
+	ct_inode_pt inode = ct_rt.fd[fd].inode;
+	size_t size, n;
+	relptr_t block;
+	uint32_t seq = 0;
+	/* optimistic: snapshot the size and page group,
+	 * copy, and redo it if a resize or write raced.
+	 * The read is announced first, so a group moved
+	 * or freed meanwhile is copied, not swapped, and
+	 * not reused before the copy is done.
+	 */
+	int announced = (view_read_begin(inode_n) == 0);
+	int tries = announced ? 0 : CT_PREAD_RETRY;
+	while(1){
+		if(unlikely(tries == CT_PREAD_RETRY)){
+			inode_rw_lock_shared(inode_n);
+		}
+		else{
+			seq = inode_read_begin(inode_n);
+		}
+		size = *(volatile size_t*)&inode->i_size;
+		block = *(volatile relptr_t*)&inode->i_block;
+		n = 0;
+		// a torn snapshot must still stay in the mapping
+		if(offset < size && likely(block + size <= CT_DAX_ALLOC_SIZE)){
+			n = (offset + count >= size) ? size - offset : count;
+			void* target = CT_REL2ABS(block);
 #ifdef CTFS_DEBUG
-	timer_start();
+			timer_start();
 #endif
-	if(count > PMD_SIZE){
-		big_memcpy(buf, target + offset, count);
-	}
-	else{
-		memcpy(buf, target + offset, count);
-	}
+			cpy_read(buf, target + offset, n);
 #ifdef CTFS_DEBUG
-	ct_rt.fd[fd].cpy_time += timer_end();
+			ct_rt.fd[fd].cpy_time += timer_end();
 #endif
-	inode_rw_unlock(inode_n);
+		}
+		if(unlikely(tries == CT_PREAD_RETRY)){
+			inode_rw_unlock_shared(inode_n);
+			break;
+		}
+		if(likely(!inode_read_retry(inode_n, seq))){
+			break;
+		}
+		tries ++;
+	}
+	if(likely(announced)){
+		view_read_end();
+	}
 	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
-	return count;
+	return n;
 }
 
 
@@ -319,7 +377,13 @@ static inline ssize_t  ctfs_pwrite_normal(int fd, const void *buf, size_t count,
 		printf("RESIZE! %lu -> %lu", ct_rt.fd[fd].inode->i_size, end);
 		timer_start();
 #endif
-		if(inode_resize(ct_rt.fd[fd].inode, offset + count)){
+		int res = inode_resize(ct_rt.fd[fd].inode, offset + count);
+		if(unlikely(res < 0)){
+			inode_rw_unlock(inode_n);
+			dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+			return -1;
+		}
+		if(res){
 			ct_rt.fd[fd].prefaulted_bytes = 0;
 		}
 #if CTFS_DEBUG > 2
@@ -334,7 +398,10 @@ static inline ssize_t  ctfs_pwrite_normal(int fd, const void *buf, size_t count,
 #ifdef CTFS_DEBUG
 	timer_start();
 #endif
+	// pages under read views are write protected
+	int granted = mmap_write_begin(inode_n);
 	avx_cpy(addr_base + offset, buf, count);
+	mmap_write_end(granted);
 #ifdef CTFS_DEBUG
 	ct_rt.fd[fd].cpy_time += timer_end();
 #endif
@@ -384,7 +451,13 @@ static inline ssize_t  ctfs_pwrite_atomic(int fd, const void *buf, size_t count,
 		printf("RESIZE! %lu -> %lu", ct_rt.fd[fd].inode->i_size, end);
 		timer_start();
 #endif
-		if(inode_resize(ct_rt.fd[fd].inode, offset + count)){
+		int res = inode_resize(ct_rt.fd[fd].inode, offset + count);
+		if(unlikely(res < 0)){
+			inode_rw_unlock(inode_n);
+			dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+			return -1;
+		}
+		if(res){
 			ct_rt.fd[fd].prefaulted_bytes = 0;
 		}
 #if CTFS_DEBUG > 4
@@ -409,7 +482,9 @@ static inline ssize_t  ctfs_pwrite_atomic(int fd, const void *buf, size_t count,
 #ifdef CTFS_ATOMIC_WRITE_USE_UNDO
 	// if the writing is small, use undo log
 	if(count <= 4096 * 4){
+		int granted = mmap_write_begin(inode_n);
 		ctfs_pwrite_atomic_cpy(ct_rt.fd[fd].inode, base, staging, buf, count, offset);
+		mmap_write_end(granted);
 		goto out;
 	}
 #endif
@@ -533,6 +608,159 @@ ssize_t  ctfs_read(int fd, void *buf, size_t count){
 	return ret;
 }
 
+/* bytes in an iovec array
+ * @return the sum, -1 if invalid
+ */
+static ssize_t ctfs_iov_total(const struct iovec *iov, int iovcnt){
+	size_t total = 0;
+	if(unlikely(iovcnt < 0 || iovcnt > UIO_MAXIOV)){
+		ct_rt.errorn = EINVAL;
+		return -1;
+	}
+	for(int i = 0; i < iovcnt; i++){
+		total += iov[i].iov_len;
+		if(unlikely(total > SSIZE_MAX)){
+			ct_rt.errorn = EINVAL;
+			return -1;
+		}
+	}
+	return total;
+}
+
+/* pread into several buffers, with one
+ * snapshot of the file for all of them
+ */
+ssize_t ctfs_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset){
+	if(fd >= CT_MAX_FD || ct_rt.fd[fd].inode == NULL){
+		ct_rt.errorn = EBADF;
+		return -1;
+	}
+	if(ct_rt.fd[fd].flags & O_WRONLY){
+		ct_rt.errorn = EBADF;
+		return -1;
+	}
+	if(ctfs_iov_total(iov, iovcnt) < 0){
+		return -1;
+	}
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	ct_inode_pt inode = ct_rt.fd[fd].inode;
+	ino_t inode_n = inode->i_number;
+	size_t size, n;
+	relptr_t block;
+	uint32_t seq = 0;
+	// as ctfs_pread, redone as a whole if raced
+	int announced = (view_read_begin(inode_n) == 0);
+	int tries = announced ? 0 : CT_PREAD_RETRY;
+	while(1){
+		if(unlikely(tries == CT_PREAD_RETRY)){
+			inode_rw_lock_shared(inode_n);
+		}
+		else{
+			seq = inode_read_begin(inode_n);
+		}
+		size = *(volatile size_t*)&inode->i_size;
+		block = *(volatile relptr_t*)&inode->i_block;
+		n = 0;
+		if(offset < size && likely(block + size <= CT_DAX_ALLOC_SIZE)){
+			void *target = CT_REL2ABS(block) + offset;
+			size_t avail = size - offset;
+			for(int i = 0; i < iovcnt && n < avail; i++){
+				size_t seg = (iov[i].iov_len < avail - n) ? iov[i].iov_len : avail - n;
+				cpy_read(iov[i].iov_base, target + n, seg);
+				n += seg;
+			}
+		}
+		if(unlikely(tries == CT_PREAD_RETRY)){
+			inode_rw_unlock_shared(inode_n);
+			break;
+		}
+		if(likely(!inode_read_retry(inode_n, seq))){
+			break;
+		}
+		tries ++;
+	}
+	if(likely(announced)){
+		view_read_end();
+	}
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	return n;
+}
+
+/* pwrite from several buffers. The lock is
+ * taken and the file resized once per call.
+ */
+ssize_t ctfs_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset){
+	if(unlikely(fd >= CT_MAX_FD || ct_rt.fd[fd].inode == NULL)){
+		ct_rt.errorn = EBADF;
+		return -1;
+	}
+	if(unlikely((ct_rt.fd[fd].flags & (O_WRONLY | O_RDWR)) == 0)){
+		ct_rt.errorn = EBADF;
+		return -1;
+	}
+	ssize_t count = ctfs_iov_total(iov, iovcnt);
+	if(count <= 0){
+		return count;
+	}
+#ifdef CTFS_ATOMIC_WRITE
+	// gather, so the whole vector is swapped in at once
+	char *buf = malloc(count);
+	if(unlikely(buf == NULL)){
+		ct_rt.errorn = ENOMEM;
+		return -1;
+	}
+	size_t n = 0;
+	for(int i = 0; i < iovcnt; i++){
+		memcpy(buf + n, iov[i].iov_base, iov[i].iov_len);
+		n += iov[i].iov_len;
+	}
+	count = ctfs_pwrite_atomic(fd, buf, count, offset);
+	free(buf);
+	return count;
+#else
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	ino_t inode_n = ct_rt.fd[fd].inode->i_number;
+	inode_rw_lock(inode_n);
+	if(unlikely(offset + count > ct_rt.fd[fd].inode->i_size)){
+		int res = inode_resize(ct_rt.fd[fd].inode, offset + count);
+		if(unlikely(res < 0)){
+			inode_rw_unlock(inode_n);
+			dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+			return -1;
+		}
+		if(res){
+			ct_rt.fd[fd].prefaulted_bytes = 0;
+		}
+	}
+	void *addr = CT_REL2ABS(ct_rt.fd[fd].inode->i_block) + offset;
+	int granted = mmap_write_begin(inode_n);
+	for(int i = 0; i < iovcnt; i++){
+		avx_cpy(addr, iov[i].iov_base, iov[i].iov_len);
+		addr += iov[i].iov_len;
+	}
+	mmap_write_end(granted);
+	inode_rw_unlock(inode_n);
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	return count;
+#endif
+}
+
+ssize_t ctfs_readv(int fd, const struct iovec *iov, int iovcnt){
+	ssize_t ret = ctfs_preadv(fd, iov, iovcnt, ct_rt.fd[fd].offset);
+	if(ret >0){
+		ct_rt.fd[fd].offset += ret;
+	}
+	return ret;
+}
+
+ssize_t ctfs_writev(int fd, const struct iovec *iov, int iovcnt){
+	ssize_t ret = ctfs_pwritev(fd, iov, iovcnt, ct_rt.fd[fd].offset);
+	if(ret >0){
+		ct_rt.fd[fd].offset += ret;
+	}
+	return ret;
+}
+
 int ctfs_mkdir(const char *pathname, uint16_t mode){
 	mode |= S_IFDIR;
 	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
@@ -548,6 +776,42 @@ int ctfs_mkdir(const char *pathname, uint16_t mode){
 	return ret;
 }
 
+/* create many regular files in one
+ * directory in a single pass
+ * @param[in] dirpath, the directory
+ * @param[in] names, file names, no '/'
+ * @param[in] count, number of names
+ * @param[in] size, initial size of each file
+ * @return number of files created, the first ones
+ *         in names; -1 if none could be attempted
+ */
+int ctfs_create_many(const char *dirpath, const char *const *names, int count, off_t size){
+	if(dirpath == NULL || names == NULL || count < 0 || size < 0){
+		ct_rt.errorn = EINVAL;
+		return -1;
+	}
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	ct_inode_frame_t frame = {.path = dirpath, 
+		.inode_start = ct_rt.current_dir, 
+		.flag = 0};
+	int ret = inode_path2inode(&frame);
+	if(ret){
+		ct_rt.errorn = ret;
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		return -1;
+	}
+	if((frame.current->i_mode & S_IFMT) != S_IFDIR){
+		ct_rt.errorn = ENOTDIR;
+		ret = -1;
+	}
+	else{
+		ret = (int)inode_create_many(frame.current, names, (uint32_t)count, (size_t)size);
+	}
+	inode_rt_unlock(frame.current->i_number);
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	return ret;
+}
+
 void print_debug(int fd){
 #ifdef CTFS_DEBUG
 	printf("cpy took %lu ns, pswap took %lu ns\n", 
@@ -581,7 +845,11 @@ int ctfs_fallocate(int fd, int mode, off_t offset, off_t len){
 	uint64_t end = offset + len;
 	if(end > ct_rt.fd[fd].inode->i_size){
 		size_t old = ct_rt.fd[fd].inode->i_size;
-		inode_resize(ct_rt.fd[fd].inode, end);
+		if(inode_resize(ct_rt.fd[fd].inode, end) < 0){
+			inode_rw_unlock(inode_n);
+			dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+			return -1;
+		}
 		if(mode & FALLOC_FL_KEEP_SIZE){
 			ct_rt.fd[fd].inode->i_size = old;
 		}
@@ -604,13 +872,17 @@ int ctfs_truncate(const char *path, off_t length){
 	res = inode_path2inode(&frame);
 	if(res){
 		ct_rt.errorn = res;
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
 		return -1;
 	}
-	if(length > frame.current->i_size){
-		inode_resize(frame.current, length);
-	}
-	else{
-		frame.current->i_size = length;
+	// the path walk returns the rt lock
+	inode_rw_lock(frame.current->i_number);
+	inode_rt_unlock(frame.current->i_number);
+	// shrinks the page group too if it dropped enough
+	if(inode_resize(frame.current, length) < 0){
+		inode_rw_unlock(frame.current->i_number);
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		return -1;
 	}
 	inode_wb(frame.current);
 	inode_rw_unlock(frame.current->i_number);
@@ -632,12 +904,13 @@ int ctfs_ftruncate(int fd, off_t len){
 	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
 	ino_t inode_n = ct_rt.fd[fd].inode->i_number;
 	inode_rw_lock(inode_n);
-	if(len > ct_rt.fd[fd].inode->i_size){
-		inode_resize(ct_rt.fd[fd].inode, len);
-	}
-	else{
-		ct_rt.fd[fd].inode->i_size = len;
+	// shrinks the page group too if it dropped enough
+	if(inode_resize(ct_rt.fd[fd].inode, len) < 0){
+		inode_rw_unlock(inode_n);
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		return -1;
 	}
+	ct_rt.fd[fd].prefaulted_bytes = 0;
 	inode_wb(ct_rt.fd[fd].inode);
 	inode_rw_unlock(inode_n);
 	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
@@ -688,6 +961,8 @@ int ctfs_rename(const char *oldpath, const char *newpath){
 	// ino_t old_num = frame.parent->i_number;
 	// ct_dirent_pt old_dir = frame.dirent;
 	frame.dirent->d_ino = 0;
+	cache_wb_one(&frame.dirent->d_ino);
+	dir_index_del(frame.parent, frame.dirent);
 	frame.parent->i_ndirent --;
 	ct_time_stamp(&frame.parent->i_mtim);
 	inode_rt_unlock(frame.parent->i_number);
@@ -750,12 +1025,12 @@ struct dirent * ctfs_readdir(DIR *dirp){
 		return NULL;
 	}
 	ino_t inode_n = ct_rt.fd[fd].inode->i_number;
-	inode_rw_lock(inode_n);
+	inode_rw_lock_shared(inode_n);
 	size_t dirent_size = ct_rt.fd[fd].inode->i_size / sizeof(ct_dirent_t);
 	ct_dirent_pt target = CT_REL2ABS(ct_rt.fd[fd].inode->i_block);
 	while(1){
 		if(ct_rt.fd[fd].offset >= dirent_size){
-			inode_rw_unlock(inode_n);
+			inode_rw_unlock_shared(inode_n);
 			dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
 			return NULL;
 		}
@@ -766,15 +1041,18 @@ struct dirent * ctfs_readdir(DIR *dirp){
 		if(target[ct_rt.fd[fd].offset].d_ino != 0){
 			break;
 		} 
-		ct_rt.fd[fd].offset++;
-	}
-	ct_rt.fd[fd].temp_dirent.d_ino = target[ct_rt.fd[fd].offset].d_ino;
-	ct_rt.fd[fd].temp_dirent.d_off = target[ct_rt.fd[fd].offset].d_off;
-	ct_rt.fd[fd].temp_dirent.d_reclen = target[ct_rt.fd[fd].offset].d_reclen;
-	ct_rt.fd[fd].temp_dirent.d_type = target[ct_rt.fd[fd].offset].d_type;
-	strcpy(ct_rt.fd[fd].temp_dirent.d_name, target[ct_rt.fd[fd].offset].d_name);
-	ct_rt.fd[fd].offset++;
-	inode_rw_unlock(inode_n);
+		// offsets are always the first slot of an entry
+		ct_rt.fd[fd].offset += CT_DIRENT_NSLOT(&target[ct_rt.fd[fd].offset]);
+	}
+	ct_dirent_pt d = &target[ct_rt.fd[fd].offset];
+	ct_rt.fd[fd].offset += CT_DIRENT_NSLOT(d);
+	ct_rt.fd[fd].temp_dirent.d_ino = d->d_ino;
+	ct_rt.fd[fd].temp_dirent.d_off = ct_rt.fd[fd].offset;
+	ct_rt.fd[fd].temp_dirent.d_reclen = sizeof(struct dirent);
+	ct_rt.fd[fd].temp_dirent.d_type = d->d_type;
+	memcpy(ct_rt.fd[fd].temp_dirent.d_name, d->d_name, d->d_namelen);
+	ct_rt.fd[fd].temp_dirent.d_name[d->d_namelen] = '\0';
+	inode_rw_unlock_shared(inode_n);
 	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
 	return &ct_rt.fd[fd].temp_dirent;
 }
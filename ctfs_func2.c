@@ -37,9 +37,7 @@ int ctfs_fstat(int fd, struct stat *buf){
     buf->st_size = c->i_size;
     buf->st_blksize = 4096;
 
-    buf->st_atim = c->i_atim;
-    buf->st_mtim = c->i_mtim;
-    buf->st_ctim = c->i_ctim;
+    inode_get_times(c, &buf->st_atim, &buf->st_mtim, &buf->st_ctim);
     dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
     inode_rt_unlock(inode_n);
     return 0;
@@ -76,9 +74,7 @@ int ctfs_lstat (const char *pathname, struct stat *buf){
     buf->st_size = c->i_size;
     buf->st_blksize = 4096;
 
-    buf->st_atim = c->i_atim;
-    buf->st_mtim = c->i_mtim;
-    buf->st_ctim = c->i_ctim;
+    inode_get_times(c, &buf->st_atim, &buf->st_mtim, &buf->st_ctim);
 
     dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
     inode_rt_unlock(frame.current->i_number);
@@ -171,12 +167,20 @@ int ctfs_unlink (const char *pathname){
     // free the dirent of current pathname
     ct_dirent_pt current_dirent = frame.dirent;
     current_dirent->d_ino = 0;
+    cache_wb_one(&current_dirent->d_ino);
+    if(parent_c != NULL){
+        dir_index_del(parent_c, current_dirent);
+    }
 
     if(c->i_nlink == 1){
-        inode_dealloc(c->i_number);
-        if(c->i_level != PGG_LVL_NONE){
+        // open fds may still take views
+        inode_rw_lock(c->i_number);
+        if(c->i_level != PGG_LVL_NONE && !mmap_orphan(c) &&
+            !view_retire(c->i_number, c->i_level, c->i_block)){
             pgg_deallocate(c->i_level, c->i_block);
         }
+        inode_rw_unlock(c->i_number);
+        inode_dealloc(c->i_number);
     }else{
         ct_time_stamp(&(c->i_mtim));
         c->i_nlink --;
@@ -233,8 +237,20 @@ int ctfs_rmdir(const char *pathname){
     if(parent_c != NULL){
         parent_c->i_ndirent --;
     }
-    inode_dealloc(c->i_number);
     frame.dirent->d_ino = 0;
+    cache_wb_one(&frame.dirent->d_ino);
+    if(parent_c != NULL){
+        dir_index_del(parent_c, frame.dirent);
+    }
+    // readdir on an open fd holds the shared lock
+    inode_rw_lock(c->i_number);
+    if(c->i_level != PGG_LVL_NONE && !mmap_orphan(c) &&
+        !view_retire(c->i_number, c->i_level, c->i_block)){
+        pgg_deallocate(c->i_level, c->i_block);
+    }
+    dir_free_forget(c->i_number);
+    inode_rw_unlock(c->i_number);
+    inode_dealloc(c->i_number);
     
     inode_rt_unlock(frame.current->i_number);
     if((frame.flag & CT_INODE_FRAME_SAME_INODE_LOCK) == 0){
@@ -242,4 +258,27 @@ int ctfs_rmdir(const char *pathname){
     }
     dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
     return 0;
-}
\ No newline at end of file
+}
+
+int ctfs_mag_stat(struct ctfs_mag_stat *stat){
+    pgg_mag_stat_t s;
+    if(stat == NULL){
+        ct_rt.errorn = EINVAL;
+        return -1;
+    }
+    pgg_mag_stat(&s);
+    memcpy(stat->alloc_hit, s.alloc_hit, sizeof(stat->alloc_hit));
+    memcpy(stat->alloc_miss, s.alloc_miss, sizeof(stat->alloc_miss));
+    memcpy(stat->free_hit, s.free_hit, sizeof(stat->free_hit));
+    memcpy(stat->free_flush, s.free_flush, sizeof(stat->free_flush));
+    return 0;
+}
+
+int ctfs_pgg_hist(struct ctfs_pgg_hist *hist){
+    if(hist == NULL){
+        ct_rt.errorn = EINVAL;
+        return -1;
+    }
+    pgg_hist(hist->requests, hist->carved);
+    return 0;
+}
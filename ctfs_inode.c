@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include "ctfs.h"
 #include "ctfs_runtime.h"
 #include "ctfs_pgg.h"
 
@@ -15,39 +18,149 @@ static const ct_inode_t default_inode = {
 
 };
 
+#define INODE_LOCK_OFFSET(n)	(n % CT_INODE_LOCK_SLOTS)
+#define INODE_LOCK(n)			(&ct_rt.inode_lock[INODE_LOCK_OFFSET(n)])
+
+#ifdef CTFS_LOCK_STAT
+#define INODE_LOCK_STAT(l, field, acquire)						\
+	do{															\
+		int waited = acquire;									\
+		if(waited != LOCK_FREE){								\
+			__sync_fetch_and_add(&(l)->stat.field, 1);			\
+		}														\
+		if(waited == LOCK_PARKED){								\
+			__sync_fetch_and_add(&(l)->stat.parked, 1);			\
+		}														\
+	}while(0)
+#else
+#define INODE_LOCK_STAT(l, field, acquire)	((void)(acquire))
+#endif
+
+/* exclusive, for changes of the size or
+ * the page group of an inode. Also bumps the
+ * sequence count of the slot, odd while held,
+ * so optimistic readers retry.
+ */
 void inode_rw_lock(index_t inode_n){
-	bitlock_acquire(ct_rt.inode_rw_lock, inode_n % CT_INODE_RW_SLOTS);
+	inode_lock_t *l = INODE_LOCK(inode_n);
+	INODE_LOCK_STAT(l, rw_wait, rwlock_acquire(&l->rw));
+	__sync_fetch_and_add(&l->seq, 1);
 }
 
 void inode_rw_unlock(index_t inode_n){
-	bitlock_release(ct_rt.inode_rw_lock, inode_n % CT_INODE_RW_SLOTS);
+	inode_lock_t *l = INODE_LOCK(inode_n);
+	__sync_fetch_and_add(&l->seq, 1);
+	rwlock_release(&l->rw);
+}
+
+/* shared, for reading the data or dirents
+ */
+void inode_rw_lock_shared(index_t inode_n){
+	inode_lock_t *l = INODE_LOCK(inode_n);
+	INODE_LOCK_STAT(l, shared_wait, rwlock_acquire_shared(&l->rw));
+}
+
+void inode_rw_unlock_shared(index_t inode_n){
+	rwlock_release_shared(&INODE_LOCK(inode_n)->rw);
+}
+
+/* start an optimistic read, no shared writes.
+ * Waits out an exclusive holder.
+ * @return the sequence count to validate with
+ */
+uint32_t inode_read_begin(index_t inode_n){
+	volatile uint32_t *seq = &INODE_LOCK(inode_n)->seq;
+	uint32_t s;
+	while((s = *seq) & 0b01){
+		_mm_pause();
+	}
+	__asm__ __volatile__("" ::: "memory");
+	return s;
+}
+
+/* @return whether the read raced with an 
+ *         exclusive holder and must be redone
+ */
+int inode_read_retry(index_t inode_n, uint32_t seq){
+	// the copy may use weakly ordered string loads
+	_mm_lfence();
+	return *(volatile uint32_t*)&INODE_LOCK(inode_n)->seq != seq;
 }
 
 void inode_rt_lock(index_t inode_n){
-	bitlock_acquire(ct_rt.inode_rt_lock, inode_n % CT_INODE_BITLOCK_SLOTS);
+	inode_lock_t *l = INODE_LOCK(inode_n);
+	INODE_LOCK_STAT(l, rt_wait, ct_lock_acquire(&l->rt));
 }
 
 void inode_rt_unlock(index_t inode_n){
-	bitlock_release(ct_rt.inode_rt_lock, inode_n % CT_INODE_BITLOCK_SLOTS);
+	ct_lock_release(&INODE_LOCK(inode_n)->rt);
+}
+
+/* the lock slots waited on the most,
+ * needs CTFS_LOCK_STAT
+ * @param[out] slot, slot numbers, hottest first
+ * @param[out] stat, their counters
+ * @param[in] n, size of slot and stat
+ * @return number of slots filled
+ */
+int inode_lock_hottest(index_t *slot, inode_lock_stat_t *stat, int n){
+	int found = 0;
+	for(index_t i = 0; i < CT_INODE_LOCK_SLOTS; i++){
+		inode_lock_stat_t cur = ct_rt.inode_lock[i].stat;
+		uint64_t waits = cur.rt_wait + cur.rw_wait + cur.shared_wait;
+		if(waits == 0){
+			continue;
+		}
+		int pos = found;
+		while(pos > 0 && 
+			stat[pos - 1].rt_wait + stat[pos - 1].rw_wait + stat[pos - 1].shared_wait < waits){
+			if(pos < n){
+				slot[pos] = slot[pos - 1];
+				stat[pos] = stat[pos - 1];
+			}
+			pos --;
+		}
+		if(pos < n){
+			slot[pos] = i;
+			stat[pos] = cur;
+			found += (found < n);
+		}
+	}
+	return found;
 }
 
 inline void inode_wb(ct_inode_pt inode){
 	cache_wb(inode, sizeof(ct_inode_t));
 }
 
-#define INODE_LOCK_OFFSET(n)	(n % CT_INODE_BITLOCK_SLOTS)
-
-int inode_resize_lvl(ct_inode_pt inode, pgg_level_t lvl){
+/* move the file to a page group of
+ * the given level
+ * @param[in] inode
+ * @param[in] lvl, target level
+ * @param[in] keep, bytes to keep when shrinking
+ * @return 1 if moved, 0 if not, -1 if out of space,
+ *         -2 if mapped and grown past its group
+ */
+int inode_resize_lvl(ct_inode_pt inode, pgg_level_t lvl, size_t keep){
 	if(inode->i_level == PGG_LVL_NONE){
 #ifdef CTFS_DEBUG
 		printf("PGG_LVL_NONE case!\n");
 #endif
 		relptr_t blk = pgg_allocate(lvl);
+		if(unlikely(blk == 0)){
+			return -1;
+		}
 		inode->i_block = blk;
 		inode->i_level = lvl;
-		inode->i_size = pgg_size[lvl];
+		inode->i_size = pgg_lvl_size(lvl);
 		return 1;
 	}
+	if(inode->i_level != lvl && inode_mapped(inode->i_number)){
+		// mappings point into the group: a
+		// shrink keeps it, a growth past the
+		// headroom ctfs_mmap reserved fails
+		return (inode->i_level < lvl) ? -2 : 0;
+	}
 	if(inode->i_level < lvl){
 		// upgrade size
 #ifdef CTFS_DEBUG
@@ -55,96 +168,514 @@ int inode_resize_lvl(ct_inode_pt inode, pgg_level_t lvl){
 		ct_inode_t dbg_inode = *inode;
 #endif
 		relptr_t new = pgg_allocate(lvl);
-		dax_ioctl_pswap_t pswap = {
-			.ufirst = CT_REL2ABS(new),
-			.usecond = CT_REL2ABS(inode->i_block),
-			.npgs = pgg_size[inode->i_level] >> 12
-		};
-		dax_pswap(&pswap);
+		if(unlikely(new == 0)){
+			return -1;
+		}
+		view_move(inode->i_number, new, inode->i_block, pgg_lvl_size(inode->i_level) >> 12);
 #ifdef CTFS_DEBUG
 		ct_inode_t dbg_inode2 = *inode;
 #endif
-		pgg_deallocate(inode->i_level, inode->i_block);
+		if(!view_retire(inode->i_number, inode->i_level, inode->i_block)){
+			pgg_deallocate(inode->i_level, inode->i_block);
+		}
 		inode->i_block = new;
-		inode->i_size = pgg_size[lvl];
+		inode->i_size = pgg_lvl_size(lvl);
 		inode->i_level = lvl;
 		cache_wb_one(inode);
 		return 1;
 	}
-	if(inode->i_level > lvl){
-		// do nothing now.
+	if(inode->i_level >= lvl + CT_PGG_SHRINK_GAP){
+		// shrink. Leave one level of headroom so
+		// a file flapping in size doesn't thrash
+		lvl ++;
+		relptr_t old = inode->i_block;
+		relptr_t new = pgg_allocate(lvl);
+		if(unlikely(new == 0)){
+			// keep the large one
+			return 0;
+		}
+		if(keep){
+			view_move(inode->i_number, new, old, (keep + CT_PAGE_SIZE - 1) >> 12);
+		}
+		pgg_level_t old_lvl = inode->i_level;
+		inode->i_block = new;
+		inode->i_level = lvl;
+		cache_wb_one(inode);
+		if(!view_retire(inode->i_number, old_lvl, old)){
+			pgg_deallocate(old_lvl, old);
+		}
+		return 1;
 	}
 	return 0;
 }
 
 int inode_resize(ct_inode_pt inode, size_t size){
 	pgg_level_t lvl = pgg_get_lvl(size);
-#ifdef CTFS_HACK
-	if(lvl < PGG_LVL3){
-		lvl = PGG_LVL3;
+	int ret = 0;
+	if(inode->i_level != PGG_LVL_NONE || size != 0){
+		ret = inode_resize_lvl(inode, lvl, (size < inode->i_size) ? size : inode->i_size);
+	}
+	if(unlikely(ret < 0)){
+		ct_rt.errorn = (ret == -2) ? EFBIG : ENOSPC;
+		return -1;
 	}
-#endif
-	int ret = inode_resize_lvl(inode, lvl);
 	inode->i_size = size;
-	ct_time_stamp(&inode->i_ctim);
-	ct_time_stamp(&inode->i_mtim);
-	inode_wb(inode);
+	if(inode_touch_mtime(inode)){
+		inode_wb(inode);
+	}
+	else{
+		// size and group are in the first line, the times in the second
+		cache_wb_one(inode);
+	}
 	return ret;
 }
 
+/* build the DRAM summary of the
+ * touched part of the inode bitmap
+ * @return 0 if success, -1 otherwise
+ */
+int inode_index_rebuild(){
+	ct_sbmp_destroy(&ct_rt.inode_free);
+	if(ct_sbmp_init(&ct_rt.inode_free, CT_SIZE_MAX_INODE >> 6)){
+		return -1;
+	}
+	ct_sbmp_load_free(&ct_rt.inode_free, ct_rt.inode_bmp, 
+		ct_super->inode_bmp_touched >> 6);
+	return 0;
+}
+
+/* free the page groups no inode references,
+ * see pgg_reclaim. Called at init, before
+ * pgg_index_rebuild.
+ * @return 0 if success, -1 otherwise
+ */
+int inode_reclaim_groups(){
+	uint64_t words = ct_super->inode_bmp_touched >> 6;
+	uint64_t n = 0, cap = 1024;
+	uint64_t *refs = malloc(cap * sizeof(uint64_t));
+	if(refs == NULL){
+		return -1;
+	}
+	for(uint64_t w = 0; w < words; w++){
+		uint64_t bits = ((uint64_t*)ct_rt.inode_bmp)[w];
+		while(bits){
+			ct_inode_pt c = &ct_rt.inode_start[(w << 6) + __builtin_ctzll(bits)];
+			bits &= bits - 1;
+			if(c->i_block == 0 || c->i_level == PGG_LVL_NONE || c->i_level >= PGG_LVL9){
+				continue;
+			}
+			if(n == cap){
+				uint64_t *t = realloc(refs, (cap *= 2) * sizeof(uint64_t));
+				if(t == NULL){
+					free(refs);
+					return -1;
+				}
+				refs = t;
+			}
+			refs[n ++] = PGG_REF(c->i_block, c->i_level);
+		}
+	}
+	pgg_reclaim(refs, n);
+	free(refs);
+	return 0;
+}
+
+/* take free bits from the bitmap a word at
+ * a time, touching more of it when needed.
+ * Caller holds inode_bmp_lock.
+ * @param[out] out, the inode numbers
+ * @param[in] n, number requested
+ * @param[in] pooled, clear the inodes first since
+ *            they sit in a pool until used
+ * @return number taken, less than n if out of inodes
+ */
+static uint32_t inode_bmp_take(index_t *out, uint32_t n, int pooled){
+	uint64_t *bmp = ct_rt.inode_bmp;
+	uint32_t got = 0;
+	while(got < n){
+		int64_t res = ct_sbmp_next(&ct_rt.inode_free, ct_super->inode_hint >> 6);
+		if(res == -1){
+			res = ct_sbmp_first(&ct_rt.inode_free);
+		}
+		if(res == -1){
+			if(ct_super->inode_bmp_touched >= CT_SIZE_MAX_INODE){
+				// !!!out of inode
+				break;
+			}
+			// need touch more inode bmp
+			memset(ct_rt.inode_bmp + (ct_super->inode_bmp_touched >> 3), 
+			0, CT_PAGE_SIZE);
+			for(uint64_t i = 0; i < (CT_PAGE_SIZE >> 3); i += 64){
+				ct_sbmp_put_word(&ct_rt.inode_free, 
+					((ct_super->inode_bmp_touched >> 6) + i) >> 6, ~(uint64_t)0);
+			}
+			ct_super->inode_bmp_touched += CT_PAGE_SIZE << 3;
+			cache_wb_one(&ct_super->inode_bmp_touched);
+			continue;
+		}
+		uint64_t free = ~bmp[res];
+		uint64_t take = 0;
+		while(free && got < n){
+			uint64_t bit = free & (~free + 1);
+			take |= bit;
+			free ^= bit;
+			out[got] = ((uint64_t)res << 6) + __builtin_ctzll(bit);
+			if(pooled){
+				// stale inodes must not look like files
+				ct_inode_pt c = &ct_rt.inode_start[out[got]];
+				c->i_level = PGG_LVL_NONE;
+				c->i_block = 0;
+				cache_wb_one(c);
+			}
+			got ++;
+		}
+		if(pooled){
+			_mm_sfence();
+		}
+		bmp[res] |= take;
+		cache_wb_one(&bmp[res]);
+		if(free == 0){
+			ct_sbmp_clear(&ct_rt.inode_free, res);
+		}
+		ct_super->inode_hint = out[got - 1];
+	}
+	return got;
+}
+
+/* give inodes back to the bitmap.
+ * Caller holds inode_bmp_lock.
+ */
+static void inode_bmp_put(index_t *in, uint32_t n){
+	for(uint32_t i = 0; i < n; i++){
+		assert(in[i] < CT_SIZE_MAX_INODE);
+		clear_bit(ct_rt.inode_bmp, in[i]);
+		cache_wb_one((uint64_t*)ct_rt.inode_bmp + (in[i] >> 6));
+		ct_sbmp_set(&ct_rt.inode_free, in[i] >> 6);
+	}
+}
+
+static inline inode_pool_t * inode_pool_local(){
+	int cpu = sched_getcpu();
+	if(unlikely(cpu < 0)){
+		cpu = 0;
+	}
+	return &ct_rt.inode_pool[cpu % CT_INODE_POOLS];
+}
+
+/* fold the inode_used change of a pool
+ * into the super block. Pool lock held.
+ */
+static inline void inode_pool_fold(inode_pool_t *pool){
+	__sync_fetch_and_add(&ct_super->inode_used, pool->used);
+	cache_wb_one(&ct_super->inode_used);
+	pool->used = 0;
+}
+
+/* reserve a batch of inodes. Served from
+ * the pool of this cpu, which is refilled from
+ * the bitmap a batch at a time. Large requests
+ * go to the bitmap directly.
+ * @param[out] out, the inode numbers, ascending
+ *             within what each source gave
+ * @param[in] n, number requested
+ * @return number reserved, less than n if out of inodes
+ */
+uint32_t inode_alloc_many(index_t *out, uint32_t n){
+	inode_pool_t *pool = inode_pool_local();
+	uint32_t got = 0;
+	bitlock_acquire(&pool->lock, 0);
+	while(got < n){
+		if(pool->count){
+			out[got ++] = pool->slot[-- pool->count];
+			continue;
+		}
+		index_t fill[CT_INODE_POOL_BATCH];
+		ctfs_lock_acquire(ct_rt.inode_bmp_lock);
+		if(n - got >= CT_INODE_POOL_BATCH){
+			got += inode_bmp_take(out + got, n - got, 0);
+			ctfs_lock_release(ct_rt.inode_bmp_lock);
+			break;
+		}
+		uint32_t filled = inode_bmp_take(fill, CT_INODE_POOL_BATCH, 1);
+		ctfs_lock_release(ct_rt.inode_bmp_lock);
+		if(filled == 0){
+			break;
+		}
+		// popped lowest first
+		while(filled){
+			pool->slot[pool->count ++] = fill[-- filled];
+		}
+	}
+	pool->used += got;
+	if(pool->used >= CT_INODE_USED_FOLD){
+		inode_pool_fold(pool);
+	}
+	bitlock_release(&pool->lock, 0);
+	return got;
+}
+
 index_t inode_alloc(){
-	ctfs_lock_acquire(ct_rt.inode_bmp_lock);
-	if(ct_super->inode_bmp_touched == ct_super->inode_used){
-		// need touch more inode bmp
-		memset(ct_rt.inode_bmp + (ct_super->inode_bmp_touched >> 3), 
-		0, CT_PAGE_SIZE);
-		ct_super->inode_bmp_touched += CT_PAGE_SIZE << 3;
-	}
-	int64_t res = find_free_bit(ct_rt.inode_bmp, CT_SIZE_MAX_INODE, ct_super->inode_hint);
 	index_t ret;
-	if(res == -1){
-		// !!!out of inode
-		ctfs_lock_release(ct_rt.inode_bmp_lock);
+	if(inode_alloc_many(&ret, 1) == 0){
 		return 0;
 	}
-	else{
-		ret = (uint64_t)res;
-	}
-	set_bit(ct_rt.inode_bmp, ret);
-	ct_super->inode_hint = ret;    
-	ct_super->inode_used ++;
-	cache_wb_one(&ct_super->inode_used);
-	ctfs_lock_release(ct_rt.inode_bmp_lock);
 	return ret;
 }
 
+/* free an inode. Its page group must be
+ * freed already, the inode is cleared when
+ * kept in the pool.
+ * @param[in] index
+ */
 void inode_dealloc(index_t index){
-	ctfs_lock_acquire(ct_rt.inode_bmp_lock);
-	assert(index < CT_SIZE_MAX_INODE);
-	clear_bit(ct_rt.inode_bmp, index);
-	ctfs_lock_release(ct_rt.inode_bmp_lock);
+	// pending times must not land on the next owner
+	if(ct_rt.mount_flags & CTFS_INIT_FLAG_LAZYTIME){
+		uint64_t slot = index % CT_LAZYTIME_SLOTS;
+		bitlock_acquire(ct_rt.lazy_lock, slot);
+		if(ct_rt.lazy[slot].ino == index){
+			ct_rt.lazy[slot].ino = 0;
+			__sync_fetch_and_sub(&ct_rt.lazy_pending, 1);
+		}
+		bitlock_release(ct_rt.lazy_lock, slot);
+	}
+	inode_pool_t *pool = inode_pool_local();
+	bitlock_acquire(&pool->lock, 0);
+	if(pool->count == CT_INODE_POOL_SIZE){
+		// the oldest batch goes back
+		ctfs_lock_acquire(ct_rt.inode_bmp_lock);
+		inode_bmp_put(pool->slot, CT_INODE_POOL_BATCH);
+		ctfs_lock_release(ct_rt.inode_bmp_lock);
+		pool->count -= CT_INODE_POOL_BATCH;
+		memmove(pool->slot, pool->slot + CT_INODE_POOL_BATCH, pool->count * sizeof(index_t));
+	}
+	ct_inode_pt c = &ct_rt.inode_start[index];
+	c->i_level = PGG_LVL_NONE;
+	c->i_block = 0;
+	cache_wb_one(c);
+	pool->slot[pool->count ++] = index;
+	pool->used --;
+	if(pool->used <= -CT_INODE_USED_FOLD){
+		inode_pool_fold(pool);
+	}
+	bitlock_release(&pool->lock, 0);
+}
+
+/* give all pooled inodes back to the bitmap
+ * and fold the counters, for a clean shutdown
+ */
+void inode_pool_drain(){
+	for(int i = 0; i < CT_INODE_POOLS; i++){
+		inode_pool_t *pool = &ct_rt.inode_pool[i];
+		bitlock_acquire(&pool->lock, 0);
+		if(pool->count){
+			ctfs_lock_acquire(ct_rt.inode_bmp_lock);
+			inode_bmp_put(pool->slot, pool->count);
+			ctfs_lock_release(ct_rt.inode_bmp_lock);
+			pool->count = 0;
+		}
+		if(pool->used){
+			inode_pool_fold(pool);
+		}
+		bitlock_release(&pool->lock, 0);
+	}
+}
+
+/* write back the pending times of a slot,
+ * no fence. A time stamped directly since
+ * is newer and kept.
+ * @param[in] slot, lazy_lock held
+ */
+static void inode_lazy_wb(uint64_t slot){
+	ct_lazytime_t *e = &ct_rt.lazy[slot];
+	if(e->ino){
+		ct_inode_pt c = &ct_rt.inode_start[e->ino];
+		if((e->pending & CT_LAZY_ATIME) && ct_time_greater(&e->atim, &c->i_atim)){
+			c->i_atim = e->atim;
+		}
+		if(e->pending & CT_LAZY_MTIME){
+			if(ct_time_greater(&e->mtim, &c->i_mtim)){
+				c->i_mtim = e->mtim;
+			}
+			if(ct_time_greater(&e->mtim, &c->i_ctim)){
+				c->i_ctim = e->mtim;
+			}
+		}
+		cache_wb(&c->i_atim, 3 * sizeof(struct timespec));
+		e->ino = 0;
+		e->pending = 0;
+		__sync_fetch_and_sub(&ct_rt.lazy_pending, 1);
+	}
+}
+
+/* take the slot of an inode in the table,
+ * evicting the one in it
+ * @param[in] inode
+ * @param[in] slot, lazy_lock held
+ */
+static ct_lazytime_t* inode_lazy_slot(ct_inode_pt inode, uint64_t slot){
+	ct_lazytime_t *e = &ct_rt.lazy[slot];
+	if(e->ino != inode->i_number){
+		inode_lazy_wb(slot);
+		e->ino = inode->i_number;
+		__sync_fetch_and_add(&ct_rt.lazy_pending, 1);
+	}
+	return e;
+}
+
+/* write back the pending times of an inode
+ * @param[in] inode_n
+ */
+void inode_lazy_flush(index_t inode_n){
+	uint64_t slot = inode_n % CT_LAZYTIME_SLOTS;
+	bitlock_acquire(ct_rt.lazy_lock, slot);
+	if(ct_rt.lazy[slot].ino == inode_n){
+		inode_lazy_wb(slot);
+		_mm_sfence();
+	}
+	bitlock_release(ct_rt.lazy_lock, slot);
+}
+
+/* write back all pending times, one fence
+ */
+void inode_lazy_flush_all(){
+	for(uint64_t slot = 0; slot < CT_LAZYTIME_SLOTS; slot++){
+		if(ct_rt.lazy[slot].ino == 0){
+			continue;
+		}
+		bitlock_acquire(ct_rt.lazy_lock, slot);
+		inode_lazy_wb(slot);
+		bitlock_release(ct_rt.lazy_lock, slot);
+	}
+	_mm_sfence();
+}
+
+/* times of an inode, the pending ones if
+ * newer
+ * @param[in] inode, rt locked
+ * @param[out] atim, mtim, ctim
+ */
+void inode_get_times(ct_inode_pt inode, struct timespec *atim,
+	struct timespec *mtim, struct timespec *ctim){
+	*atim = inode->i_atim;
+	*mtim = inode->i_mtim;
+	*ctim = inode->i_ctim;
+	if(ct_rt.mount_flags & CTFS_INIT_FLAG_LAZYTIME){
+		uint64_t slot = inode->i_number % CT_LAZYTIME_SLOTS;
+		ct_lazytime_t *e = &ct_rt.lazy[slot];
+		bitlock_acquire(ct_rt.lazy_lock, slot);
+		if(e->ino == inode->i_number){
+			if((e->pending & CT_LAZY_ATIME) && ct_time_greater(&e->atim, atim)){
+				*atim = e->atim;
+			}
+			if((e->pending & CT_LAZY_MTIME) && ct_time_greater(&e->mtim, mtim)){
+				*mtim = e->mtim;
+			}
+			if((e->pending & CT_LAZY_MTIME) && ct_time_greater(&e->mtim, ctim)){
+				*ctim = e->mtim;
+			}
+		}
+		bitlock_release(ct_rt.lazy_lock, slot);
+	}
+}
+
+/* the inode was accessed, update its atime
+ * as the mount options say
+ * @param[in] inode, rt locked
+ */
+void inode_touch_atime(ct_inode_pt inode){
+	int flags = ct_rt.mount_flags;
+	if(flags & CTFS_INIT_FLAG_NOATIME){
+		return;
+	}
+	struct timespec now, atim, mtim, ctim;
+	ct_time_stamp(&now);
+	if(flags & CTFS_INIT_FLAG_RELATIME){
+		inode_get_times(inode, &atim, &mtim, &ctim);
+		// only when it would look older than a change
+		if(ct_time_greater(&atim, &mtim) &&
+			ct_time_greater(&atim, &ctim) &&
+			now.tv_sec - atim.tv_sec < CT_RELATIME_SEC){
+			return;
+		}
+	}
+	if((flags & CTFS_INIT_FLAG_LAZYTIME) == 0){
+		inode->i_atim = now;
+		return;
+	}
+	uint64_t slot = inode->i_number % CT_LAZYTIME_SLOTS;
+	bitlock_acquire(ct_rt.lazy_lock, slot);
+	ct_lazytime_t *e = inode_lazy_slot(inode, slot);
+	e->atim = now;
+	e->pending |= CT_LAZY_ATIME;
+	bitlock_release(ct_rt.lazy_lock, slot);
+	if(ct_rt.lazy_pending >= CT_LAZYTIME_BATCH){
+		inode_lazy_flush_all();
+	}
+}
+
+/* the inode changed, update its mtime and
+ * ctime. Kept in DRAM under lazytime.
+ * @param[in] inode, rt locked
+ * @return 1 if stamped in the inode and not
+ *         written back, 0 if deferred
+ */
+int inode_touch_mtime(ct_inode_pt inode){
+	struct timespec now;
+	ct_time_stamp(&now);
+	if((ct_rt.mount_flags & CTFS_INIT_FLAG_LAZYTIME) == 0){
+		inode->i_ctim = now;
+		inode->i_mtim = now;
+		return 1;
+	}
+	uint64_t slot = inode->i_number % CT_LAZYTIME_SLOTS;
+	bitlock_acquire(ct_rt.lazy_lock, slot);
+	ct_lazytime_t *e = inode_lazy_slot(inode, slot);
+	e->mtim = now;
+	e->pending |= CT_LAZY_MTIME;
+	bitlock_release(ct_rt.lazy_lock, slot);
+	if(ct_rt.lazy_pending >= CT_LAZYTIME_BATCH){
+		inode_lazy_flush_all();
+	}
+	return 0;
 }
 
 static int inode_dir_fill(ct_inode_frame_t * frame){
 	ct_inode_pt c = frame->current;
 	inode_resize(frame->current, 2 * sizeof(ct_dirent_t));
-	ct_dirent_pt cur_dirent = CT_REL2ABS(c->i_block);
-	cur_dirent[0].d_ino = c->i_number;
-	strcpy(cur_dirent[0].d_name, ".");
-	cur_dirent[0].d_type = DT_DIR;
-	cur_dirent[1].d_ino = frame->parent->i_number;
-	strcpy(cur_dirent[1].d_name, "..");
-	cur_dirent[1].d_type = DT_DIR;
-	c->i_size = 2 * sizeof(ct_dirent_t);
-	c->i_ndirent = 2;
+	dir_init(c, frame->parent->i_number);
 	c->i_mode |= S_IFDIR;
 #ifdef DAX_DEBUGGING
 	ct_inode_t in = *c;
-	ct_dirent_t dir = *cur_dirent;
+	ct_dirent_t dir = *(ct_dirent_pt)CT_REL2ABS(c->i_block);
 #endif
 	return 0;
 }
 
+/* link an inode into a directory. 
+ * The name and index go in before d_ino.
+ * @param[in] c, the directory, rt locked
+ * @param[in] name, one path component
+ * @param[in] inode, the one to link
+ * @return 0 if success, error otherwise
+ */
+static int inode_dir_install(ct_inode_pt c, const char *name, ct_inode_pt inode){
+	size_t len = strnlen(name, CT_MAX_NAME);
+	int64_t i = dir_alloc(c, len);
+	if(i < 0){
+		return ENOSPC;
+	}
+	ct_dirent_pt target_dirent = &((ct_dirent_pt)CT_REL2ABS(c->i_block))[i];
+	dir_dirent_set(target_dirent, name, len, (inode->i_mode & S_IFDIR)? DT_DIR:DT_REG);
+	_mm_sfence();
+	dir_index_add(c, target_dirent);
+	target_dirent->d_ino = inode->i_number;
+	cache_wb_one(&target_dirent->d_ino);
+	c->i_ndirent ++;
+	ct_time_stamp(&c->i_ctim);
+	cache_wb(c, sizeof(ct_inode_t));
+	return 0;
+}
+
 /* create all necessary inodes from the inode_start point
  * goes in with start locked
  * internal use only
@@ -154,144 +685,105 @@ static int inode_create(ct_inode_frame_t * frame){
 	const char * cursor = frame->path;
 	ino_t temp_i;
 	uint32_t j;
+	int64_t i;
+	int ret;
 	c = frame->inode_start;
 	// ino_t start_ino = c->i_number;
-	ct_dirent_pt target_dirent = NULL;
 	// loop over path components
 	while(1){
-		ct_dirent_pt cur_dirent = CT_REL2ABS(c->i_block);
-		// loop over dirents
 #ifdef DAX_DEBUGGING
-		ct_dirent_t dir = *cur_dirent;
-		// dir.d_ino = 0;
 		ct_inode_t in = *c;
 		// in.i_gid = 0;
 #endif
-		if(frame->flag & CT_INODE_FRAME_INSTALL){
-			j = 0;
-			while(cursor[j] != '/' && cursor[j] != '\0'){
-				j++;
-			}
-			if(cursor[j] == '\0'){
-				// install inode here
-				for(uint32_t i = 2;; i++){
-					if(i >= c->i_ndirent){
-						if((i+1) * sizeof(ct_dirent_t) > c->i_size){
-							// need to enlarge the data block
-							inode_resize(c, (i+1) * sizeof(ct_dirent_t));
-							cache_wb(c, sizeof(ct_inode_t));
-						}
-						ct_time_stamp(&c->i_ctim);
-						c->i_ndirent ++;
-						target_dirent = &cur_dirent[i];
-						break;
-					}
-					else if(cur_dirent[i].d_ino == 0){
-						target_dirent = &cur_dirent[i];
-						break;
-					}
-				}
-				assert(target_dirent);
-				target_dirent->d_ino = frame->current->i_number;
-				strncpy(target_dirent->d_name, cursor, CT_MAX_NAME);
-				target_dirent->d_type = (frame->current->i_mode & S_IFDIR)? DT_DIR:DT_REG;
-				cache_wb(target_dirent, sizeof(ct_dirent_t));
-				inode_rt_unlock(c->i_number);
-				return 0;
+		j = 0;
+		while(cursor[j] != '/' && cursor[j] != '\0'){
+			j++;
+		}
+		if(j > CT_MAX_NAME){
+			inode_rt_unlock(c->i_number);
+			return EINVAL;
+		}
+		if((frame->flag & CT_INODE_FRAME_INSTALL) && cursor[j] == '\0'){
+			// install inode here
+			ret = inode_dir_install(c, cursor, frame->current);
+			inode_rt_unlock(c->i_number);
+			return ret;
+		}
+		i = dir_alloc(c, j);
+		temp_i = (i < 0) ? 0 : inode_alloc();
+		if(temp_i == 0){
+			if(i >= 0){
+				dir_unalloc(c, i, j);
 			}
+			inode_rt_unlock(c->i_number);
+			return ENOSPC;
 		}
-		for(uint32_t i = 2;; i++){
-			ct_inode_t inode_temp;
-			ct_dirent_t dirent_temp;
-			if((i+1) * sizeof(ct_dirent_t) > c->i_size){
-				// need to enlarge the data block
-				inode_resize(c, (i+1) * sizeof(ct_dirent_t));
-				goto found_empty;
+		// the directory may have moved
+		ct_dirent_pt cur_dirent = CT_REL2ABS(c->i_block);
+		c->i_ndirent ++;
+		ct_time_stamp(&c->i_ctim);
+		cache_wb(c, sizeof(ct_inode_t));
+		const char *name = cursor;
+		cursor += j;
+		while(*cursor == '/'){
+			cursor++;
+		}
+		// a directory unless it is the last component of a file
+		dir_dirent_set(&cur_dirent[i], name, j, 
+			(*cursor == '\0' && (frame->i_mode & S_IFDIR) == 0) ? DT_REG : DT_DIR);
+		ct_time_stamp(&c->i_mtim);
+		ct_time_stamp(&c->i_atim);
+		frame->parent = c;
+		c = &ct_rt.inode_start[temp_i];
+		frame->current = c;
+		frame->dirent = &cur_dirent[i];
+		memcpy(c, &default_inode, sizeof(ct_inode_t));
+		c->i_number = temp_i;
+		ct_time_stamp(&c->i_ctim);
+		ct_time_stamp(&c->i_mtim);
+		ct_time_stamp(&c->i_atim);
+		if(*cursor == '\0'){
+			// it's the last one. we are done.
+			if(frame->i_mode & S_IFDIR){
+				inode_dir_fill(frame);
 			}
-			if(cur_dirent[i].d_ino == 0){
-found_empty:
-#ifdef CTFS_DEBUG
-				inode_temp = *c;
-				dirent_temp = cur_dirent[i];
-#endif
-				c->i_ndirent ++;
-				ct_time_stamp(&c->i_ctim);
-				cache_wb(c, sizeof(ct_inode_t));
-				temp_i = inode_alloc();
-				j = 0;
-				while(cursor[j] != '\0' && cursor[j] != '/'){
-					cur_dirent[i].d_name[j] = cursor[j];
-					j ++;
-					if(j > CT_MAX_NAME){
-						inode_dealloc(temp_i);
-						return EINVAL;
-					}
+			if(frame->flag & CT_INODE_FRAME_PARENT){
+				// parent requested
+				if(INODE_LOCK_OFFSET(frame->parent->i_number) == INODE_LOCK_OFFSET(temp_i)){
+					frame->flag |= CT_INODE_FRAME_SAME_INODE_LOCK;
 				}
-				cur_dirent[i].d_name[j] = '\0';
-				ct_time_stamp(&c->i_mtim);
-				ct_time_stamp(&c->i_atim);
-				cursor += j;
-				while(*cursor == '/'){
-					cursor++;
+				else{
+					inode_rt_lock(temp_i);
 				}
-				frame->parent = c;
-				c = &ct_rt.inode_start[temp_i];
-				frame->current = c;
-				frame->dirent = &cur_dirent[i];
-				memcpy(c, &default_inode, sizeof(ct_inode_t));
-				c->i_number = temp_i;
-				ct_time_stamp(&c->i_ctim);
-				ct_time_stamp(&c->i_mtim);
-				ct_time_stamp(&c->i_atim);
-				if(*cursor == '\0'){
-					// it's the last one. we are done.
-					if(frame->i_mode & S_IFDIR){
-						cur_dirent[i].d_type = DT_DIR;
-						inode_dir_fill(frame);
-					}
-					else{
-						cur_dirent[i].d_type = DT_REG;
-					}
-					if(frame->flag & CT_INODE_FRAME_PARENT){
-						// parent requested
-						if(INODE_LOCK_OFFSET(frame->parent->i_number) == INODE_LOCK_OFFSET(temp_i)){
-							frame->flag |= CT_INODE_FRAME_SAME_INODE_LOCK;
-						}
-						else{
-							inode_rt_lock(temp_i);
-						}
-					}
-					else{
-						if(INODE_LOCK_OFFSET(frame->parent->i_number) != INODE_LOCK_OFFSET(temp_i)){
-							inode_rt_unlock(frame->parent->i_number);
-							inode_rt_lock(temp_i);
-						}
-					}
+			}
+			else{
+				if(INODE_LOCK_OFFSET(frame->parent->i_number) != INODE_LOCK_OFFSET(temp_i)){
+					inode_rt_unlock(frame->parent->i_number);
+					inode_rt_lock(temp_i);
+				}
+			}
 #ifdef CTFS_DEBUG
-					ct_inode_t tt = *c;
-					printf("allocated at dirent #%d\n", i);
+			ct_inode_t tt = *c;
+			printf("allocated at dirent #%ld\n", i);
 #endif
-					cache_wb(c, sizeof(ct_inode_t));
-					cache_wb(&cur_dirent[i], sizeof(ct_dirent_t));
-					cur_dirent[i].d_ino = temp_i;
-					cache_wb_one(&cur_dirent[i].d_ino);
-					return 0;
-				}
-				else{
-					cur_dirent[i].d_type = DT_DIR;
-					inode_dir_fill(frame);
-
-					cache_wb(c, sizeof(ct_inode_t));
-					cache_wb(&cur_dirent[i], sizeof(ct_dirent_t));
-					cur_dirent[i].d_ino = temp_i;
-					cache_wb_one(&cur_dirent[i].d_ino);
-					if(INODE_LOCK_OFFSET(frame->parent->i_number) != INODE_LOCK_OFFSET(temp_i)){
-						inode_rt_unlock(frame->parent->i_number);
-						inode_rt_lock(temp_i);
-					}
-				}
-				break; // break loop over dirents
-				
+			cache_wb(c, sizeof(ct_inode_t));
+			_mm_sfence();
+			dir_index_add(frame->parent, &cur_dirent[i]);
+			cur_dirent[i].d_ino = temp_i;
+			cache_wb_one(&cur_dirent[i].d_ino);
+			return 0;
+		}
+		else{
+			inode_dir_fill(frame);
+
+			cache_wb(c, sizeof(ct_inode_t));
+			_mm_sfence();
+			dir_index_add(frame->parent, &cur_dirent[i]);
+			cur_dirent[i].d_ino = temp_i;
+			cache_wb_one(&cur_dirent[i].d_ino);
+			if(INODE_LOCK_OFFSET(frame->parent->i_number) != INODE_LOCK_OFFSET(temp_i)){
+				inode_rt_unlock(frame->parent->i_number);
+				inode_rt_lock(temp_i);
 			}
 		}
 	}
@@ -332,7 +824,7 @@ int inode_path2inode(ct_inode_frame_t * frame){
 	while(*cursor == '/')
 		cursor ++;
 	inode_rt_lock(c->i_number);
-	ct_time_stamp(&c->i_atim);
+	inode_touch_atime(c);
 	if(*cursor == '\0'){
 		// request is root
 		frame->current = c;
@@ -350,124 +842,87 @@ int inode_path2inode(ct_inode_frame_t * frame){
 			goto error;
 		}
 
-		uint32_t size_dirent = c->i_size / sizeof(ct_dirent_t);
-		found = 0;
+		uint32_t j = 0;
+		while(cursor[j] != '/' && cursor[j] != '\0'){
+			j++;
+		}
 		ct_dirent_pt cur_dirent = CT_REL2ABS(c->i_block);
-		/* loop over dirents in the directory */
-		for(uint32_t i = 0; i < size_dirent; i++){
-			if(cur_dirent[i].d_ino == 0){
-				continue;
+		int64_t i;
+		index_t hit_ino;
+		uint32_t hit_slot;
+		switch(dcache_lookup(c->i_number, cursor, j, &hit_ino, &hit_slot)){
+		case 1:
+			i = hit_slot;
+			break;
+		case 0:
+			i = -1;
+			break;
+		default:
+			i = dir_lookup(c, cursor, j);
+			dcache_insert(c->i_number, cursor, j, (i >= 0) ? cur_dirent[i].d_ino : 0, i);
+		}
+		found = (i >= 0);
+		if(found){
+			cursor += j;
+			while(*cursor == '/'){
+				cursor++;
 			}
-			uint32_t j = 0;
-#ifdef CTFS_DEBUG
-			ct_dirent_t dir = cur_dirent[i];
-			dir.d_ino = 0;
-#endif
-			// check the name
-			while(1){
-				if(cur_dirent[i].d_name[j] == '\0'){
-					// reach the end of current dirent's name
-					if(cursor[j] == '/' ){
-						cursor += j;
-						while(*cursor == '/'){
-							cursor++;
-						}
-						if(*cursor == '\0'){
-target_reached:
-							if(frame->flag & CT_INODE_FRAME_INSTALL){
-								// got trouble. Shouldn't exist.
-								ino_t old = cur_dirent[i].d_ino;
-								cur_dirent[i].d_ino = frame->current->i_number;
-								ct_rt.inode_start[old].i_nlink --;
-								if(ct_rt.inode_start[old].i_level != -1){
-									if(ct_rt.inode_start[old].i_block != 0){
-										pgg_deallocate(ct_rt.inode_start[old].i_level, ct_rt.inode_start[old].i_block);
-									}
-									inode_dealloc(old);
-								}
-								cur_dirent[i].d_type = (frame->current->i_mode & S_IFDIR)? DT_DIR:DT_REG;
-								inode_rt_unlock(c->i_number);
-								return 0;
-							}
-							if(frame->flag & CT_INODE_FRAME_PARENT){
-								// parent requested
-								frame->parent = c;
-								frame->dirent = &cur_dirent[i];
-								if(INODE_LOCK_OFFSET(c->i_number) == INODE_LOCK_OFFSET(cur_dirent[i].d_ino)){
-									frame->flag |= CT_INODE_FRAME_SAME_INODE_LOCK;
-								}
-								else{
-									inode_rt_lock(cur_dirent[i].d_ino);
-								}
-							}
-							else{
-								// parent not requested
-								if(INODE_LOCK_OFFSET(c->i_number) != INODE_LOCK_OFFSET(cur_dirent[i].d_ino)){
-									inode_rt_lock(cur_dirent[i].d_ino);
-									inode_rt_unlock(c->i_number);
-									
-								}
-							}
-							frame->current = &ct_rt.inode_start[cur_dirent[i].d_ino];
-							return 0;
+			if(*cursor == '\0'){
+				if(frame->flag & CT_INODE_FRAME_INSTALL){
+					// got trouble. Shouldn't exist.
+					ino_t old = cur_dirent[i].d_ino;
+					dcache_invalidate(c->i_number, cur_dirent[i].d_name, j);
+					cur_dirent[i].d_ino = frame->current->i_number;
+					ct_rt.inode_start[old].i_nlink --;
+					if(ct_rt.inode_start[old].i_level != -1){
+						ct_inode_pt o = &ct_rt.inode_start[old];
+						// open fds may still take views
+						inode_rw_lock(old);
+						if(o->i_block != 0 && !mmap_orphan(o) &&
+							!view_retire(old, o->i_level, o->i_block)){
+							pgg_deallocate(o->i_level, o->i_block);
 						}
-						found = 1;
-						if(INODE_LOCK_OFFSET(c->i_number) != INODE_LOCK_OFFSET(cur_dirent[i].d_ino)){
-							inode_rt_unlock(c->i_number);
-							inode_rt_lock(cur_dirent[i].d_ino);
-						}
-						c = &ct_rt.inode_start[cur_dirent[i].d_ino];
-						ct_time_stamp(&c->i_atim);
-						break; // break check the name
+						inode_rw_unlock(old);
+						inode_dealloc(old);
+					}
+					cur_dirent[i].d_type = (frame->current->i_mode & S_IFDIR)? DT_DIR:DT_REG;
+					inode_rt_unlock(c->i_number);
+					return 0;
+				}
+				if(frame->flag & CT_INODE_FRAME_PARENT){
+					// parent requested
+					frame->parent = c;
+					frame->dirent = &cur_dirent[i];
+					if(INODE_LOCK_OFFSET(c->i_number) == INODE_LOCK_OFFSET(cur_dirent[i].d_ino)){
+						frame->flag |= CT_INODE_FRAME_SAME_INODE_LOCK;
 					}
-					if(cursor[j] == '\0'){
-						goto target_reached;
+					else{
+						inode_rt_lock(cur_dirent[i].d_ino);
 					}
 				}
-				if(cursor[j] != cur_dirent[i].d_name[j]){
-					// not match
-					break; // break check the name
+				else{
+					// parent not requested
+					if(INODE_LOCK_OFFSET(c->i_number) != INODE_LOCK_OFFSET(cur_dirent[i].d_ino)){
+						inode_rt_lock(cur_dirent[i].d_ino);
+						inode_rt_unlock(c->i_number);
+					}
 				}
-				j++;
+				frame->current = &ct_rt.inode_start[cur_dirent[i].d_ino];
+				return 0;
 			}
-			if(found){
-				break; // break loop over dirents in the directory
+			if(INODE_LOCK_OFFSET(c->i_number) != INODE_LOCK_OFFSET(cur_dirent[i].d_ino)){
+				inode_rt_unlock(c->i_number);
+				inode_rt_lock(cur_dirent[i].d_ino);
 			}
+			c = &ct_rt.inode_start[cur_dirent[i].d_ino];
+			inode_touch_atime(c);
 		}
-		if(!found){
-			if(frame->flag & CT_INODE_FRAME_INSTALL){
-				uint16_t j = 0;
-				ct_dirent_pt target_dirent = NULL;
-				while(cursor[j] != '/' && cursor[j] != '\0'){
-					j++;
-				}
-				if(cursor[j] == '\0'){
-					// install inode here
-					for(uint32_t i = 2;; i++){
-						if(i >= c->i_ndirent){
-							if(i * sizeof(ct_dirent_t) > c->i_size){
-								// need to enlarge the data block
-								inode_resize(c, i * sizeof(ct_dirent_t));
-								cache_wb(c, sizeof(ct_inode_t));
-							}
-							ct_time_stamp(&c->i_ctim);
-							c->i_ndirent ++;
-							target_dirent = &cur_dirent[i];
-							break;
-						}
-						else if(cur_dirent[i].d_ino == 0){
-							target_dirent = &cur_dirent[i];
-							break;
-						}
-					}
-					assert(target_dirent);
-					target_dirent->d_ino = frame->current->i_number;
-					strncpy(target_dirent->d_name, cursor, CT_MAX_NAME);
-					target_dirent->d_type = (frame->current->i_mode & S_IFDIR)? DT_DIR:DT_REG;
-					cache_wb(target_dirent, sizeof(ct_dirent_t));
-					inode_rt_unlock(c->i_number);
-					return 0;
-				}
+		else{
+			if((frame->flag & CT_INODE_FRAME_INSTALL) && cursor[j] == '\0'){
+				// install inode here
+				ret = inode_dir_install(c, cursor, frame->current);
+				inode_rt_unlock(c->i_number);
+				return ret;
 			}
 			// no match dirent
 			if(frame->flag & CT_INODE_FRAME_CREATE){
@@ -492,29 +947,176 @@ error:
 	return ret;
 }
 
+/* open addressing set of names,
+ * used to catch duplicates in a batch
+ */
+struct name_set{
+	const char	**slot;
+	uint64_t	mask;
+};
+
+/* @return 1 if added, 0 if already there */
+static int name_set_add(struct name_set *set, const char *name){
+	uint64_t i = dir_name_hash(name, strlen(name)) & set->mask;
+	while(set->slot[i]){
+		if(strcmp(set->slot[i], name) == 0){
+			return 0;
+		}
+		i = (i + 1) & set->mask;
+	}
+	set->slot[i] = name;
+	return 1;
+}
+
+/* create a batch of regular files in
+ * one directory. Inodes and page groups
+ * are reserved in bulk, the directory 
+ * grows once and is flushed once.
+ * Caller holds the rt lock of dir.
+ * @param[in] dir
+ * @param[in] names, one path component each
+ * @param[in] n, number of names
+ * @param[in] size, initial size of each file
+ * @return number created, the first n names. 
+ *         ct_rt.errorn is set if less than n
+ */
+uint32_t inode_create_many(ct_inode_pt dir, const char *const *names, uint32_t n, size_t size){
+	ct_dirent_pt cur_dirent = CT_REL2ABS(dir->i_block);
+	uint32_t nd = dir->i_size / sizeof(ct_dirent_t);
+	uint32_t i, got, planned, append = 0;
+	index_t *ino = NULL;
+	relptr_t *blk = NULL;
+	uint32_t *slot = NULL;
+	pgg_level_t lvl = PGG_LVL_NONE;
+	struct name_set set;
+
+	if(n == 0){
+		return 0;
+	}
+	set.mask = 1;
+	while(set.mask < 2 * ((uint64_t)nd + n)){
+		set.mask <<= 1;
+	}
+	set.slot = calloc(set.mask, sizeof(char*));
+	ino = malloc(n * sizeof(index_t));
+	slot = malloc(n * sizeof(uint32_t));
+	if(set.slot == NULL || ino == NULL || slot == NULL){
+		ct_rt.errorn = ENOMEM;
+		n = 0;
+		goto out;
+	}
+	set.mask --;
+	// names already in the directory
+	for(i = 0; i < nd; i += CT_DIRENT_NSLOT(&cur_dirent[i])){
+		if(cur_dirent[i].d_ino != 0){
+			name_set_add(&set, cur_dirent[i].d_name);
+		}
+	}
+	for(i = 0; i < n; i++){
+		size_t len = strnlen(names[i], CT_MAX_NAME + 1);
+		if(len == 0 || len > CT_MAX_NAME || strchr(names[i], '/')){
+			ct_rt.errorn = EINVAL;
+			break;
+		}
+		if(!name_set_add(&set, names[i])){
+			ct_rt.errorn = EEXIST;
+			break;
+		}
+	}
+	n = planned = i;
+	// reuse free entries, then append
+	uint32_t first_append = n;
+	for(i = 0; i < n; i++){
+		uint32_t need = CT_DIRENT_SLOTS(strlen(names[i]));
+		int64_t s = dir_free_take(dir, need);
+		if(s < 0){
+			first_append = (i < first_append) ? i : first_append;
+			slot[i] = nd + append;
+			append += need;
+			continue;
+		}
+		slot[i] = s;
+	}
+	if(append){
+		if(dir_grow(dir, nd + append)){
+			// keep the names before the first appended one
+			n = first_append;
+		}
+		cur_dirent = CT_REL2ABS(dir->i_block);
+	}
+
+	got = inode_alloc_many(ino, n);
+	if(got < n){
+		ct_rt.errorn = ENOSPC;
+		n = got;
+	}
+	if(size){
+		lvl = pgg_get_lvl(size);
+		blk = malloc(n * sizeof(relptr_t));
+		got = blk ? pgg_allocate_many(lvl, blk, n) : 0;
+		if(got < n){
+			ct_rt.errorn = blk ? ENOSPC : ENOMEM;
+			for(i = got; i < n; i++){
+				inode_dealloc(ino[i]);
+			}
+			n = got;
+		}
+	}
+
+	// inodes and names first, then link
+	struct timespec now;
+	ct_time_stamp(&now);
+	for(i = 0; i < n; i++){
+		ct_inode_pt c = &ct_rt.inode_start[ino[i]];
+		memcpy(c, &default_inode, sizeof(ct_inode_t));
+		c->i_number = ino[i];
+		c->i_ctim = now;
+		c->i_mtim = now;
+		c->i_atim = now;
+		if(size){
+			c->i_block = blk[i];
+			c->i_level = lvl;
+			c->i_size = size;
+		}
+		cache_wb(c, sizeof(ct_inode_t));
+		dir_dirent_set(&cur_dirent[slot[i]], names[i], strlen(names[i]), DT_REG);
+	}
+	_mm_sfence();
+	for(i = 0; i < n; i++){
+		dir_index_add(dir, &cur_dirent[slot[i]]);
+		cur_dirent[slot[i]].d_ino = ino[i];
+		cache_wb_one(&cur_dirent[slot[i]].d_ino);
+	}
+	dir->i_ndirent += n;
+	dir->i_ctim = now;
+	dir->i_mtim = now;
+	cache_wb(dir, sizeof(ct_inode_t));
+	// give back the entries of names left out
+	nd = dir->i_size / sizeof(ct_dirent_t);
+	for(i = n; i < planned; i++){
+		uint32_t need = CT_DIRENT_SLOTS(strlen(names[i]));
+		for(uint32_t j = 0; j < need && slot[i] + j < nd; j += CT_DIRENT_NSLOT(&cur_dirent[slot[i] + j])){
+			dir_free_put(dir, slot[i] + j);
+		}
+	}
+out:
+	free(set.slot);
+	free(ino);
+	free(slot);
+	free(blk);
+	return n;
+}
+
 void inode_set_root(){
 	ct_inode_pt c = &ct_rt.inode_start[1];
 	memcpy(c, &default_inode, sizeof(ct_inode_t));
 	c->i_number = 1;
 	c->i_block = pgg_mkfs();
-#ifdef CTFS_HACK
-	c->i_level = PGG_LVL3;
-#else
 	c->i_level = PGG_LVL0;
-#endif
-	c->i_size = 2 * sizeof(ct_dirent_t);
 	c->i_mode |= S_IFDIR;
-	c->i_ndirent = 2;
-	ct_dirent_pt cur_dirent = CT_REL2ABS(c->i_block);
-	cur_dirent[0].d_ino = 1;
-	strcpy(cur_dirent[0].d_name, ".");
-	cur_dirent[0].d_type = DT_DIR;
-	cur_dirent[1].d_ino = 1;
-	strcpy(cur_dirent[1].d_name, "..");
-	cur_dirent[1].d_type = DT_DIR;
+	dir_init(c, 1);
 	ct_time_stamp(&c->i_ctim);
 	ct_time_stamp(&c->i_mtim);
 	ct_time_stamp(&c->i_atim);
 	cache_wb(c, sizeof(ct_inode_t));
-	cache_wb(cur_dirent, 2 * sizeof(ct_dirent_t));
 }
@@ -0,0 +1,678 @@
+/*****************************
+ *
+ * Memory mapped files. A file is one range
+ * of the DAX mapping, so ctfs_mmap returns
+ * that range itself, no copy and no second
+ * mapping. pswap moves pages under a fixed
+ * virtual address, which an alias of the
+ * device would not follow.
+ *
+ * The mapped pages get the file protection
+ * key, which stays accessible outside ctfs
+ * calls, and go back to the default key once
+ * no mapping covers them. Pages covered only
+ * by read-only mappings or read views get the
+ * view key, which threads can only read
+ * outside ctfs calls; ctfs writes to them
+ * between mmap_write_begin and _end. A mapped file keeps
+ * its page group: it is not moved by resize
+ * or the defragmenter, and a removed file
+ * hands its group to the mappings, freed by
+ * the last munmap. So the group is reserved
+ * with headroom at map time, the file grows
+ * in it while mapped.
+ *
+ * Read views borrow a range without a
+ * mapping. A view bumps a counter of the
+ * inode lock slot and puts its pages on the
+ * view key until released. A group moved or
+ * removed under views is copied instead of
+ * swapped and kept until the slot has no views.
+ * Optimistic preads announce themselves in a
+ * per-thread record the same way, so a group
+ * is not reused under a racing copy.
+ *
+ ****************************/
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include "ctfs.h"
+#include "ctfs_pgg.h"
+#include "ctfs_runtime.h"
+
+// mappings of the inodes of one lock slot
+#define MMAP_COUNT(ino)		(ct_rt.inode_lock[(ino) % CT_INODE_LOCK_SLOTS].mapped)
+// read views of the inodes of one lock slot
+#define VIEW_COUNT(ino)		(ct_rt.inode_lock[(ino) % CT_INODE_LOCK_SLOTS].views)
+
+/* grow the covered end at lo, or pull the
+ * next covered start in, for one range
+ */
+static void mmap_cover(uint64_t addr, uint64_t len, uint64_t lo, uint64_t *end, uint64_t *next){
+	if(addr <= lo && addr + len > lo){
+		*end = (addr + len > *end) ? addr + len : *end;
+	}
+	else if(addr > lo && addr < *next){
+		*next = addr;
+	}
+}
+
+/* give the pages in [lo, hi) the file key
+ * where a writable mapping covers them, the
+ * view key where only read-only mappings or
+ * read views do, the default key elsewhere.
+ * Caller holds mmap_lock.
+ * @param[in] lo, hi: page aligned
+ */
+static void mmap_protect(uint64_t lo, uint64_t hi){
+	while(lo < hi){
+		uint64_t wend = 0, wnext = hi, rend = 0, rnext = hi, end;
+		int key;
+		for(uint64_t i = 0; i < ct_rt.mmap_n; i++){
+			ct_mmap_t *m = &ct_rt.mmap[i];
+			if(m->writable){
+				mmap_cover(m->addr, m->len, lo, &wend, &wnext);
+			}
+			else{
+				mmap_cover(m->addr, m->len, lo, &rend, &rnext);
+			}
+		}
+		for(uint64_t i = 0; i < ct_rt.view_range_n; i++){
+			mmap_cover(ct_rt.view_range[i].addr, ct_rt.view_range[i].len, lo, &rend, &rnext);
+		}
+		if(wend){
+			key = ct_rt.mpk[DAX_MPK_FILE];
+			end = wend;
+		}
+		else if(rend){
+			key = ct_rt.mpk[DAX_MPK_VIEW];
+			end = (rend < wnext) ? rend : wnext;
+		}
+		else{
+			key = ct_rt.mpk[DAX_MPK_DEFAULT];
+			end = (rnext < wnext) ? rnext : wnext;
+		}
+		end = (end < hi) ? end : hi;
+		// fails without PKU, nothing to change then
+		pkey_mprotect((void*)lo, end - lo, PROT_READ | PROT_WRITE, key);
+		lo = end;
+	}
+}
+
+/* let this thread store to the pages of an
+ * inode that the view key write protects.
+ * Caller holds its rw lock, so no view or
+ * mapping starts until it is dropped.
+ * @param[in] ino
+ * @return 1 if mmap_write_end has to
+ *         protect them again, 0 otherwise
+ */
+int mmap_write_begin(index_t ino){
+	if(VIEW_COUNT(ino) == 0 && MMAP_COUNT(ino) == 0){
+		return 0;
+	}
+	dax_grant_access(ct_rt.mpk[DAX_MPK_VIEW]);
+	return 1;
+}
+
+/* @param[in] granted, from mmap_write_begin */
+void mmap_write_end(int granted){
+	if(granted){
+		dax_stop_write(ct_rt.mpk[DAX_MPK_VIEW]);
+	}
+}
+
+/* whether the inode has a mapping. Cheap
+ * when nothing in its lock slot is mapped.
+ * Caller holds its rt or rw lock.
+ * @param[in] ino
+ */
+int inode_mapped(index_t ino){
+	int ret = 0;
+	if(MMAP_COUNT(ino) == 0){
+		return 0;
+	}
+	bitlock_acquire(&ct_rt.mmap_lock, 0);
+	for(uint64_t i = 0; i < ct_rt.mmap_n; i++){
+		if(ct_rt.mmap[i].ino == ino){
+			ret = 1;
+			break;
+		}
+	}
+	bitlock_release(&ct_rt.mmap_lock, 0);
+	return ret;
+}
+
+/* hand the page group of a removed file to
+ * its mappings. Caller holds its rt lock.
+ * @param[in] inode
+ * @return 1 if mapped, the caller keeps the
+ *         group. 0 if the caller frees it.
+ */
+int mmap_orphan(ct_inode_pt inode){
+	int ret = 0;
+	if(MMAP_COUNT(inode->i_number) == 0){
+		return 0;
+	}
+	bitlock_acquire(&ct_rt.mmap_lock, 0);
+	for(uint64_t i = 0; i < ct_rt.mmap_n; i++){
+		if(ct_rt.mmap[i].ino == inode->i_number){
+			ct_rt.mmap[i].ino = 0;
+			MMAP_COUNT(inode->i_number) --;
+			ret = 1;
+		}
+	}
+	bitlock_release(&ct_rt.mmap_lock, 0);
+	return ret;
+}
+
+/* @return whether addr is in the DAX mapping */
+int ctfs_mmap_owns(const void *addr){
+	return ct_rt.base_addr != 0 && (uint64_t)addr >= ct_rt.base_addr &&
+		(uint64_t)addr < ct_rt.base_addr + CT_DAX_ALLOC_SIZE;
+}
+
+/* private writable mappings get a copy,
+ * the file is not to see their stores
+ */
+static void *mmap_copy(void *addr, size_t len, int prot, int flags, int fd, off_t off){
+	void *ret = mmap(addr, len, prot | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0);
+	if(ret == MAP_FAILED){
+		ct_rt.errorn = ENOMEM;
+		return MAP_FAILED;
+	}
+	if(ctfs_pread(fd, ret, len, off) < 0){
+		munmap(ret, len);
+		return MAP_FAILED;
+	}
+	return ret;
+}
+
+/* map a file. Shared and read-only private
+ * mappings point into the DAX mapping. The
+ * page group is grown to hold the range and
+ * CT_MMAP_HEADROOM_LVL levels more, the size
+ * of the file does not change.
+ * MAP_FIXED is only served by a copy.
+ * @return the mapping, MAP_FAILED otherwise
+ */
+void *ctfs_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off){
+	if(fd < 0 || fd >= CT_MAX_FD || ct_rt.fd[fd].inode == NULL){
+		ct_rt.errorn = EBADF;
+		return MAP_FAILED;
+	}
+	if(len == 0 || off < 0 || (off & (CT_PAGE_SIZE - 1))){
+		ct_rt.errorn = EINVAL;
+		return MAP_FAILED;
+	}
+	ct_inode_pt inode = ct_rt.fd[fd].inode;
+	if((inode->i_mode & S_IFMT) == S_IFDIR){
+		ct_rt.errorn = ENODEV;
+		return MAP_FAILED;
+	}
+	int shared = (flags & MAP_TYPE) == MAP_SHARED || (flags & MAP_TYPE) == MAP_SHARED_VALIDATE;
+	if(shared && (prot & PROT_WRITE) && (ct_rt.fd[fd].flags & O_ACCMODE) != O_RDWR){
+		ct_rt.errorn = EACCES;
+		return MAP_FAILED;
+	}
+	if((!shared && (prot & PROT_WRITE)) || (flags & MAP_FIXED)){
+		if(shared){
+			ct_rt.errorn = EINVAL;
+			return MAP_FAILED;
+		}
+		return mmap_copy(addr, len, prot, (flags & ~MAP_TYPE) | MAP_PRIVATE, fd, off);
+	}
+	len = (len + CT_PAGE_SIZE - 1) & ~(CT_PAGE_SIZE - 1);
+	uint64_t need = off + len;
+	index_t inode_n = inode->i_number;
+	void *ret = MAP_FAILED;
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	// rt keeps unlink out, rw keeps resize out
+	inode_rt_lock(inode_n);
+	inode_rw_lock(inode_n);
+	if(ct_rt.mmap_n == CT_MAX_MMAP){
+		ct_rt.errorn = ENOMEM;
+		goto out;
+	}
+	pgg_level_t lvl = pgg_get_lvl(need);
+	// the group cannot move once mapped,
+	// reserve room for the file to grow
+	pgg_level_t room = lvl + CT_MMAP_HEADROOM_LVL;
+	room = (room > CT_MMAP_HEADROOM_MAX_LVL) ? CT_MMAP_HEADROOM_MAX_LVL : room;
+	room = (room < lvl) ? lvl : room;
+	if(!inode_mapped(inode_n) && inode->i_level < room){
+		size_t size = inode->i_size;
+		if(inode_resize_lvl(inode, room, size) < 0 &&
+			(room == lvl || inode_resize_lvl(inode, lvl, size) < 0)){
+			ct_rt.errorn = ENOMEM;
+			goto out;
+		}
+		inode->i_size = size;
+		inode_wb(inode);
+		// the rest of a new group is stale
+		if(size < need){
+			void *tail = (void*)((uint64_t)CT_REL2ABS(inode->i_block) + size);
+			int granted = mmap_write_begin(inode_n);
+			memset(tail, 0, need - size);
+			mmap_write_end(granted);
+			cache_wb(tail, need - size);
+			_mm_sfence();
+		}
+	}
+	if(need > pgg_lvl_size(inode->i_level)){
+		// already mapped, past its headroom
+		ct_rt.errorn = ENOMEM;
+		goto out;
+	}
+	ret = (void*)((uint64_t)CT_REL2ABS(inode->i_block) + off);
+	bitlock_acquire(&ct_rt.mmap_lock, 0);
+	ct_rt.mmap[ct_rt.mmap_n ++] = (ct_mmap_t){
+		.addr = (uint64_t)ret,
+		.len = len,
+		.ino = inode_n,
+		.block = inode->i_block,
+		.level = inode->i_level,
+		.writable = (prot & PROT_WRITE) != 0
+	};
+	MMAP_COUNT(inode_n) ++;
+	mmap_protect((uint64_t)ret, (uint64_t)ret + len);
+	bitlock_release(&ct_rt.mmap_lock, 0);
+out:
+	inode_rw_unlock(inode_n);
+	inode_rt_unlock(inode_n);
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	return ret;
+}
+
+/* unmap a range returned by ctfs_mmap,
+ * whole or in part
+ * @return 0 if success, -1 otherwise
+ */
+int ctfs_munmap(void *addr, size_t len){
+	uint64_t lo = (uint64_t)addr;
+	uint64_t hi = lo + ((len + CT_PAGE_SIZE - 1) & ~(CT_PAGE_SIZE - 1));
+	relptr_t freed[CT_MAX_MMAP];
+	pgg_level_t freed_lvl[CT_MAX_MMAP];
+	uint64_t nfreed = 0, i;
+	if(len == 0 || (lo & (CT_PAGE_SIZE - 1))){
+		ct_rt.errorn = EINVAL;
+		return -1;
+	}
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	bitlock_acquire(&ct_rt.mmap_lock, 0);
+	// a hole in the middle takes one more entry
+	uint64_t split = 0;
+	for(i = 0; i < ct_rt.mmap_n; i++){
+		split += ct_rt.mmap[i].addr < lo && ct_rt.mmap[i].addr + ct_rt.mmap[i].len > hi;
+	}
+	if(ct_rt.mmap_n + split > CT_MAX_MMAP){
+		bitlock_release(&ct_rt.mmap_lock, 0);
+		dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+		ct_rt.errorn = ENOMEM;
+		return -1;
+	}
+	for(i = 0; i < ct_rt.mmap_n; ){
+		ct_mmap_t *m = &ct_rt.mmap[i];
+		uint64_t end = m->addr + m->len;
+		if(end <= lo || m->addr >= hi){
+			i ++;
+			continue;
+		}
+		if(m->addr < lo && end > hi){
+			// keep the tail
+			ct_rt.mmap[ct_rt.mmap_n ++] = (ct_mmap_t){
+				.addr = hi, .len = end - hi, .ino = m->ino, .block = m->block, .level = m->level,
+				.writable = m->writable};
+			if(m->ino){
+				MMAP_COUNT(m->ino) ++;
+			}
+		}
+		if(m->addr < lo){
+			m->len = lo - m->addr;
+			i ++;
+		}
+		else if(end > hi){
+			m->len = end - hi;
+			m->addr = hi;
+			i ++;
+		}
+		else{
+			if(m->ino){
+				MMAP_COUNT(m->ino) --;
+			}
+			else{
+				freed[nfreed] = m->block;
+				freed_lvl[nfreed ++] = m->level;
+			}
+			*m = ct_rt.mmap[-- ct_rt.mmap_n];
+		}
+	}
+	// groups of removed files no longer mapped
+	for(uint64_t j = 0; j < nfreed; j++){
+		for(i = 0; i < ct_rt.mmap_n && ct_rt.mmap[i].block != freed[j]; i++);
+		if(i == ct_rt.mmap_n){
+			for(i = j + 1; i < nfreed && freed[i] != freed[j]; i++);
+			if(i == nfreed){
+				pgg_deallocate(freed_lvl[j], freed[j]);
+			}
+		}
+	}
+	mmap_protect(lo, hi);
+	bitlock_release(&ct_rt.mmap_lock, 0);
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	return 0;
+}
+
+/* write a mapped range back to pmem
+ * @return 0
+ */
+int ctfs_msync(void *addr, size_t len, int flags){
+	cache_wb(addr, len);
+	_mm_sfence();
+	return 0;
+}
+
+static pthread_key_t view_reader_key;
+static pthread_once_t view_reader_once = PTHREAD_ONCE_INIT;
+static __thread ct_reader_t *view_reader;
+
+/* whether an optimistic read of the lock
+ * slot that began by epoch is in flight.
+ * Pair with a full barrier after the seq
+ * bump, a read not seen here then waits.
+ * @param[in] slot
+ * @param[in] epoch, UINT64_MAX for any
+ */
+static int view_readers(index_t slot, uint64_t epoch){
+	for(ct_reader_t *r = ct_rt.reader_list; r != NULL; r = r->next){
+		uint64_t e = *(volatile uint64_t*)&r->epoch;
+		if(e && e <= epoch && *(volatile uint64_t*)&r->slot == slot){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* free the retired groups of a lock slot
+ * if it has no views and no reads older
+ * than them. Caller holds view_lock.
+ * @param[in] slot
+ */
+static void view_reap(index_t slot){
+	for(uint64_t i = 0; i < ct_rt.view_retired_n; ){
+		ct_view_retired_t *r = &ct_rt.view_retired[i];
+		if(r->slot != slot || ct_rt.inode_lock[slot].views || 
+			view_readers(slot, r->epoch)){
+			i ++;
+			continue;
+		}
+		pgg_deallocate(r->level, r->block);
+		*r = ct_rt.view_retired[-- ct_rt.view_retired_n];
+	}
+}
+
+static void view_drop(index_t ino){
+	// a full barrier, then see a group retired
+	// by a mover that still counted this view
+	if(__sync_sub_and_fetch(&VIEW_COUNT(ino), 1) == 0 && ct_rt.view_retired_n){
+		bitlock_acquire(&ct_rt.view_lock, 0);
+		view_reap(ino % CT_INODE_LOCK_SLOTS);
+		bitlock_release(&ct_rt.view_lock, 0);
+	}
+}
+
+static void __view_reader_free(void *arg){
+	ct_reader_t *r = arg;
+	r->epoch = 0;
+	r->free = 1;
+}
+
+static void __view_reader_key_init(){
+	pthread_key_create(&view_reader_key, __view_reader_free);
+}
+
+/* the reader record of the calling thread,
+ * one left by an exited thread if any
+ * @return record, NULL if out of memory
+ */
+static ct_reader_t *view_reader_local(){
+	if(likely(view_reader != NULL)){
+		return view_reader;
+	}
+	pthread_once(&view_reader_once, __view_reader_key_init);
+	ct_reader_t *r;
+	for(r = ct_rt.reader_list; r != NULL; r = r->next){
+		if(r->free && __sync_bool_compare_and_swap(&r->free, 1, 0)){
+			break;
+		}
+	}
+	if(r == NULL){
+		r = aligned_alloc(64, sizeof(ct_reader_t));
+		if(r == NULL){
+			return NULL;
+		}
+		*r = (ct_reader_t){0};
+		do{
+			r->next = ct_rt.reader_list;
+		}while(!__sync_bool_compare_and_swap(&ct_rt.reader_list, r->next, r));
+	}
+	pthread_setspecific(view_reader_key, r);
+	view_reader = r;
+	return r;
+}
+
+/* announce an optimistic read of a file, 
+ * so a mover copies instead of swapping and
+ * keeps its old group until the read ends.
+ * Only the calling thread's record is written.
+ * @param[in] ino
+ * @return 0, -1 if out of memory: take the
+ *         shared lock instead
+ */
+int view_read_begin(index_t ino){
+	ct_reader_t *r = view_reader_local();
+	if(unlikely(r == NULL)){
+		return -1;
+	}
+	r->slot = ino % CT_INODE_LOCK_SLOTS;
+	r->epoch = *(volatile uint64_t*)&ct_rt.view_epoch + 1;
+	// before the seq load of inode_read_begin
+	__sync_synchronize();
+	return 0;
+}
+
+/* the read of view_read_begin is done,
+ * free what waited for it
+ */
+void view_read_end(){
+	ct_reader_t *r = view_reader;
+	index_t slot = r->slot;
+	// the copy is done before this shows
+	__asm__ __volatile__("" ::: "memory");
+	*(volatile uint64_t*)&r->epoch = 0;
+	if(unlikely(*(volatile uint64_t*)&ct_rt.view_retired_n)){
+		__sync_synchronize();
+		bitlock_acquire(&ct_rt.view_lock, 0);
+		view_reap(slot);
+		bitlock_release(&ct_rt.view_lock, 0);
+	}
+}
+
+/* move the first pages of a file to a new 
+ * group. Swapped, unless views or reads may
+ * point into the old group: those pages are
+ * copied and stay as they are. Caller holds
+ * its rw lock.
+ * @param[in] ino
+ * @param[in] new, old: page groups
+ * @param[in] npgs, pages to move
+ */
+void view_move(index_t ino, relptr_t new, relptr_t old, uint64_t npgs){
+	// the seq bump of the rw lock is ordered
+	// before this, so later views and reads retry
+	__sync_synchronize();
+	if(VIEW_COUNT(ino) || view_readers(ino % CT_INODE_LOCK_SLOTS, UINT64_MAX)){
+		avx_cpy(CT_REL2ABS(new), CT_REL2ABS(old), npgs << 12);
+		_mm_sfence();
+		return;
+	}
+	dax_ioctl_pswap_t pswap = {
+		.ufirst = CT_REL2ABS(new),
+		.usecond = CT_REL2ABS(old),
+		.npgs = npgs
+	};
+	dax_pswap(&pswap);
+}
+
+/* keep the old page group of a file for
+ * its views and optimistic reads. Caller
+ * holds its rw lock, so this never waits.
+ * @param[in] ino
+ * @param[in] level, block: the old group
+ * @return 1 if in use, the group is freed once
+ *         not. 0 if the caller frees it.
+ */
+int view_retire(index_t ino, pgg_level_t level, relptr_t block){
+	index_t slot = ino % CT_INODE_LOCK_SLOTS;
+	__sync_synchronize();
+	if(VIEW_COUNT(ino) == 0 && !view_readers(slot, UINT64_MAX)){
+		return 0;
+	}
+	bitlock_acquire(&ct_rt.view_lock, 0);
+	if(ct_rt.view_retired_n == ct_rt.view_retired_cap){
+		uint64_t cap = ct_rt.view_retired_cap ? 
+			ct_rt.view_retired_cap * 2 : CT_VIEW_RETIRED_INIT;
+		ct_view_retired_t *t = realloc(ct_rt.view_retired, cap * sizeof(ct_view_retired_t));
+		if(t == NULL){
+			// out of memory: the group leaks
+			// rather than freed under a view
+			bitlock_release(&ct_rt.view_lock, 0);
+			return 1;
+		}
+		ct_rt.view_retired = t;
+		ct_rt.view_retired_cap = cap;
+	}
+	// reads that begin after this see the
+	// rw lock held, and then the new group
+	uint64_t epoch = __sync_add_and_fetch(&ct_rt.view_epoch, 1);
+	ct_rt.view_retired[ct_rt.view_retired_n ++] = (ct_view_retired_t){
+		.block = block, .level = level, .slot = slot, .epoch = epoch};
+	// the last view may have left already
+	__sync_synchronize();
+	view_reap(slot);
+	bitlock_release(&ct_rt.view_lock, 0);
+	return 1;
+}
+
+/* borrow a range of a file instead of 
+ * copying it. The pointer stays valid while
+ * the file is resized, truncated, moved or
+ * removed, until ctfs_read_view_release. Later
+ * writes in place show through it. Its pages
+ * get the file key, as a mapping does.
+ * @param[in] fd, offset, count: as ctfs_pread
+ * @param[out] view
+ * @return bytes in the view, -1 otherwise, 
+ *         EAGAIN with CT_MAX_VIEW views held
+ */
+ssize_t ctfs_read_view(int fd, off_t offset, size_t count, struct ctfs_view *view){
+	if(fd < 0 || fd >= CT_MAX_FD || ct_rt.fd[fd].inode == NULL ||
+		(ct_rt.fd[fd].flags & O_WRONLY)){
+		ct_rt.errorn = EBADF;
+		return -1;
+	}
+	if(offset < 0){
+		ct_rt.errorn = EINVAL;
+		return -1;
+	}
+	ct_inode_pt inode = ct_rt.fd[fd].inode;
+	if((inode->i_mode & S_IFMT) == S_IFDIR){
+		ct_rt.errorn = EISDIR;
+		return -1;
+	}
+	index_t inode_n = inode->i_number;
+	size_t size, n = 0;
+	relptr_t block;
+	uint32_t seq;
+	int tries = 0;
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	// count the view first, then snapshot. A
+	// mover either sees it or makes this retry
+	while(1){
+		if(unlikely(tries == CT_PREAD_RETRY)){
+			inode_rw_lock_shared(inode_n);
+		}
+		else{
+			seq = inode_read_begin(inode_n);
+		}
+		__sync_fetch_and_add(&VIEW_COUNT(inode_n), 1);
+		size = *(volatile size_t*)&inode->i_size;
+		block = *(volatile relptr_t*)&inode->i_block;
+		if(unlikely(tries == CT_PREAD_RETRY)){
+			inode_rw_unlock_shared(inode_n);
+			break;
+		}
+		if(likely(!inode_read_retry(inode_n, seq))){
+			break;
+		}
+		view_drop(inode_n);
+		tries ++;
+	}
+	if((size_t)offset < size){
+		n = (offset + count >= size) ? size - offset : count;
+	}
+	if(n == 0){
+		view_drop(inode_n);
+		*view = (struct ctfs_view){0};
+	}
+	else{
+		uint64_t addr = (uint64_t)CT_REL2ABS(block) + offset;
+		uint64_t lo = addr & ~(CT_PAGE_SIZE - 1);
+		uint64_t hi = (addr + n + CT_PAGE_SIZE - 1) & ~(CT_PAGE_SIZE - 1);
+		bitlock_acquire(&ct_rt.mmap_lock, 0);
+		if(ct_rt.view_range_n == CT_MAX_VIEW){
+			bitlock_release(&ct_rt.mmap_lock, 0);
+			view_drop(inode_n);
+			*view = (struct ctfs_view){0};
+			ct_rt.errorn = EAGAIN;
+			dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+			return -1;
+		}
+		ct_rt.view_range[ct_rt.view_range_n ++] = (ct_view_range_t){
+			.addr = lo, .len = hi - lo};
+		mmap_protect(lo, hi);
+		bitlock_release(&ct_rt.mmap_lock, 0);
+		*view = (struct ctfs_view){
+			.addr = (void*)addr,
+			.len = n,
+			.ino = inode_n
+		};
+	}
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	return n;
+}
+
+/* give back a view of ctfs_read_view
+ * @param[in] view
+ */
+void ctfs_read_view_release(struct ctfs_view *view){
+	if(view->len == 0){
+		return;
+	}
+	uint64_t lo = (uint64_t)view->addr & ~(CT_PAGE_SIZE - 1);
+	uint64_t hi = ((uint64_t)view->addr + view->len + CT_PAGE_SIZE - 1) & ~(CT_PAGE_SIZE - 1);
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	// back to the default key before the
+	// group can be freed and reused
+	bitlock_acquire(&ct_rt.mmap_lock, 0);
+	for(uint64_t i = 0; i < ct_rt.view_range_n; i++){
+		if(ct_rt.view_range[i].addr == lo && ct_rt.view_range[i].len == hi - lo){
+			ct_rt.view_range[i] = ct_rt.view_range[-- ct_rt.view_range_n];
+			break;
+		}
+	}
+	mmap_protect(lo, hi);
+	bitlock_release(&ct_rt.mmap_lock, 0);
+	view_drop(view->ino);
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	*view = (struct ctfs_view){0};
+}
@@ -3,8 +3,14 @@
  * s
  * 
  ****************************/
+#define _GNU_SOURCE
+#include <sched.h>
 #include "ctfs_pgg.h"
 
+static pthread_key_t pgg_mag_key;
+static pthread_once_t pgg_mag_once = PTHREAD_ONCE_INIT;
+static __thread pgg_magazine_t *pgg_mag;
+
 
 const uint64_t pgg_size[10] = {
 	CT_PGGSIZE_LV0,
@@ -49,7 +55,8 @@ pgg_level_t pgg_get_lvl(uint64_t size){
 			if(size > CT_LIMITSIZE_LV7){
 				if(size > CT_LIMITSIZE_LV8){
 					if(size > CT_LIMITSIZE_LV9){
-						return PGG_LVL10;
+						// a run of L9s
+						return PGG_LVL8 + (pgg_level_t)((size + CT_PGGSIZE_LV9 - 1) / CT_PGGSIZE_LV9);
 					}
 					else{
 						return PGG_LVL9;
@@ -105,7 +112,7 @@ pgg_level_t pgg_get_lvl(uint64_t size){
 void pgg_alloc_prot_file_add(pgg_header_pt header, relptr_t target){
 	int64_t index;
 retry:
-	index = find_free_bit(&ct_rt.super_blk->alloc_prot_bmp, 
+	index = find_free_bit_tiny_from(&ct_rt.super_blk->alloc_prot_bmp, 
 		CT_ALLOC_PROT_SIZE, ct_rt.super_blk->alloc_prot_clock + 1);
 	if(index == -1){
 		goto retry;
@@ -118,25 +125,65 @@ retry:
 	cache_wb_one(&ct_rt.super_blk->alloc_prot_bmp);
 }
 
+/* sum the sub-PMD request histogram
+ * of all arenas and the packages carved
+ * @param[out] requests, 3 levels
+ * @param[out] carved, 3 levels, may be NULL
+ */
+void pgg_hist(uint64_t *requests, uint64_t *carved){
+	for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+		requests[lvl] = 0;
+		for(uint16_t i=0; i<CT_PGG_ARENAS; i++){
+			requests[lvl] += ct_rt.pgg_arena[i].hist[lvl];
+		}
+		if(carved){
+			carved[lvl] = ct_rt.pgg_carved[lvl];
+		}
+	}
+}
+
 /* provide the sub_pmd package level
  * for next sub_pmd package
- * allocation. 
+ * allocation. Each level earns credits
+ * in proportion to the packages its 
+ * requests use up, the richest is picked.
+ * Round-robin until there are requests.
  * @return level
  */
 pgg_level_t __pgg_sub_pmd_lvl_hint(){
-	pgg_level_t ret = ct_rt.super_blk->next_sub_lvl;
-	if(ret == PGG_LVL2){
-		ct_rt.super_blk->next_sub_lvl = PGG_LVL0;
+	pgg_level_t ret, next;
+	uint64_t req[PGG_LVL3];
+	uint64_t demand[PGG_LVL3];
+	uint64_t total = 0;
+	pgg_hist(req, NULL);
+	for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+		// in packages, scaled
+		demand[lvl] = (req[lvl] << 16) / pgg_subpmd_count_per_pkg[lvl];
+		total += demand[lvl];
 	}
-	else{
-		ct_rt.super_blk->next_sub_lvl++;
+	if(total == 0){
+		// arenas build packages concurrently
+		do{
+			ret = ct_rt.super_blk->next_sub_lvl;
+			next = (ret == PGG_LVL2) ? PGG_LVL0 : ret + 1;
+		}while(!__sync_bool_compare_and_swap(&ct_rt.super_blk->next_sub_lvl, ret, next));
+		return ret;
+	}
+	bitlock_acquire(&ct_rt.pgg_lock, 1);
+	ret = PGG_LVL0;
+	for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+		ct_rt.pgg_sub_credit[lvl] += (demand[lvl] << 16) / total;
+		if(ct_rt.pgg_sub_credit[lvl] > ct_rt.pgg_sub_credit[ret]){
+			ret = lvl;
+		}
 	}
+	ct_rt.pgg_sub_credit[ret] -= (int64_t)1 << 16;
+	bitlock_release(&ct_rt.pgg_lock, 1);
 	return ret;
 }
 
 /* build a sub pmd header at given
- * level. update all the sub_pmd_cap
- * in the header group.
+ * level and mark it in the parent.
  * @param[in] parent, a lvl4 header
  * @param[in] index
  * @param[in] level
@@ -156,115 +203,11 @@ void __pgg_build_sub_pmd(pgg_header_pt parent, uint8_t index, pgg_level_t level)
 	target->parent = CT_ABS2REL(parent);
 	// flush cache
 	cache_wb_one(target);
+	__sync_fetch_and_add(&ct_rt.pgg_carved[level], 1);
 
-	//handle upper level
-	pgg_header_pt header = parent;
 	PGG_STATE_STORE(parent->pmd_type, index, level);
+	PGG_STATE_STORE(parent->state_map, index, PGG_STATE_SUB);
 	cache_wb_one(parent);
-	while(PGG_SUBPMD_PRF_TEST(header->sub_pmd_cap, level) == 0){
-#ifdef CTFS_DEBUG
-		pgg_header_t hd2 = *header;
-#endif
-		header->sub_pmd_cap |= 0b010001 << level;
-		// flush cache
-		cache_wb_one(header);
-		if(header->parent_pgg != 0){
-#ifdef CTFS_DEBUG
-			pgg_header_t par = *header;
-#endif
-			header = CT_REL2ABS(header->parent_pgg);
-			// goto the upper level
-#ifdef CTFS_DEBUG
-			pgg_header_t hd2 = *header;
-#endif
-		}
-		else{
-			assert(header->level == PGG_LVL9);
-			break;
-		}
-	}
-}
-
-/* check the availability of current 
- * pgg. if the pgg becomes full, 
- * update the capability of higher level.
- * @param[in] header
- */
-void __pgg_update_cap_alloc(pgg_header_pt header){
-	pgg_header_pt current_header = header;
-	pgg_level_t current_lvl = header->level;
-	pgg_level_t max_cap = 0;
-
-	// stop when current header doesn't need to update or max_level tops
-	while(current_lvl != 9){
-		max_cap = 0;
-		pgg_level_t old_cap = current_header->cap_lvl;
-		// check the maximum capability level of all 8 blocks (including first sub ppg)
-		for(uint16_t i=0; i<8; i++){
-			if(PGG_STATE_LOAD(current_header->state_map, i) == PGG_STATE_EMPTY){
-				// if any of the 8 blocks is empty, level - 1 is definitely avaliable, no change is required
-				return;
-			}else if(current_lvl != PGG_LVL4 && PGG_STATE_LOAD(current_header->state_map, i) == PGG_STATE_SUB){
-				// if the block is used as sub ppg, we check the capability and pass to parent
-				pgg_header_pt child = PGG_GROUP_AT2HEADER(PGG_HEADER2GROUP(current_header), current_header->level - 1, i);
-				max_cap = (max_cap > child->cap_lvl)? max_cap : child->cap_lvl;
-			}else{
-				// if the block is used as data, then we pass
-				continue;
-			}
-		}
-#ifdef CTFS_DEBUG
-		ctfs_debug_temp = current_header->state_map;
-#endif
-		if(old_cap == max_cap){
-			return;
-		}else{
-			current_header->cap_lvl = max_cap;
-			cache_wb_one(current_header);
-		}
-#if CTFS_DEBUG > 0
-		pgg_header_t h = *current_header;
-		pgg_header_t h2 = *(pgg_header_t*)CT_REL2ABS(current_header->parent_pgg);
-#endif
-		current_header = CT_REL2ABS(current_header->parent_pgg);
-		assert(current_lvl == current_header->level - 1);
-		current_lvl ++;
-	}
-}
-
-/* check the availability of current 
- * pgg. if the pgg becomes not full, 
- * update the capability of higher level.
- * @param[in] header
- */
-void __pgg_update_cap_dealloc(pgg_header_pt header){
-	if(unlikely(header->cap_lvl != header->level - 1)){
-		assert(header->cap_lvl < header->level -1);
-		pgg_header_pt current_header = header;
-		pgg_level_t current_lvl = header->level;
-		pgg_level_t min_cap = current_lvl - 1;
-		header->cap_lvl = min_cap;
-		cache_wb_one(header);
-
-		// stop when current header doesn't need to update or max_level tops
-		while(current_lvl != 8){
-			current_header = CT_REL2ABS(current_header->parent_pgg);
-#ifdef CTFS_DEBUG
-			pgg_header_t hd = *current_header;
-#endif
-			assert(current_lvl + 1 == current_header->level);
-			current_lvl ++;
-
-			if(current_header->cap_lvl >= min_cap){
-				return;
-			}
-			current_header->cap_lvl = min_cap;
-			cache_wb_one(current_header);
-		}
-	}
-	else{
-		return;
-	}
 }
 
 /* Build new sub page group.
@@ -280,7 +223,6 @@ void __pgg_update_cap_dealloc(pgg_header_pt header){
 void __pgg_new_subpgg(pgg_header_pt header, pgg_header_pt parent_header, pgg_level_t level){
 	assert(level <= 9);
 	pgg_hd_group_pt group = PGG_HEADER2GROUP(header);
-	/* create sub-pmd package */
 	/* Fill the headers */
 	pgg_header_pt hd = NULL;
 	for(uint16_t i=level; i>3; i-- ){
@@ -288,7 +230,6 @@ void __pgg_new_subpgg(pgg_header_pt header, pgg_header_pt parent_header, pgg_lev
 		memset(hd, 0, sizeof(pgg_header_t));
 		hd->parent_pgg = (i == 9) ? 0 : CT_ABS2REL(&group->header[9-i-1]);
 		hd->state_map = PGG_STATE_INIT;
-		hd->cap_lvl = i - 1;
 		hd->level = i;    
 		cache_wb_one(hd);
 	}
@@ -303,72 +244,7 @@ void __pgg_new_subpgg(pgg_header_pt header, pgg_header_pt parent_header, pgg_lev
 	
 }
 
-/* Allocate a lvl3 and upper file
- * It's a recursive function
- * which will return at the level
- * it requests. 
- * @param[in]   level
- * @param[in]   header
- * @return      relative pointer to the file
- */
-relptr_t __pgg_allocate_big(pgg_level_t level, pgg_header_pt header){
-	if(level +1 == header->level){
-		// Just find an empty spot.
-		uint16_t map = header->state_map;
-		for(uint16_t i=1; i<8; i++){
-			if(PGG_STATE_LOAD(map, i) == PGG_STATE_EMPTY){
-				relptr_t ret = CT_ABS2REL((uint64_t)header + (pgg_size[level] * i));
-				// report to allocation protector
-				// pgg_alloc_prot_file_add(header, ret);
-				PGG_STATE_STORE(header->state_map, i, PGG_STATE_FILE);
-#ifdef CTFS_DEBUG
-				ctfs_debug_temp  = header->state_map;
-#endif			
-				__pgg_update_cap_alloc(header);
-				return ret;
-			}
-		}
-		/*********BUG!!!!!!********/
-	}
-	else{
-		uint16_t map = header->state_map;
-		for(uint16_t i=0; i<8; i++){
-			if(PGG_STATE_LOAD(map, i) == PGG_STATE_SUB){
-				pgg_header_pt child = PGG_GROUP_AT2HEADER(PGG_HEADER2GROUP(header),header->level-1, i);
-				assert(child->level == header->level - 1);
-#ifdef CTFS_DEBUG
-				pgg_hd_group_t gp2= *PGG_HEADER2GROUP(header);
-				pgg_header_t hd2 = *header;
-				pgg_header_t chd = *child;
-#endif
-				if(child->cap_lvl < level){
-					continue;
-				}
-
-				return __pgg_allocate_big(level, child);
-			}
-		}
-		// no existing sub pgg available. create a new one.
-		for(uint16_t i=1; i<8; i++){
-			if(PGG_STATE_LOAD(map, i) == PGG_STATE_EMPTY){
-				pgg_level_t child_lvl = header->level - 1;
-				pgg_header_pt child = PGG_GROUP_AT2HEADER(PGG_HEADER2GROUP(header),child_lvl, i);
-				__pgg_new_subpgg(child, header, child_lvl);
-				assert(child->level == header->level - 1);
-				header->state_map |= PGG_STATE_SUB << (2*i);
-				cache_wb_one(header);
-				__pgg_update_cap_alloc(header);
-				return __pgg_allocate_big(level, child);
-			}
-		}
-		/*********BUG!!!!!!********/
-	}
-	// pgg_hd_group_t gp = *PGG_HEADER2GROUP(header);
-	assert(0);
-	return 0;
-}
-
-/* helper for __pgg_allocate_small
+/* helper for the small allocation
  * alocate a sub_pmd file
  * given a subpmd header
  * @param[in]   level
@@ -379,16 +255,16 @@ relptr_t __pgg_sub_pmd_alloc(pgg_level_t level, pgg_subpmd_header_pt header){
 	assert(level < PGG_LVL3);
 	assert(level == header->level);
 	assert(header->taken < pgg_subpmd_count_per_pkg[level]);
-	int64_t target = (level == PGG_LVL2) ? find_free_bit_tiny(header->bitmap, pgg_subpmd_count_per_pkg[level]) :
+	// L1 and L2 packages fit in one word
+	int64_t target = (level != PGG_LVL0) ? find_free_bit_tiny(header->bitmap, pgg_subpmd_count_per_pkg[level]) :
 	find_free_bit(header->bitmap, pgg_subpmd_count_per_pkg[level], header->bitmap_hint);
 
 	assert(target != -1);
-	relptr_t ret = CT_ABS2REL((uint64_t)header + (pgg_size[level] * target));
+	relptr_t ret = CT_ABS2REL((uint64_t)PGG_HEADER2GROUP(header) + (pgg_size[level] * target));
 	set_bit(header->bitmap, (size_t)target);
 	header->bitmap_hint = (uint8_t)target;
-	// pgg_alloc_prot_file_add(header, ret);
-	// !!!!Need rethink above! !!!!!!!!!!!!!
-	// How to protect sub_pmd allocation
+	// a slot no inode took before a crash is
+	// cleared by pgg_reclaim at the next init
 	header->taken ++;
 #ifdef DAX_DEBUGGING
 		pgg_subpmd_header_t gr = *header;
@@ -397,170 +273,729 @@ relptr_t __pgg_sub_pmd_alloc(pgg_level_t level, pgg_subpmd_header_pt header){
 	return ret;
 }
 
-/* sub_pmd file allocation
- * three scenario:
- * 1. found a preferred pgg
- * 2. found an empty lvl3 pgg
- * 3. found an empty upper pgg
- * @param[in]   level
- * @param[in]   header
- * @return      relative pointer to the target
+/* store the state of a L3 and upper
+ * slot in its parent header
+ * @param[in] rel, the slot
+ * @param[in] level, level of the slot
+ * @param[in] state
  */
-relptr_t __pgg_allocate_small(pgg_level_t level, pgg_header_pt header){
-	assert(level < PGG_LVL3);
-	pgg_hd_group_pt group;
-	pgg_header_pt child;
-	pgg_subpmd_header_pt target = NULL;
-	int found;
-	if(PGG_SUBPMD_PRF_TEST(header->sub_pmd_cap, level)){
-		// case: preferred
-		while(1){
-			// iterate each layer
-			found = 0;
-			group = PGG_HEADER2GROUP(header);
-#ifdef DAX_DEBUGGING
-		pgg_hd_group_t gr = *group;
-#endif
-			for(uint16_t i=0; i<8; i++){
-				if(PGG_STATE_LOAD(header->state_map, i) == PGG_STATE_SUB){
-					child = PGG_GROUP_AT2HEADER(group, header->level - 1, i);
-					if(PGG_SUBPMD_PRF_TEST(child->sub_pmd_cap, level)){
-						header = child;
-						found = 1;
-						break;                        
-					}
-				}
+static void __pgg_mark(relptr_t rel, pgg_level_t level, uint16_t state){
+	pgg_header_pt parent = PGG_GROUP2HEADER(PGG_REL2HD_GROUP(rel, level + 1), level + 1);
+	uint8_t index = PGG_BIGFILE2INDEX(rel, level);
+	assert(parent->level == level + 1);
+	assert(index != 0);
+	PGG_STATE_STORE(parent->state_map, index, state);
+	cache_wb_one(parent);
+}
+
+/* turn an empty slot into a 
+ * sub page group
+ * @param[in] rel, the slot
+ * @param[in] level, level of the slot
+ */
+static void __pgg_open_sub(relptr_t rel, pgg_level_t level){
+	pgg_header_pt parent = PGG_GROUP2HEADER(PGG_REL2HD_GROUP(rel, level + 1), level + 1);
+	pgg_hd_group_pt group = CT_REL2ABS(rel);
+	__pgg_new_subpgg(PGG_GROUP2HEADER(group, level), parent, level);
+	__pgg_mark(rel, level, PGG_STATE_SUB);
+}
+
+/* register the empty slots and the 
+ * sub-PMD package of a freshly opened
+ * sub page group to the index.
+ * @param[in] rel, the sub page group
+ * @param[in] level, level of the sub page group
+ * @param[in] arena, owner of the slots, NULL for global
+ */
+static void __pgg_index_add_new(relptr_t rel, pgg_level_t level, pgg_arena_t *arena){
+	pgg_subpmd_header_pt sp = &((pgg_hd_group_pt)CT_REL2ABS(rel))->subpmd_header;
+	if(arena){
+		assert(level == PGG_LVL4);
+		uint64_t index = PGG_BIGFILE2INDEX(rel, PGG_LVL4) * 8;
+		arena->free3 |= (uint64_t)0b011111110 << index;
+		arena->pkg[sp->level] |= (uint64_t)0b01 << index;
+		return;
+	}
+	for(pgg_level_t lvl = level - 1; lvl >= PGG_LVL3; lvl--){
+		for(uint16_t i = 1; i < 8; i++){
+			ct_sbmp_set(&ct_rt.pgg_free[lvl], rel / pgg_size[lvl] + i);
+		}
+	}
+	ct_sbmp_set(&ct_rt.pgg_pkg[sp->level], rel / pgg_size[PGG_LVL3]);
+}
+
+/* find a run of free L9s in 
+ * the lvl9 bitmap. Caller holds pgg_lock.
+ * @param[in] n, number of L9s
+ * @return index of the first L9, -1 if none
+ */
+static int16_t __pgg_l9_find(uint16_t n){
+	uint64_t bmp = *(uint64_t*)ct_rt.lvl9_bmp;
+	uint64_t run = ((uint64_t)0b01 << n) - 1;
+	for(uint16_t i=0; i + n <= CT_DAX_ALLOC_SIZE / CT_PGGSIZE_LV9; i++){
+		if((bmp & (run << i)) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* set or clear a run of L9s
+ * in the lvl9 bitmap
+ * @param[in] index, of the first L9
+ * @param[in] n, number of L9s
+ * @param[in] used
+ */
+static void __pgg_l9_mark(uint16_t index, uint16_t n, int used){
+	uint64_t *bmp = ct_rt.lvl9_bmp;
+	uint64_t run = (((uint64_t)0b01 << n) - 1) << index;
+	if(used){
+		*bmp |= run;
+	}
+	else{
+		*bmp &= ~run;
+	}
+	cache_wb_one(bmp);
+}
+
+/* build a new L9 tree on a free L9
+ * and chain it after the last one.
+ * Caller holds pgg_lock.
+ * @return 0 if success, -1 if no L9 left
+ */
+static int __pgg_l9_grow(){
+	int16_t index = __pgg_l9_find(1);
+	if(index == -1){
+		return -1;
+	}
+	relptr_t rel = (relptr_t)index * CT_PGGSIZE_LV9;
+	pgg_header_pt header = &((pgg_hd_group_pt)CT_REL2ABS(rel))->header[0];
+	pgg_header_pt last = &ct_rt.first_pgg->header[0];
+	while(last->next_l9 != 0){
+		last = &((pgg_hd_group_pt)CT_REL2ABS(last->next_l9))->header[0];
+	}
+	__pgg_new_subpgg(header, header, PGG_LVL9);
+	last->next_l9 = rel;
+	cache_wb_one(last);
+	// a crash before this is repaired by the rebuild
+	__pgg_l9_mark(index, 1, 1);
+	__pgg_index_add_new(rel, PGG_LVL9, NULL);
+	return 0;
+}
+
+/* pop an empty slot from the global
+ * index. Opens a higher level slot
+ * if none is left at this level.
+ * Caller holds pgg_lock.
+ * @param[in] level, 3 to 8
+ * @return relative pointer, 0 if out of space
+ */
+static relptr_t __pgg_index_pop(pgg_level_t level){
+	int64_t bit = ct_sbmp_first(&ct_rt.pgg_free[level]);
+	if(bit == -1){
+		if(level == PGG_LVL8){
+			if(__pgg_l9_grow()){
+				return 0;
 			}
-			assert(found);
-			if(header->level == PGG_LVL4){
-				break;
+		}
+		else{
+			relptr_t up = __pgg_index_pop(level + 1);
+			if(up == 0){
+				return 0;
 			}
+			__pgg_open_sub(up, level + 1);
+			__pgg_index_add_new(up, level + 1, NULL);
 		}
-		for(uint16_t i=0; i<8; i++){
-			if(PGG_STATE_LOAD(header->state_map, i) && 
-			PGG_STATE_LOAD(header->pmd_type, i) == level){
-				group = PGG_HEADER2GROUP(header);
-				group = PGG_GROUP_AT(group, PGG_LVL3, i);
-				target = &group->subpmd_header;
-				break;
+		bit = ct_sbmp_first(&ct_rt.pgg_free[level]);
+		assert(bit != -1);
+	}
+	ct_sbmp_clear(&ct_rt.pgg_free[level], bit);
+	return (relptr_t)bit * pgg_size[level];
+}
+
+/* walk the pgg tree in pmem and 
+ * fill the global index
+ * @param[in] header
+ */
+static void __pgg_index_scan(pgg_header_pt header){
+	pgg_hd_group_pt group = PGG_HEADER2GROUP(header);
+	pgg_level_t child_lvl = header->level - 1;
+	for(uint16_t i=0; i<8; i++){
+		relptr_t rel = CT_ABS2REL(PGG_GROUP_AT(group, child_lvl, i));
+		uint16_t state = PGG_STATE_LOAD(header->state_map, i);
+		if(state == PGG_STATE_EMPTY && i != 0){
+			ct_sbmp_set(&ct_rt.pgg_free[child_lvl], rel / pgg_size[child_lvl]);
+		}
+		else if(state == PGG_STATE_SUB && child_lvl == PGG_LVL3){
+			pgg_subpmd_header_pt sp = &PGG_GROUP_AT(group, PGG_LVL3, i)->subpmd_header;
+			uint16_t taken = 0;
+			for(uint16_t w=0; w<8; w++){
+				taken += __builtin_popcountll(sp->bitmap[w]);
+			}
+			// the counter may lag behind the bitmap after a crash
+			if(sp->taken != taken){
+				sp->taken = taken;
+				cache_wb_one(sp);
+			}
+			if(taken <= 1 && i != 0){
+				// emptied, the release did not make it
+				PGG_STATE_STORE(header->state_map, i, PGG_STATE_EMPTY);
+				cache_wb_one(header);
+				ct_sbmp_set(&ct_rt.pgg_free[PGG_LVL3], rel / pgg_size[PGG_LVL3]);
+			}
+			else if(taken < pgg_subpmd_count_per_pkg[sp->level]){
+				ct_sbmp_set(&ct_rt.pgg_pkg[sp->level], rel / pgg_size[PGG_LVL3]);
 			}
 		}
-#ifdef DAX_DEBUGGING
-		pgg_hd_group_t gr = *group;
-#endif
-		assert(target!=NULL);
-		// Now we have the target header
+		else if(state == PGG_STATE_SUB){
+			__pgg_index_scan(PGG_GROUP_AT2HEADER(group, child_lvl, i));
+		}
 	}
-	else if(header->cap_lvl >= PGG_LVL3){
-		// case: available. Should find one lvl3
-		while(1){
-			// iterate each layer
-			found = 0;
-			group = PGG_HEADER2GROUP(header);
-#ifdef DAX_DEBUGGING
-		pgg_hd_group_t gr = *group;
-#endif
-			for(uint16_t i=0; i<8; i++){
-				if(PGG_STATE_LOAD(header->state_map, i) == PGG_STATE_SUB){
-					child = PGG_GROUP_AT2HEADER(group, header->level - 1, i);
-					if(child->cap_lvl >= PGG_LVL3){
-						header = child;
-						found = 1;
-						break;
-					}
+}
+
+static int __pgg_ref_cmp(const void *a, const void *b){
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int __pgg_referenced(relptr_t rel, pgg_level_t level, const uint64_t *refs, uint64_t n){
+	uint64_t key = PGG_REF(rel, level);
+	return bsearch(&key, refs, n, sizeof(uint64_t), __pgg_ref_cmp) != NULL;
+}
+
+/* free the L0-L8 slots of a subtree that
+ * are taken in pmem but not in refs
+ * @param[in] header
+ * @param[in] refs, n: sorted PGG_REF keys
+ * @return number of slots freed
+ */
+static uint64_t __pgg_reclaim_scan(pgg_header_pt header, const uint64_t *refs, uint64_t n){
+	pgg_hd_group_pt group = PGG_HEADER2GROUP(header);
+	pgg_level_t child_lvl = header->level - 1;
+	uint64_t ret = 0;
+	for(uint16_t i=0; i<8; i++){
+		relptr_t rel = CT_ABS2REL(PGG_GROUP_AT(group, child_lvl, i));
+		uint16_t state = PGG_STATE_LOAD(header->state_map, i);
+		if(state == PGG_STATE_FILE && i != 0){
+			if(!__pgg_referenced(rel, child_lvl, refs, n)){
+				PGG_STATE_STORE(header->state_map, i, PGG_STATE_EMPTY);
+				cache_wb_one(header);
+				ret ++;
+			}
+		}
+		else if(state == PGG_STATE_SUB && child_lvl == PGG_LVL3){
+			pgg_subpmd_header_pt sp = &PGG_GROUP_AT(group, PGG_LVL3, i)->subpmd_header;
+			uint16_t freed = 0;
+			// slot 0 holds the header
+			for(uint16_t b=1; b<pgg_subpmd_count_per_pkg[sp->level]; b++){
+				if((sp->bitmap[b >> 6] & ((uint64_t)0b01 << (b & 63))) &&
+					!__pgg_referenced(rel + b * pgg_size[sp->level], sp->level, refs, n)){
+					clear_bit(sp->bitmap, b);
+					freed ++;
 				}
 			}
-			assert(found);
-#ifdef DAX_DEBUGGING
-		gr = *group;
-#endif
-			if(header->level == PGG_LVL4){
-				break;
+			if(freed){
+				// taken is recounted by the index scan
+				cache_wb_one(sp);
+				ret += freed;
 			}
 		}
-		//now we have a lvl4 that contains an empty pgg
-		for(uint16_t i=1; i<8; i++){
-			if(PGG_STATE_LOAD(header->state_map, i) == PGG_STATE_EMPTY){
-				__pgg_build_sub_pmd(header, i, level);
-				group = PGG_HEADER2GROUP(header);
-				group = PGG_GROUP_AT(group, PGG_LVL3, i);
-				target = &group->subpmd_header;
-				break;
+		else if(state == PGG_STATE_SUB){
+			ret += __pgg_reclaim_scan(PGG_GROUP_AT2HEADER(group, child_lvl, i), refs, n);
+		}
+	}
+	return ret;
+}
+
+/* free the groups taken in pmem that no
+ * file references: ones allocated or freed
+ * around a crash, or still held by a magazine
+ * or an unmapped orphan then. Called at init,
+ * before pgg_index_rebuild, with nothing else
+ * running. L9 runs are left alone.
+ * @param[in] refs, n: PGG_REF keys of every
+ *            group in use, sorted here
+ * @return number of groups freed
+ */
+uint64_t pgg_reclaim(uint64_t *refs, uint64_t n){
+	uint64_t ret = 0;
+	qsort(refs, n, sizeof(uint64_t), __pgg_ref_cmp);
+	for(pgg_header_pt header = &ct_rt.first_pgg->header[0]; ; 
+		header = &((pgg_hd_group_pt)CT_REL2ABS(header->next_l9))->header[0]){
+		ret += __pgg_reclaim_scan(header, refs, n);
+		if(header->next_l9 == 0){
+			break;
+		}
+	}
+	_mm_sfence();
+	return ret;
+}
+
+/* rebuild the DRAM index of 
+ * the pgg tree. Called at init.
+ * @return 0 if success, -1 otherwise
+ */
+int pgg_index_rebuild(){
+	for(pgg_level_t lvl = PGG_LVL3; lvl < PGG_LVL9; lvl++){
+		ct_sbmp_destroy(&ct_rt.pgg_free[lvl]);
+		if(ct_sbmp_init(&ct_rt.pgg_free[lvl], CT_DAX_ALLOC_SIZE / pgg_size[lvl])){
+			return -1;
+		}
+	}
+	for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+		ct_sbmp_destroy(&ct_rt.pgg_pkg[lvl]);
+		if(ct_sbmp_init(&ct_rt.pgg_pkg[lvl], CT_DAX_ALLOC_SIZE / pgg_size[PGG_LVL3])){
+			return -1;
+		}
+	}
+	memset(ct_rt.pgg_arena, 0, sizeof(ct_rt.pgg_arena));
+	memset(ct_rt.pgg_arena_of, 0, sizeof(ct_rt.pgg_arena_of));
+	// the super pgg
+	if((*(uint64_t*)ct_rt.lvl9_bmp & 0b01) == 0){
+		__pgg_l9_mark(0, 1, 1);
+	}
+	for(pgg_header_pt header = &ct_rt.first_pgg->header[0]; ; 
+		header = &((pgg_hd_group_pt)CT_REL2ABS(header->next_l9))->header[0]){
+		uint16_t index = CT_ABS2REL(header) / CT_PGGSIZE_LV9;
+		if((*(uint64_t*)ct_rt.lvl9_bmp & ((uint64_t)0b01 << index)) == 0){
+			__pgg_l9_mark(index, 1, 1);
+		}
+		__pgg_index_scan(header);
+		if(header->next_l9 == 0){
+			break;
+		}
+	}
+	return 0;
+}
+
+/* move the index of a L5 subtree
+ * from the global one into the arena.
+ * Caller holds pgg_lock.
+ * @param[in] arena
+ * @param[in] root, the L5
+ */
+static void __pgg_arena_own(pgg_arena_t *arena, relptr_t root){
+	uint64_t l4 = root / pgg_size[PGG_LVL4];
+	arena->free3 = ct_sbmp_take_word(&ct_rt.pgg_free[PGG_LVL3], root / CT_PGG_ARENA_SIZE, ~(uint64_t)0);
+	arena->free4 = ct_sbmp_take_word(&ct_rt.pgg_free[PGG_LVL4], l4 / 64, (uint64_t)0xFF << (l4 % 64)) >> (l4 % 64);
+	for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+		arena->pkg[lvl] = ct_sbmp_take_word(&ct_rt.pgg_pkg[lvl], root / CT_PGG_ARENA_SIZE, ~(uint64_t)0);
+	}
+	arena->root = PGG_GROUP2HEADER(((pgg_hd_group_pt)CT_REL2ABS(root)), CT_PGG_ARENA_LVL);
+	assert(arena->root->level == CT_PGG_ARENA_LVL);
+	ct_rt.pgg_arena_of[root / CT_PGG_ARENA_SIZE] = (uint8_t)(arena - ct_rt.pgg_arena) + 1;
+}
+
+/* reserve a L5 subtree for the arena
+ * and move its part of the index in.
+ * Prefer one that already serves level, 
+ * otherwise open a new one. 
+ * Caller holds pgg_lock.
+ * @param[in] arena
+ * @param[in] level, the level to serve
+ */
+static void __pgg_arena_reserve(pgg_arena_t *arena, pgg_level_t level){
+	int64_t bit = -1;
+	relptr_t root = 0;
+	if(level <= PGG_LVL2){
+		bit = ct_sbmp_first(&ct_rt.pgg_pkg[level]);
+		root = bit * pgg_size[PGG_LVL3];
+	}
+	if(bit == -1 && level <= PGG_LVL3){
+		bit = ct_sbmp_first(&ct_rt.pgg_free[PGG_LVL3]);
+		root = bit * pgg_size[PGG_LVL3];
+	}
+	if(bit == -1){
+		bit = ct_sbmp_first(&ct_rt.pgg_free[PGG_LVL4]);
+		root = bit * pgg_size[PGG_LVL4];
+	}
+	if(bit == -1){
+		root = __pgg_index_pop(CT_PGG_ARENA_LVL);
+		if(root == 0){
+			return;
+		}
+		__pgg_open_sub(root, CT_PGG_ARENA_LVL);
+		__pgg_index_add_new(root, CT_PGG_ARENA_LVL, NULL);
+	}
+	__pgg_arena_own(arena, root & ~(CT_PGG_ARENA_SIZE - 1));
+}
+
+/* give the subtree of the arena back to 
+ * the global tree. Caller holds both 
+ * the arena lock and pgg_lock.
+ * @param[in] arena
+ */
+static void __pgg_arena_handback(pgg_arena_t *arena){
+	relptr_t root = CT_ABS2REL(PGG_HEADER2GROUP(arena->root));
+	uint64_t l4 = root / pgg_size[PGG_LVL4];
+	ct_sbmp_put_word(&ct_rt.pgg_free[PGG_LVL3], root / CT_PGG_ARENA_SIZE, arena->free3);
+	ct_sbmp_put_word(&ct_rt.pgg_free[PGG_LVL4], l4 / 64, (uint64_t)arena->free4 << (l4 % 64));
+	for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+		ct_sbmp_put_word(&ct_rt.pgg_pkg[lvl], root / CT_PGG_ARENA_SIZE, arena->pkg[lvl]);
+	}
+	ct_rt.pgg_arena_of[root / CT_PGG_ARENA_SIZE] = 0;
+	arena->root = NULL;
+	arena->free3 = 0;
+	arena->free4 = 0;
+	memset(arena->pkg, 0, sizeof(arena->pkg));
+}
+
+static inline pgg_arena_t * __pgg_arena_local(){
+	int cpu = sched_getcpu();
+	if(unlikely(cpu < 0)){
+		cpu = 0;
+	}
+	return &ct_rt.pgg_arena[cpu % CT_PGG_ARENAS];
+}
+
+/* allocate from the subtree of the arena.
+ * Caller holds the arena lock.
+ * @param[in] arena
+ * @param[in] level, 0 to 4
+ * @return relative pointer, 0 if the arena can't serve
+ */
+static relptr_t __pgg_arena_take(pgg_arena_t *arena, pgg_level_t level){
+	relptr_t base = CT_ABS2REL(PGG_HEADER2GROUP(arena->root));
+	relptr_t rel;
+	uint64_t index;
+	if(level <= PGG_LVL2){
+		if(++ arena->hist[level] + arena->hist[(level + 1) % 3] + arena->hist[(level + 2) % 3] 
+			> CT_PGG_HIST_WINDOW){
+			for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+				arena->hist[lvl] >>= 1;
 			}
 		}
-		assert(target!=NULL);
 	}
-	else{
+	while(1){
+		if(level <= PGG_LVL2 && arena->pkg[level]){
+			index = __builtin_ctzll(arena->pkg[level]);
+			pgg_subpmd_header_pt sp = &((pgg_hd_group_pt)CT_REL2ABS(base + index * pgg_size[PGG_LVL3]))->subpmd_header;
+			rel = __pgg_sub_pmd_alloc(level, sp);
+			if(sp->taken == pgg_subpmd_count_per_pkg[level]){
+				arena->pkg[level] &= ~((uint64_t)0b01 << index);
+			}
+			return rel;
+		}
+		if(level <= PGG_LVL3 && arena->free3){
+			index = __builtin_ctzll(arena->free3);
+			arena->free3 &= ~((uint64_t)0b01 << index);
+			rel = base + index * pgg_size[PGG_LVL3];
+			if(level == PGG_LVL3){
+				__pgg_mark(rel, PGG_LVL3, PGG_STATE_FILE);
+				return rel;
+			}
+			pgg_header_pt l4 = PGG_GROUP2HEADER(PGG_REL2HD_GROUP(rel, PGG_LVL4), PGG_LVL4);
+			__pgg_build_sub_pmd(l4, index % 8, level);
+			arena->pkg[level] |= (uint64_t)0b01 << index;
+			continue;
+		}
+		if(arena->free4){
+			index = __builtin_ctz(arena->free4);
+			arena->free4 &= ~(0b01 << index);
+			rel = base + index * pgg_size[PGG_LVL4];
+			if(level == PGG_LVL4){
+				__pgg_mark(rel, PGG_LVL4, PGG_STATE_FILE);
+				return rel;
+			}
+			__pgg_open_sub(rel, PGG_LVL4);
+			__pgg_index_add_new(rel, PGG_LVL4, arena);
+			continue;
+		}
 		return 0;
 	}
-	// Target header is ready here
-	relptr_t ret = __pgg_sub_pmd_alloc(level, target);
-	if(target->taken == pgg_subpmd_count_per_pkg[level]){
-		//need update cap
-		pgg_header_pt current;
-		pgg_hd_group_pt hdg;
-		uint16_t need_act = 1;
-		hdg = PGG_REL2HD_GROUP(ret, PGG_LVL4);
-		current = &hdg->header[9 - PGG_LVL4];
-		assert(current->cap_lvl >= PGG_LVL3);
-		// check for availiblity
-		// TBD below
-		for(uint16_t i = 0; i < 8; i++){
-			if(PGG_STATE_LOAD(current->state_map, i) == PGG_STATE_SUB){
-				pgg_subpmd_header_pt sp_header;
-				sp_header = &PGG_GROUP_AT(hdg, PGG_LVL3, i)->subpmd_header;
-				assert(PGG_STATE_LOAD(current->pmd_type, i) == sp_header->level);
-				if(sp_header->level == level && sp_header->taken != pgg_subpmd_count_per_pkg[level]){
-					// still space left
-					// stay same
-					need_act = 0;
-					break;
-				}
+}
+
+/* allocate L0-L4 files from the
+ * arena of the current cpu.
+ * @param[in] level
+ * @param[out] out, relative pointers
+ * @param[in] n, number requested
+ * @return number allocated, less than n if out of space
+ */
+static uint32_t __pgg_arena_allocate(pgg_level_t level, relptr_t *out, uint32_t n){
+	pgg_arena_t *arena = __pgg_arena_local();
+	relptr_t ret;
+	uint32_t got = 0;
+	bitlock_acquire(&arena->lock, 0);
+	while(got < n){
+		ret = 0;
+		if(arena->root != NULL){
+			ret = __pgg_arena_take(arena, level);
+		}
+		if(ret == 0){
+			// refill
+			bitlock_acquire(&ct_rt.pgg_lock, 0);
+			if(arena->root != NULL){
+				__pgg_arena_handback(arena);
+			}
+			__pgg_arena_reserve(arena, level);
+			bitlock_release(&ct_rt.pgg_lock, 0);
+			if(arena->root != NULL){
+				ret = __pgg_arena_take(arena, level);
+			}
+			if(ret == 0){
+				break;
 			}
 		}
-		if(need_act){
-			// clear bits
-			current->sub_pmd_cap &= ~(0b010001 << level);
-			cache_wb_one(current);
-			for(pgg_level_t lvl = 5; lvl <= 9; lvl++){
-				hdg = PGG_REL2HD_GROUP(ret, lvl);
-				for(uint16_t i=0; i<8; i++){
-					current = &PGG_GROUP_AT(hdg, lvl - 1, i)->header[9-(lvl-1)];
-					assert(current->level == lvl - 1);
-					// TBD
+		out[got ++] = ret;
+	}
+	bitlock_release(&arena->lock, 0);
+	return got;
+}
+
+/* deallocate one file
+ * caller holds the lock of the
+ * tree that target belongs to.
+ * @param[in] level
+ * @param[in] target
+ * @param[in] arena, owner of target, NULL for global
+ */
+static void __pgg_deallocate(pgg_level_t level, relptr_t target, pgg_arena_t *arena){
+	if(level >= PGG_LVL9){
+		// a run of L9s
+		__pgg_l9_mark(target / CT_PGGSIZE_LV9, level - PGG_LVL8, 0);
+	}
+	else if(level > PGG_LVL2){
+		// PMD and above
+#ifdef CTFS_DEBUG
+		printf("------deallocated lvl %d @0x%lx\n", level, target);
+#endif
+		assert(PGG_STATE_LOAD(PGG_GROUP2HEADER(PGG_REL2HD_GROUP(target, level + 1), level + 1)->state_map, 
+			PGG_BIGFILE2INDEX(target, level)) == PGG_STATE_FILE);
+		__pgg_mark(target, level, PGG_STATE_EMPTY);
+		if(arena == NULL){
+			ct_sbmp_set(&ct_rt.pgg_free[level], target / pgg_size[level]);
+		}
+		else if(level == PGG_LVL3){
+			arena->free3 |= (uint64_t)0b01 << ((target / pgg_size[PGG_LVL3]) % 64);
+		}
+		else{
+			arena->free4 |= 0b01 << PGG_BIGFILE2INDEX(target, PGG_LVL4);
+		}
+	}
+	else{
+		// sub PMD
+		pgg_subpmd_header_pt header = &PGG_REL2HD_GROUP(target, PGG_LVL3)->subpmd_header;
+		assert(header->level == level);
+		uint16_t index = PGG_SMALLFILE2INDEX(target, header->level);
+		clear_bit(header->bitmap, index);
+		if(index < header->bitmap_hint){
+			header->bitmap_hint = index;
+		}
+		header->taken --;
+		cache_wb_one(header);
+		relptr_t pkg = target & ~(pgg_size[PGG_LVL3] - 1);
+		uint64_t bit = pkg / pgg_size[PGG_LVL3];
+		if(header->taken == 1 && PGG_BIGFILE2INDEX(pkg, PGG_LVL3) != 0){
+			// only the header slot left, the package turns
+			// back into an empty L3. Slot 0 of a L4 keeps
+			// the headers above and stays a package.
+			__pgg_mark(pkg, PGG_LVL3, PGG_STATE_EMPTY);
+			if(arena == NULL){
+				ct_sbmp_clear(&ct_rt.pgg_pkg[level], bit);
+				ct_sbmp_set(&ct_rt.pgg_free[PGG_LVL3], bit);
+			}
+			else{
+				arena->pkg[level] &= ~((uint64_t)0b01 << (bit % 64));
+				arena->free3 |= (uint64_t)0b01 << (bit % 64);
+			}
+		}
+		else if(header->taken + 1 == pgg_subpmd_count_per_pkg[level]){
+			// it was full
+			if(arena == NULL){
+				ct_sbmp_set(&ct_rt.pgg_pkg[level], target / pgg_size[PGG_LVL3]);
+			}
+			else{
+				arena->pkg[level] |= (uint64_t)0b01 << ((target / pgg_size[PGG_LVL3]) % 64);
+			}
+		}
+	}
+}
+
+/* return page groups of one level to
+ * the tree. A run of targets under the 
+ * same lock takes the lock once.
+ * @param[in] level
+ * @param[in] targets
+ * @param[in] n, number of targets
+ */
+static void __pgg_deallocate_batch(pgg_level_t level, relptr_t *targets, uint16_t n){
+	uint64_t *held = NULL;
+	for(uint16_t i=0; i<n; i++){
+		uint8_t *owner = &ct_rt.pgg_arena_of[targets[i] / CT_PGG_ARENA_SIZE];
+		while(1){
+			uint8_t cur = (level < CT_PGG_ARENA_LVL) ? *owner : 0;
+			uint64_t *lock = cur ? &ct_rt.pgg_arena[cur - 1].lock : &ct_rt.pgg_lock;
+			if(lock != held){
+				if(held){
+					bitlock_release(held, 0);
 				}
+				bitlock_acquire(lock, 0);
+				held = lock;
+			}
+			// the owner is stable once its lock is held
+			if(((level < CT_PGG_ARENA_LVL) ? *owner : 0) == cur){
+				__pgg_deallocate(level, targets[i], cur ? &ct_rt.pgg_arena[cur - 1] : NULL);
+				break;
 			}
 		}
-		
-		
 	}
-	return ret;
+	if(held){
+		bitlock_release(held, 0);
+	}
+}
+
+/* give everything in the magazine back
+ * to the tree. Caller holds mag->lock.
+ * @param[in] mag
+ */
+static void __pgg_mag_drain(pgg_magazine_t *mag){
+	for(pgg_level_t lvl = 0; lvl <= CT_PGG_MAG_MAX_LVL; lvl++){
+		__pgg_deallocate_batch(lvl, mag->slot[lvl], mag->count[lvl]);
+		mag->stat.free_flush[lvl] += mag->count[lvl];
+		mag->count[lvl] = 0;
+	}
+}
+
+/* retire the magazine of an exiting
+ * thread. Unlinked first, so a concurrent
+ * pgg_mag_flush_all cannot reach it.
+ * @param[in] arg, the magazine
+ */
+static void __pgg_mag_destroy(void *arg){
+	pgg_magazine_t *mag = arg;
+	pgg_magazine_t **pp;
+	bitlock_acquire(&ct_rt.pgg_mag_lock, 0);
+	for(pp = &ct_rt.pgg_mag_list; *pp != NULL; pp = &(*pp)->next){
+		if(*pp == mag){
+			*pp = mag->next;
+			break;
+		}
+	}
+	bitlock_release(&ct_rt.pgg_mag_lock, 0);
+	dax_grant_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	__pgg_mag_drain(mag);
+	dax_stop_access(ct_rt.mpk[DAX_MPK_DEFAULT]);
+	bitlock_acquire(&ct_rt.pgg_mag_lock, 0);
+	for(uint16_t i=0; i<sizeof(pgg_mag_stat_t) / sizeof(uint64_t); i++){
+		((uint64_t*)&ct_rt.pgg_mag_retired)[i] += ((uint64_t*)&mag->stat)[i];
+	}
+	bitlock_release(&ct_rt.pgg_mag_lock, 0);
+	free(mag);
+}
+
+static void __pgg_mag_key_init(){
+	pthread_key_create(&pgg_mag_key, __pgg_mag_destroy);
+}
+
+/* the magazine of the calling thread.
+ * Created on first use.
+ * @return magazine, NULL if out of memory
+ */
+static pgg_magazine_t * __pgg_mag_local(){
+	if(unlikely(pgg_mag == NULL)){
+		pthread_once(&pgg_mag_once, __pgg_mag_key_init);
+		pgg_mag = calloc(1, sizeof(pgg_magazine_t));
+		if(pgg_mag == NULL){
+			return NULL;
+		}
+		pthread_setspecific(pgg_mag_key, pgg_mag);
+		bitlock_acquire(&ct_rt.pgg_mag_lock, 0);
+		pgg_mag->next = ct_rt.pgg_mag_list;
+		ct_rt.pgg_mag_list = pgg_mag;
+		bitlock_release(&ct_rt.pgg_mag_lock, 0);
+	}
+	return pgg_mag;
+}
+
+/* give the page groups held by the
+ * magazine of this thread back to the tree
+ */
+void pgg_mag_flush(){
+	pgg_magazine_t *mag = pgg_mag;
+	if(mag == NULL){
+		return;
+	}
+	bitlock_acquire(&mag->lock, 0);
+	__pgg_mag_drain(mag);
+	bitlock_release(&mag->lock, 0);
+}
+
+/* give the page groups held by the
+ * magazines of all threads back to the
+ * tree. The main thread has no TLS
+ * destructor, so a clean exit needs this.
+ */
+void pgg_mag_flush_all(){
+	bitlock_acquire(&ct_rt.pgg_mag_lock, 0);
+	for(pgg_magazine_t *mag = ct_rt.pgg_mag_list; mag != NULL; mag = mag->next){
+		bitlock_acquire(&mag->lock, 0);
+		__pgg_mag_drain(mag);
+		bitlock_release(&mag->lock, 0);
+	}
+	bitlock_release(&ct_rt.pgg_mag_lock, 0);
+}
+
+/* sum the magazine counters of 
+ * all threads, live or exited
+ * @param[out] stat
+ */
+void pgg_mag_stat(pgg_mag_stat_t *stat){
+	bitlock_acquire(&ct_rt.pgg_mag_lock, 0);
+	*stat = ct_rt.pgg_mag_retired;
+	for(pgg_magazine_t *mag = ct_rt.pgg_mag_list; mag != NULL; mag = mag->next){
+		for(uint16_t i=0; i<sizeof(pgg_mag_stat_t) / sizeof(uint64_t); i++){
+			((uint64_t*)stat)[i] += ((uint64_t*)&mag->stat)[i];
+		}
+	}
+	bitlock_release(&ct_rt.pgg_mag_lock, 0);
 }
 
 relptr_t pgg_allocate(pgg_level_t level){
 	relptr_t ret;
-	bitlock_acquire(&ct_rt.pgg_lock, 0);
-	if(level <= PGG_LVL2){
-		ret = __pgg_allocate_small(level, &ct_rt.first_pgg->header[0]);
+	pgg_magazine_t *mag = __pgg_mag_local();
+	if(level <= CT_PGG_MAG_MAX_LVL && mag){
+		bitlock_acquire(&mag->lock, 0);
+		if(mag->count[level]){
+			mag->stat.alloc_hit[level] ++;
+			ret = mag->slot[level][-- mag->count[level]];
+			bitlock_release(&mag->lock, 0);
+			return ret;
+		}
+		mag->stat.alloc_miss[level] ++;
+		bitlock_release(&mag->lock, 0);
+	}
+	if(level < CT_PGG_ARENA_LVL){
+		ret = 0;
+		__pgg_arena_allocate(level, &ret, 1);
 #if CTFS_DEBUG > 0
-		printf("\tallocated lvl %d @0x%lx\n", ret);
+		printf("\tallocated lvl %d @0x%lx\n", level, ret);
 #endif
-		bitlock_release(&ct_rt.pgg_lock, 0);
 		return ret;
 	}
-	else if(level > PGG_LVL2 && level <= PGG_LVL9){
-		ret = __pgg_allocate_big(level, &ct_rt.first_pgg->header[0]) & PAGE_MASK;
+	else if(level < PGG_LVL9){
+		bitlock_acquire(&ct_rt.pgg_lock, 0);
+		ret = __pgg_index_pop(level);
+		if(ret){
+			__pgg_mark(ret, level, PGG_STATE_FILE);
+		}
 #if CTFS_DEBUG > 0
 		printf("\tallocated lvl %d @0x%lx\n", level, ret);
 #endif
 		bitlock_release(&ct_rt.pgg_lock, 0);
 		return ret;
 	}
-	else{
-		// TBD: file > 512G
+	else if(level <= PGG_LVL_MAX){
+		bitlock_acquire(&ct_rt.pgg_lock, 0);
+		int16_t index = __pgg_l9_find(level - PGG_LVL8);
+		ret = 0;
+		if(index != -1){
+			__pgg_l9_mark(index, level - PGG_LVL8, 1);
+			ret = (relptr_t)index * CT_PGGSIZE_LV9;
+		}
 		bitlock_release(&ct_rt.pgg_lock, 0);
+		return ret;
 	}
-	bitlock_release(&ct_rt.pgg_lock, 0);
 	return 0;
 }
 
@@ -569,57 +1004,287 @@ relptr_t pgg_allocate(pgg_level_t level){
  * @param[in] target
  */
 void pgg_deallocate(pgg_level_t level, relptr_t target){
-	bitlock_acquire(&ct_rt.pgg_lock, 0);
-	if(level > PGG_LVL2){
-		// PMD and above
-		pgg_header_pt header = &PGG_REL2HD_GROUP(target, level + 1) ->header[9 - (level + 1)];
-#ifdef CTFS_DEBUG
-		pgg_hd_group_t grp = *PGG_REL2HD_GROUP(target, level + 1);
-		pgg_header_t hdr = *header;
-		printf("------deallocated lvl %d @0x%lx\n", level, target);
-#endif
-		assert(header->level == level + 1);
-		uint8_t index = PGG_BIGFILE2INDEX(target, level);
-#ifdef CTFS_DEBUG
-		ctfs_debug_temp  = header->state_map;
-#endif
-		assert(PGG_STATE_LOAD(header->state_map, index) == PGG_STATE_FILE);
-		PGG_STATE_STORE(header->state_map, index, PGG_STATE_EMPTY);
+	pgg_magazine_t *mag = __pgg_mag_local();
+	if(level > CT_PGG_MAG_MAX_LVL || mag == NULL){
+		__pgg_deallocate_batch(level, &target, 1);
+		return;
+	}
+	bitlock_acquire(&mag->lock, 0);
+	if(mag->count[level] == CT_PGG_MAG_SIZE){
+		// return the oldest ones
+		__pgg_deallocate_batch(level, mag->slot[level], CT_PGG_MAG_BATCH);
+		memmove(mag->slot[level], &mag->slot[level][CT_PGG_MAG_BATCH], 
+			(CT_PGG_MAG_SIZE - CT_PGG_MAG_BATCH) * sizeof(relptr_t));
+		mag->count[level] -= CT_PGG_MAG_BATCH;
+		mag->stat.free_flush[level] += CT_PGG_MAG_BATCH;
+	}
+	mag->slot[level][mag->count[level] ++] = target;
+	mag->stat.free_hit[level] ++;
+	bitlock_release(&mag->lock, 0);
+}
 
-		// check if it was full
-		__pgg_update_cap_dealloc(header);
+/* allocate a batch of files of one 
+ * level. Takes each lock once for the
+ * whole batch instead of once per file.
+ * @param[in] level
+ * @param[out] out, relative pointers
+ * @param[in] n, number requested
+ * @return number allocated, less than n if out of space
+ */
+uint32_t pgg_allocate_many(pgg_level_t level, relptr_t *out, uint32_t n){
+	uint32_t got = 0;
+	pgg_magazine_t *mag = __pgg_mag_local();
+	if(level <= CT_PGG_MAG_MAX_LVL && mag){
+		bitlock_acquire(&mag->lock, 0);
+		while(got < n && mag->count[level]){
+			mag->stat.alloc_hit[level] ++;
+			out[got ++] = mag->slot[level][-- mag->count[level]];
+		}
+		bitlock_release(&mag->lock, 0);
+	}
+	if(level < CT_PGG_ARENA_LVL){
+		got += __pgg_arena_allocate(level, &out[got], n - got);
+	}
+	else if(level < PGG_LVL9){
+		bitlock_acquire(&ct_rt.pgg_lock, 0);
+		while(got < n){
+			relptr_t ret = __pgg_index_pop(level);
+			if(ret == 0){
+				break;
+			}
+			__pgg_mark(ret, level, PGG_STATE_FILE);
+			out[got ++] = ret;
+		}
+		bitlock_release(&ct_rt.pgg_lock, 0);
 	}
 	else{
-		// sub PMD
-		pgg_subpmd_header_pt header = &PGG_REL2HD_GROUP(target, PGG_LVL3)->subpmd_header;
-		uint16_t index = PGG_SMALLFILE2INDEX(target, header->level);
-		clear_bit(header->bitmap, index);
-		if(index < header->bitmap_hint){
-			header->bitmap_hint = index;
+		while(got < n){
+			relptr_t ret = pgg_allocate(level);
+			if(ret == 0){
+				break;
+			}
+			out[got ++] = ret;
 		}
-		header->taken --;
-		cache_wb_one(header);
-		pgg_hd_group_pt hdg = PGG_REL2HD_GROUP(target, PGG_LVL4);
-		// uint8_t hd_index = PGG_BIGFILE2INDEX(target, PGG_LVL3);
-		if(hdg->header[5].cap_lvl < PGG_LVL3){
-			// it was full
-			assert(PGG_SUBPMD_PRF_TEST(hdg->header[5].sub_pmd_cap, level) == 0);
-			for(pgg_level_t lvl = PGG_LVL4; lvl < PGG_LVL10; lvl++){
-				pgg_header_pt current = &PGG_REL2HD_GROUP(target, lvl)->header[lvl];
-				assert(current->level == lvl);
-				if(current->cap_lvl >= PGG_LVL3){
-					assert(PGG_SUBPMD_PRF_TEST(current->sub_pmd_cap, level) != 0);
-					break;
-				}
-				else{
-					assert(PGG_SUBPMD_PRF_TEST(current->sub_pmd_cap, level) == 0);
-					current->sub_pmd_cap |= 0b010001 << level;
-					cache_wb_one(current);
-				}
+	}
+	return got;
+}
+
+/* allocate the lowest free L0-L8 slot
+ * from the global index, bypassing arenas
+ * and magazines. Used by the defragmenter.
+ * Takes only slots already free below limit,
+ * never opens a group or a package.
+ * @param[in] level
+ * @param[in] limit, the result must be below it
+ * @return relative pointer, 0 if none below limit
+ */
+relptr_t pgg_allocate_below(pgg_level_t level, relptr_t limit){
+	relptr_t ret = 0;
+	int64_t bit;
+	bitlock_acquire(&ct_rt.pgg_lock, 0);
+	if(level <= PGG_LVL2){
+		bit = ct_sbmp_first(&ct_rt.pgg_pkg[level]);
+		if(bit != -1 && (relptr_t)bit * pgg_size[PGG_LVL3] < limit){
+			pgg_subpmd_header_pt sp = &((pgg_hd_group_pt)CT_REL2ABS(bit * pgg_size[PGG_LVL3]))->subpmd_header;
+			ret = __pgg_sub_pmd_alloc(level, sp);
+			if(sp->taken == pgg_subpmd_count_per_pkg[level]){
+				ct_sbmp_clear(&ct_rt.pgg_pkg[level], bit);
+			}
+		}
+	}
+	else{
+		bit = ct_sbmp_first(&ct_rt.pgg_free[level]);
+		if(bit != -1 && (relptr_t)bit * pgg_size[level] < limit){
+			ct_sbmp_clear(&ct_rt.pgg_free[level], bit);
+			ret = (relptr_t)bit * pgg_size[level];
+			__pgg_mark(ret, level, PGG_STATE_FILE);
+		}
+	}
+	bitlock_release(&ct_rt.pgg_lock, 0);
+	return ret;
+}
+
+/* deallocate without going through
+ * the magazine of this thread
+ * @param[in] level
+ * @param[in] target
+ */
+void pgg_deallocate_direct(pgg_level_t level, relptr_t target){
+	__pgg_deallocate_batch(level, &target, 1);
+}
+
+/* whether a sub page group holds no file.
+ * Sub-PMD packages with only the header 
+ * slot taken count as empty.
+ * @param[in] header
+ */
+static int __pgg_group_empty(pgg_header_pt header){
+	pgg_hd_group_pt group = PGG_HEADER2GROUP(header);
+	pgg_level_t child_lvl = header->level - 1;
+	for(uint16_t i=0; i<8; i++){
+		uint16_t state = PGG_STATE_LOAD(header->state_map, i);
+		if(state == PGG_STATE_FILE){
+			return 0;
+		}
+		if(state != PGG_STATE_SUB){
+			continue;
+		}
+		if(child_lvl == PGG_LVL3){
+			if(PGG_GROUP_AT(group, PGG_LVL3, i)->subpmd_header.taken > 1){
+				return 0;
+			}
+		}
+		else if(!__pgg_group_empty(PGG_GROUP_AT2HEADER(group, child_lvl, i))){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* clear n bits of a summary bitmap
+ * @param[in] b
+ * @param[in] first, the first bit
+ * @param[in] n
+ */
+static void __pgg_sbmp_drop(ct_sbmp_t *b, uint64_t first, uint64_t n){
+	while(n){
+		uint64_t cnt = 64 - first % 64;
+		cnt = (cnt < n) ? cnt : n;
+		uint64_t mask = (cnt == 64) ? ~(uint64_t)0 : (((uint64_t)0b01 << cnt) - 1) << (first % 64);
+		ct_sbmp_take_word(b, first / 64, mask);
+		first += cnt;
+		n -= cnt;
+	}
+}
+
+/* turn empty sub page groups back into
+ * empty slots, from level upwards.
+ * Stops at the first level still in use 
+ * or holding a L5 owned by an arena.
+ * Caller holds pgg_lock.
+ * @param[in] rel, the sub page group
+ * @param[in] level
+ * @return number of groups freed
+ */
+static int __pgg_collapse(relptr_t rel, pgg_level_t level){
+	int ret = 0;
+	while(level < PGG_LVL9){
+		for(uint64_t i = rel / CT_PGG_ARENA_SIZE; i < (rel + pgg_size[level]) / CT_PGG_ARENA_SIZE; i++){
+			if(ct_rt.pgg_arena_of[i]){
+				return ret;
+			}
+		}
+		if(!__pgg_group_empty(PGG_GROUP2HEADER(((pgg_hd_group_pt)CT_REL2ABS(rel)), level))){
+			return ret;
+		}
+		// slot 0 holds the headers of its parent
+		if(PGG_BIGFILE2INDEX(rel, level) != 0){
+			for(pgg_level_t lvl = PGG_LVL3; lvl < level; lvl++){
+				__pgg_sbmp_drop(&ct_rt.pgg_free[lvl], rel / pgg_size[lvl], pgg_size[level] / pgg_size[lvl]);
+			}
+			for(pgg_level_t lvl = PGG_LVL0; lvl < PGG_LVL3; lvl++){
+				__pgg_sbmp_drop(&ct_rt.pgg_pkg[lvl], rel / pgg_size[PGG_LVL3], pgg_size[level] / pgg_size[PGG_LVL3]);
+			}
+			__pgg_mark(rel, level, PGG_STATE_EMPTY);
+			ct_sbmp_set(&ct_rt.pgg_free[level], rel / pgg_size[level]);
+			ret ++;
+		}
+		level ++;
+		rel &= ~(pgg_size[level] - 1);
+	}
+	return ret;
+}
+
+/* whether a L5 is a sub page group
+ * in one of the pgg trees
+ * @param[in] root, the L5
+ */
+static int __pgg_defrag_is_sub(relptr_t root){
+	// the L9 may be a file rather than a tree
+	pgg_header_pt l9 = &ct_rt.first_pgg->header[0];
+	while(CT_ABS2REL(l9) / CT_PGGSIZE_LV9 != root / CT_PGGSIZE_LV9){
+		if(l9->next_l9 == 0){
+			return 0;
+		}
+		l9 = &((pgg_hd_group_pt)CT_REL2ABS(l9->next_l9))->header[0];
+	}
+	for(pgg_level_t lvl = PGG_LVL9; lvl > CT_PGG_ARENA_LVL; lvl--){
+		pgg_header_pt header = PGG_GROUP2HEADER(PGG_REL2HD_GROUP(root, lvl), lvl);
+		if(header->level != lvl || 
+			PGG_STATE_LOAD(header->state_map, PGG_BIGFILE2INDEX(root, lvl - 1)) != PGG_STATE_SUB){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* find the next sparsely used L5 not 
+ * owned by any arena, going downwards.
+ * Allocation prefers low addresses, so
+ * files evacuated from the top move down.
+ * @param[in] from, search starts here
+ * @param[in] max_used, in L3 units out of 64
+ * @return the L5, 0 if none
+ */
+relptr_t pgg_defrag_next(relptr_t from, uint16_t max_used){
+	relptr_t root = from & ~(CT_PGG_ARENA_SIZE - 1);
+	// below is the super pgg
+	for(; root >= CT_PGGSIZE_LV9; root -= CT_PGG_ARENA_SIZE){
+		bitlock_acquire(&ct_rt.pgg_lock, 0);
+		if(ct_rt.pgg_arena_of[root / CT_PGG_ARENA_SIZE] == 0 && __pgg_defrag_is_sub(root)){
+			uint64_t l4 = root / pgg_size[PGG_LVL4];
+			uint64_t free4 = (ct_rt.pgg_free[PGG_LVL4].map[0][l4 / 64] >> (l4 % 64)) & 0xFF;
+			uint64_t free3 = ct_rt.pgg_free[PGG_LVL3].map[0][root / CT_PGG_ARENA_SIZE];
+			uint16_t used = 64 - 8 * __builtin_popcountll(free4) - __builtin_popcountll(free3);
+			if(used <= max_used){
+				bitlock_release(&ct_rt.pgg_lock, 0);
+				return root;
+			}
+		}
+		bitlock_release(&ct_rt.pgg_lock, 0);
+	}
+	return 0;
+}
+
+/* reserve a L5 for the defragmenter 
+ * so that nothing new lands in it
+ * @param[in] root, the L5
+ * @return 0 if success, -1 otherwise
+ */
+int pgg_defrag_own(relptr_t root){
+	int ret = -1;
+	bitlock_acquire(&ct_rt.pgg_lock, 0);
+	if(ct_rt.pgg_arena_of[root / CT_PGG_ARENA_SIZE] == 0 && __pgg_defrag_is_sub(root)){
+		for(uint16_t i = CT_PGG_ARENAS; i < CT_PGG_ARENAS + CT_DEFRAG_BATCH; i++){
+			if(ct_rt.pgg_arena[i].root == NULL){
+				__pgg_arena_own(&ct_rt.pgg_arena[i], root);
+				ret = 0;
+				break;
 			}
 		}
 	}
 	bitlock_release(&ct_rt.pgg_lock, 0);
+	return ret;
+}
+
+/* give a L5 of the defragmenter back,
+ * freeing it and the levels above 
+ * if they became empty
+ * @param[in] root, the L5
+ * @return number of groups freed
+ */
+int pgg_defrag_release(relptr_t root){
+	uint8_t owner = ct_rt.pgg_arena_of[root / CT_PGG_ARENA_SIZE];
+	assert(owner > CT_PGG_ARENAS);
+	pgg_arena_t *arena = &ct_rt.pgg_arena[owner - 1];
+	int ret;
+	bitlock_acquire(&arena->lock, 0);
+	bitlock_acquire(&ct_rt.pgg_lock, 0);
+	__pgg_arena_handback(arena);
+	ret = __pgg_collapse(root, CT_PGG_ARENA_LVL);
+	bitlock_release(&ct_rt.pgg_lock, 0);
+	bitlock_release(&arena->lock, 0);
+	return ret;
 }
 
 /* Called for mkfs
@@ -632,9 +1297,9 @@ relptr_t pgg_mkfs(){
 	pgg_header_pt current;
 	current = &hdg->header[0];
 	__pgg_new_subpgg(current, current, PGG_LVL9);
-#ifdef CTFS_HACK
-	return __pgg_allocate_big(PGG_LVL3, current);
-#else
-	return __pgg_allocate_small(PGG_LVL0, current);
-#endif
+	*(uint64_t*)ct_rt.lvl9_bmp = 0;
+	if(pgg_index_rebuild()){
+		return 0;
+	}
+	return pgg_allocate(PGG_LVL0);
 }
@@ -1,3 +1,5 @@
+#ifndef CTFS_PGG_H
+#define CTFS_PGG_H
 #include "ctfs_format.h"
 #include "ctfs_util.h"
 #include "ctfs_runtime.h"
@@ -6,10 +8,46 @@ pgg_level_t pgg_get_lvl(uint64_t size);
 
 relptr_t pgg_allocate(pgg_level_t level);
 
+uint32_t pgg_allocate_many(pgg_level_t level, relptr_t *out, uint32_t n);
+
 void pgg_deallocate(pgg_level_t level, relptr_t target);
 
 relptr_t pgg_mkfs();
 
+int pgg_index_rebuild();
+
+/* key of a group in use, for pgg_reclaim */
+#define PGG_REF(rel, level)     ((uint64_t)(rel) | (uint64_t)(level))
+
+uint64_t pgg_reclaim(uint64_t *refs, uint64_t n);
+
+void pgg_hist(uint64_t *requests, uint64_t *carved);
+
+void pgg_mag_flush();
+
+void pgg_mag_flush_all();
+
+void pgg_mag_stat(pgg_mag_stat_t *stat);
+
+relptr_t pgg_allocate_below(pgg_level_t level, relptr_t limit);
+
+void pgg_deallocate_direct(pgg_level_t level, relptr_t target);
+
+relptr_t pgg_defrag_next(relptr_t from, uint16_t max_used);
+
+int pgg_defrag_own(relptr_t root);
+
+int pgg_defrag_release(relptr_t root);
+
 extern const uint64_t pgg_limit[10];
 
 extern const uint64_t pgg_size[10];
+
+/* size of a page group at level.
+ * Levels above 9 are runs of L9s.
+ */
+static inline uint64_t pgg_lvl_size(pgg_level_t level){
+	return (level <= PGG_LVL9) ? pgg_size[level] : (uint64_t)(level - PGG_LVL8) * CT_PGGSIZE_LV9;
+}
+
+#endif
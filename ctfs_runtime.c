@@ -30,8 +30,12 @@ ct_runtime_t* get_rt(){
     return &ct_rt;
 }
 
+/* file timestamps. The coarse clock is read
+ * from the vDSO without a syscall or rdtsc, at
+ * tick granularity, like the kernel's inode times
+ */
 void ct_time_stamp(struct timespec * time){
-    clock_gettime(CLOCK_REALTIME, time);
+    clock_gettime(CLOCK_REALTIME_COARSE, time);
 }
 
 int ct_time_greater(struct timespec * time1, struct timespec * time2){
@@ -20,6 +20,222 @@ struct ct_fd_t{
 };
 typedef struct ct_fd_t ct_fd_t;
 
+/* Per-cpu page group arena.
+ * Owns one L5 subtree of the pgg tree and
+ * serves L0-L4 allocations from it under its
+ * own lock. The global pgg_lock is only taken
+ * to reserve or hand back a subtree.
+ * While reserved, the part of the DRAM index
+ * covering the subtree lives here.
+ */
+struct pgg_arena{
+	uint64_t			lock;
+	pgg_header_pt		root;
+	// empty L3 slots, bit = L3 index in the subtree
+	uint64_t			free3;
+	// sub-PMD packages with free slots, per level
+	uint64_t			pkg[PGG_LVL3];
+	// sub-PMD requests served, decayed
+	uint32_t			hist[PGG_LVL3];
+	// empty L4 slots
+	uint8_t				free4;
+	char				padding[3];
+};
+typedef struct pgg_arena pgg_arena_t;
+
+/* Waits on the locks of one slot,
+ * counted with CTFS_LOCK_STAT
+ */
+struct inode_lock_stat{
+	uint64_t			rt_wait;
+	uint64_t			rw_wait;
+	uint64_t			shared_wait;
+	// waits that parked on a futex
+	uint64_t			parked;
+};
+typedef struct inode_lock_stat inode_lock_stat_t;
+
+/* Locks of the inodes hashing to one slot.
+ * One cache line each, so inodes of different
+ * slots do not false share.
+ */
+struct inode_lock{
+	ctfs_lock_t			rt;
+	// reader-writer lock
+	uint32_t			rw;
+	// sequence count, odd while rw
+	// is held exclusive
+	uint32_t			seq;
+	// mappings of the inodes of this slot
+	uint32_t			mapped;
+	inode_lock_stat_t	stat;
+	// read views of the inodes of this slot
+	uint32_t			views;
+	char				padding[12];
+} __attribute__((aligned(64)));
+typedef struct inode_lock inode_lock_t;
+
+/* Per-cpu pool of inode numbers. Their bits
+ * are set in the bitmap and the inodes hold 
+ * no page group, so nothing else sees them.
+ */
+struct inode_pool{
+	uint64_t			lock;
+	// inode_used change not yet in the super block
+	int64_t				used;
+	uint64_t			count;
+	index_t				slot[CT_INODE_POOL_SIZE];
+	char				padding[40];
+};
+typedef struct inode_pool inode_pool_t;
+
+/* Magazine hit and miss counters, per level
+ */
+struct pgg_mag_stat{
+	uint64_t			alloc_hit[PGG_LVL10];
+	uint64_t			alloc_miss[PGG_LVL10];
+	uint64_t			free_hit[PGG_LVL10];
+	uint64_t			free_flush[PGG_LVL10];
+};
+typedef struct pgg_mag_stat pgg_mag_stat_t;
+
+/* Per-thread magazine of freed page groups.
+ * A free is pushed here and a later allocation 
+ * of the same level pops it without touching 
+ * the tree. The page groups held stay marked
+ * allocated in pmem until a flush: thread exit,
+ * or ctfs_sync for all threads. Whatever is
+ * held at a crash, or at an exit without
+ * ctfs_sync, is referenced by no inode and
+ * taken back by pgg_reclaim at the next init.
+ * The owner takes lock around every access so
+ * pgg_mag_flush_all can drain it.
+ */
+struct pgg_magazine{
+	relptr_t			slot[CT_PGG_MAG_MAX_LVL + 1][CT_PGG_MAG_SIZE];
+	uint8_t				count[CT_PGG_MAG_MAX_LVL + 1];
+	uint64_t			lock;
+	pgg_mag_stat_t		stat;
+	struct pgg_magazine	*next;
+};
+typedef struct pgg_magazine pgg_magazine_t;
+
+/* Online defragmenter state.
+ * Progress counters are only written
+ * by the defrag thread.
+ */
+struct ct_defrag{
+	pthread_t			thread;
+	volatile int		running;
+	volatile int		stop;
+	// bytes moved per second, 0 for unlimited
+	uint64_t			rate;
+	uint64_t			passes;
+	uint64_t			scanned;
+	uint64_t			reclaimed;
+	uint64_t			files_moved;
+	uint64_t			bytes_moved;
+	relptr_t			cursor;
+	uint64_t			dirs_compacted;
+};
+typedef struct ct_defrag ct_defrag_t;
+
+/* Dentry cache entry, (parent, name) to the
+ * dirent slot holding name. ino is 0 for a 
+ * name known not to exist, parent is 0 for
+ * an empty entry. Entries of a parent change
+ * only under its rt lock.
+ */
+struct ct_dentry{
+	index_t				parent;
+	index_t				ino;
+	uint32_t			slot;
+	uint8_t				len;
+	char				name[CT_DCACHE_NAME];
+};
+typedef struct ct_dentry ct_dentry_t;
+
+/* Free dirents of a large directory, DRAM
+ * only. Stacks of free entries by their
+ * number of slots, LIFO so the last freed
+ * is reused first.
+ */
+struct dir_free{
+	index_t				ino;
+	// free slots, for the compactor
+	uint64_t			nfree;
+	int					queued;
+	uint32_t			count[CT_DIRENT_MAX_SLOTS + 1];
+	uint32_t			cap[CT_DIRENT_MAX_SLOTS + 1];
+	uint32_t			*slot[CT_DIRENT_MAX_SLOTS + 1];
+};
+typedef struct dir_free dir_free_t;
+
+/* A range returned by ctfs_mmap. ino is 0
+ * once the file is removed, the group is
+ * then freed with its last mapping.
+ */
+struct ct_mmap{
+	uint64_t			addr;
+	uint64_t			len;
+	index_t				ino;
+	relptr_t			block;
+	pgg_level_t			level;
+	uint8_t				writable;
+};
+typedef struct ct_mmap ct_mmap_t;
+
+/* pages under a read view, kept on the
+ * view key like a read-only mapping
+ */
+struct ct_view_range{
+	uint64_t			addr;
+	uint64_t			len;
+};
+typedef struct ct_view_range ct_view_range_t;
+
+/* A page group moved away from or removed
+ * under a read view or an optimistic read.
+ * Freed once the inode lock slot has no views
+ * and no reads from before epoch left.
+ */
+struct ct_view_retired{
+	relptr_t			block;
+	pgg_level_t			level;
+	index_t				slot;
+	uint64_t			epoch;
+};
+typedef struct ct_view_retired ct_view_retired_t;
+
+/* One per thread, an optimistic pread in
+ * flight. epoch is 0 when idle. Never freed,
+ * taken over by a later thread once free.
+ */
+struct ct_reader{
+	uint64_t			epoch;
+	uint64_t			slot;
+	uint64_t			free;
+	struct ct_reader	*next;
+	char				padding[32];
+};
+typedef struct ct_reader ct_reader_t;
+
+/* Times not yet written to pmem, lazytime.
+ * ino is 0 for an empty slot, pending says
+ * which of the times are set. A change sets
+ * both mtim and ctim to mtim.
+ */
+#define CT_LAZY_ATIME		0x01
+#define CT_LAZY_MTIME		0x02
+
+struct ct_lazytime{
+	index_t				ino;
+	uint64_t			pending;
+	struct timespec		atim;
+	struct timespec		mtim;
+};
+typedef struct ct_lazytime ct_lazytime_t;
+
 /* end of in-RAM structures */
 struct failsafe_frame;
 
@@ -40,8 +256,11 @@ struct ct_runtime{
 	char 				indoe_bmp_lock_padding[48];
 	ctfs_lock_t         inode_bmp_lock;
 	char 				indoe_bmp_lock_padding_[60];
-	uint64_t			inode_rt_lock[CT_INODE_BITLOCK_SLOTS / 64];
-	uint64_t			inode_rw_lock[CT_INODE_RW_SLOTS / 64];
+	// bitmap words with a free inode,
+	// under inode_bmp_lock
+	ct_sbmp_t			inode_free;
+	inode_pool_t		inode_pool[CT_INODE_POOLS];
+	inode_lock_t		inode_lock[CT_INODE_LOCK_SLOTS];
 
 	// current dir
 	ct_inode_pt			current_dir;
@@ -56,6 +275,59 @@ struct ct_runtime{
 	// ppg lock
 	uint64_t			pgg_lock;
 	char				pgg_lock_padding[56];
+	/* DRAM index of the pgg tree, rebuilt at init.
+	 * pgg_free[l]: empty L3-L8 slots, bit = offset / pgg_size[l]
+	 * pgg_pkg[l]: L0-L2 packages with free slots, bit = offset / 2M
+	 * Protected by pgg_lock.
+	 */
+	ct_sbmp_t			pgg_free[PGG_LVL9];
+	ct_sbmp_t			pgg_pkg[PGG_LVL3];
+	// the last CT_DEFRAG_BATCH hold the L5s being evacuated
+	pgg_arena_t			pgg_arena[CT_PGG_ARENAS + CT_DEFRAG_BATCH];
+	// magazines of live threads, and counters of exited ones
+	uint64_t			pgg_mag_lock;
+	pgg_magazine_t		*pgg_mag_list;
+	pgg_mag_stat_t		pgg_mag_retired;
+	ct_defrag_t			defrag;
+	// sub-PMD packages carved per level, and the
+	// credits deciding the level of the next one
+	uint64_t			pgg_carved[PGG_LVL3];
+	int64_t				pgg_sub_credit[PGG_LVL3];
+	// owner arena + 1 of each L5, 0 if not reserved
+	uint8_t				pgg_arena_of[CT_DAX_ALLOC_SIZE / CT_PGG_ARENA_SIZE];
+	// mount options, CTFS_INIT_FLAG_*
+	int					mount_flags;
+	// pending times, lazytime
+	ct_lazytime_t		lazy[CT_LAZYTIME_SLOTS];
+	uint64_t			lazy_lock[CT_LAZYTIME_SLOTS / 64];
+	uint64_t			lazy_pending;
+	// free dirents of one large directory per
+	// inode lock slot, under that rt lock
+	dir_free_t			*dir_free[CT_INODE_LOCK_SLOTS];
+	// directories gone sparse, for the compactor
+	index_t				dir_sparse[CT_DIR_COMPACT_QUEUE];
+	uint64_t			dir_sparse_n;
+	uint64_t			dir_sparse_lock;
+	// mapped files
+	ct_mmap_t			mmap[CT_MAX_MMAP];
+	uint64_t			mmap_n;
+	uint64_t			mmap_lock;
+	// read views, under mmap_lock too
+	ct_view_range_t		view_range[CT_MAX_VIEW];
+	uint64_t			view_range_n;
+	// groups waiting for read views to go
+	ct_view_retired_t	*view_retired;
+	uint64_t			view_retired_n;
+	uint64_t			view_retired_cap;
+	uint64_t			view_lock;
+	// optimistic readers, and the epoch
+	// a retired group is tagged with
+	ct_reader_t			*reader_list;
+	uint64_t			view_epoch;
+	// dentry cache, NULL if disabled
+	ct_dentry_t			*dcache;
+	uint8_t				*dcache_clock;
+	uint64_t			dcache_lock[CT_DCACHE_SETS / 64];
 	// failsafe
 	uint64_t			failsafe_clock;
 	struct failsafe_frame* failsafe_frame;
@@ -100,12 +372,57 @@ void inode_rt_lock(index_t inode_n);
 void inode_rt_unlock(index_t inode_n);
 void inode_rw_lock(index_t inode_n);
 void inode_rw_unlock(index_t inode_n);
+void inode_rw_lock_shared(index_t inode_n);
+void inode_rw_unlock_shared(index_t inode_n);
+uint32_t inode_read_begin(index_t inode_n);
+int inode_read_retry(index_t inode_n, uint32_t seq);
+int inode_lock_hottest(index_t *slot, inode_lock_stat_t *stat, int n);
 void inode_wb(ct_inode_pt inode);
+int inode_index_rebuild();
+int inode_reclaim_groups();
+uint32_t inode_alloc_many(index_t *out, uint32_t n);
 index_t inode_alloc();
 void inode_dealloc(index_t index);
+void inode_pool_drain();
 void inode_set_root();
+void inode_touch_atime(ct_inode_pt inode);
+int inode_touch_mtime(ct_inode_pt inode);
+void inode_get_times(ct_inode_pt inode, struct timespec *atim,
+	struct timespec *mtim, struct timespec *ctim);
+void inode_lazy_flush(index_t inode_n);
+void inode_lazy_flush_all();
 int inode_path2inode(ct_inode_frame_t * frame);
+uint32_t inode_create_many(ct_inode_pt dir, const char *const *names, uint32_t n, size_t size);
+int inode_resize_lvl(ct_inode_pt inode, pgg_level_t lvl, size_t keep);
 int inode_resize(ct_inode_pt inode, size_t size);
+// directory related
+uint64_t dir_name_hash(const char *name, size_t len);
+int64_t dir_lookup(ct_inode_pt dir, const char *name, size_t len);
+void dir_index_add(ct_inode_pt dir, ct_dirent_pt dirent);
+void dir_index_del(ct_inode_pt dir, ct_dirent_pt dirent);
+void dir_dirent_set(ct_dirent_pt d, const char *name, size_t len, uint8_t type);
+void dir_init(ct_inode_pt dir, index_t parent);
+int64_t dir_alloc(ct_inode_pt dir, size_t len);
+void dir_unalloc(ct_inode_pt dir, int64_t slot, size_t len);
+int64_t dir_free_take(ct_inode_pt dir, uint32_t n);
+void dir_free_put(ct_inode_pt dir, uint64_t slot);
+void dir_free_forget(index_t ino);
+int dir_compact(index_t ino);
+uint64_t dir_compact_pending();
+// mapped files
+int inode_mapped(index_t ino);
+int mmap_orphan(ct_inode_pt inode);
+int mmap_write_begin(index_t ino);
+void mmap_write_end(int granted);
+void view_move(index_t ino, relptr_t new, relptr_t old, uint64_t npgs);
+int view_retire(index_t ino, pgg_level_t level, relptr_t block);
+int view_read_begin(index_t ino);
+void view_read_end();
+int dir_grow(ct_inode_pt dir, uint64_t nslots);
+void dcache_init();
+int dcache_lookup(index_t parent, const char *name, size_t len, index_t *ino, uint32_t *slot);
+void dcache_insert(index_t parent, const char *name, size_t len, index_t ino, uint32_t slot);
+void dcache_invalidate(index_t parent, const char *name, size_t len);
 
 void ct_time_stamp(struct timespec * time);
 int ct_time_greater(struct timespec * time1, struct timespec * time2);
@@ -1,6 +1,7 @@
 #ifndef CTFS_TYPE_H
 #define CTFS_TYPE_H
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <assert.h>
 #include <sys/types.h>
@@ -91,26 +92,44 @@ struct ct_inode{
     time_t          i_otim; /* Time of last open */
 
 	// 8-bit fields
-	
+	uint8_t		i_hash_bits;	// log2 of the dir index entries, 0 if none
+
 
     /* Padding.
-     * 128B - 120B = 8
+     * 128B - 121B = 7
      */
-    char        padding[7];
+    char        padding[6];
 };
 typedef struct ct_inode ct_inode_t;
 typedef ct_inode_t* ct_inode_pt;
 
+/* Packed dirent. A directory is an array of
+ * 32B slots, an entry takes d_nslot of them
+ * and its name runs on into the following ones.
+ * Free entries have d_ino 0 and keep d_nslot,
+ * d_nslot 0 is a never used single slot.
+ */
 struct ct_dirent{
     __ino64_t d_ino;
-    __off64_t d_off;
-    unsigned short int d_reclen;
-    unsigned char d_type;
-    char d_name[CT_MAX_NAME + 1];
+    // high 32 bits of dir_name_hash of the name
+    uint32_t d_hash;
+    uint8_t d_namelen;
+    uint8_t d_type;
+    uint8_t d_nslot;
+    uint8_t d_reserved;
+    // terminated, continues in the next slots
+    char d_name[16];
 };
 typedef struct ct_dirent ct_dirent_t;
 typedef ct_dirent_t* ct_dirent_pt;
 
+#define CT_DIRENT_NAME0         (sizeof(ct_dirent_t) - offsetof(ct_dirent_t, d_name))
+// slots taken by a name of len bytes
+#define CT_DIRENT_SLOTS(len)    ((len) + 1 <= CT_DIRENT_NAME0 ? 1 : \
+    1 + ((len) + 1 - CT_DIRENT_NAME0 + sizeof(ct_dirent_t) - 1) / sizeof(ct_dirent_t))
+#define CT_DIRENT_MAX_SLOTS     CT_DIRENT_SLOTS(CT_MAX_NAME)
+#define CT_DIRENT_NSLOT(d)      ((d)->d_nslot ? (d)->d_nslot : 1)
+
 /******************************************
  * In-RAM structures 
  ******************************************/
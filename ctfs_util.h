@@ -19,12 +19,27 @@ __sync_fetch_and_or((char*) (((uint64_t)addr)+(num/8)),      \
 __sync_and_and_fetch((char*) (((uint64_t)addr)+(num/8)),      \
 ~((char)0x01 << (num%8))) 
 
-typedef volatile int ctfs_lock_t;
+/* Locks spin a while, then park on a futex
+ * so a preempted holder gets the cpu back.
+ * Acquires return how long they waited.
+ */
+#define LOCK_FREE               0
+#define LOCK_SPUN               1
+#define LOCK_PARKED             2
 
-#define ctfs_lock_try(lock)     pthread_spin_trylock(&lock)
-#define ctfs_lock_acquire(lock) pthread_spin_lock(&lock)
-#define ctfs_lock_release(lock) pthread_spin_unlock(&lock)
-#define ctfs_lock_init(lock) pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE)
+typedef uint32_t ctfs_lock_t;
+
+// 0 on success, like pthread_spin_trylock
+#define ctfs_lock_try(lock)     (!ct_lock_try(&(lock)))
+#define ctfs_lock_acquire(lock) ct_lock_acquire(&(lock))
+#define ctfs_lock_release(lock) ct_lock_release(&(lock))
+#define ctfs_lock_init(lock)    ((lock) = 0)
+
+int ct_lock_acquire(uint32_t *lock);
+
+int ct_lock_try(uint32_t *lock);
+
+void ct_lock_release(uint32_t *lock);
 
 // void bit_lock_acquire(uint64_t *addr, uint64_t num);
 // void bit_lock_release(uint64_t *addr, uint64_t num);
@@ -45,18 +60,68 @@ int get_bit (uint64_t *bitmap, size_t b);
 
 int64_t find_free_bit_tiny(uint64_t *bitmap, size_t size);
 
+int64_t find_free_bit_tiny_from(uint64_t *bitmap, size_t size, size_t hint);
+
 int64_t find_free_bit (uint64_t *bitmap, size_t size, size_t hint);
 
-void bitlock_acquire(uint64_t *bitlock, uint64_t location);
+/************************************************ 
+ * DRAM summary bitmap. Level 0 holds one bit 
+ * per item, a bit in level n+1 is set when the 
+ * matching word in level n is not zero.
+ * Not thread safe, callers hold their own lock.
+ ************************************************/
+#define CT_SBMP_MAX_LVL 6
+
+struct ct_sbmp{
+    uint64_t    nbits;
+    uint8_t     nlvl;
+    uint64_t    nwords[CT_SBMP_MAX_LVL];
+    uint64_t    *map[CT_SBMP_MAX_LVL];
+};
+typedef struct ct_sbmp ct_sbmp_t;
+
+int ct_sbmp_init(ct_sbmp_t *b, uint64_t nbits);
+
+void ct_sbmp_destroy(ct_sbmp_t *b);
+
+void ct_sbmp_set(ct_sbmp_t *b, uint64_t bit);
+
+void ct_sbmp_clear(ct_sbmp_t *b, uint64_t bit);
+
+int ct_sbmp_test(ct_sbmp_t *b, uint64_t bit);
+
+int64_t ct_sbmp_next(ct_sbmp_t *b, uint64_t from);
+
+#define ct_sbmp_first(b)    ct_sbmp_next(b, 0)
+
+uint64_t ct_sbmp_take_word(ct_sbmp_t *b, uint64_t word, uint64_t mask);
+
+void ct_sbmp_load_free(ct_sbmp_t *b, uint64_t *bitmap, uint64_t nwords);
+
+void ct_sbmp_put_word(ct_sbmp_t *b, uint64_t word, uint64_t bits);
+
+int bitlock_acquire(uint64_t *bitlock, uint64_t location);
 
 int bitlock_try_acquire(uint32_t *bitlock, uint32_t bit, uint32_t tries);
 
 void bitlock_release(uint64_t *bitlock, uint64_t location);
 
+int rwlock_acquire_shared(uint32_t *lock);
+
+void rwlock_release_shared(uint32_t *lock);
+
+int rwlock_acquire(uint32_t *lock);
+
+void rwlock_release(uint32_t *lock);
+
 void avx_cpy(void *dest, const void *src, size_t size);
 
 void avx_cpyt(void *dest, void *src, size_t size);
 
+void cpy_read(void *dest, const void *src, size_t size);
+
+void cpy_init();
+
 // void big_memcpy(void *dest, const void *src, size_t n);
 
 /***********************************************
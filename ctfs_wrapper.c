@@ -83,6 +83,10 @@
 #define ALIAS_PREAD64  pread64
 #define ALIAS_PWRITE64 pwrite64
 #define ALIAS_PWRITE pwrite
+#define ALIAS_PREADV  preadv
+#define ALIAS_PREADV64  preadv64
+#define ALIAS_PWRITEV pwritev
+#define ALIAS_PWRITEV64 pwritev64
 //#define ALIAS_PWRITESYNC pwrite64_sync
 #define ALIAS_FSYNC  fsync
 #define ALIAS_FDSYNC fdatasync
@@ -182,6 +186,10 @@
 #define RETT_PREAD64  ssize_t
 #define RETT_PWRITE ssize_t
 #define RETT_PWRITE64 ssize_t
+#define RETT_PREADV  ssize_t
+#define RETT_PREADV64  ssize_t
+#define RETT_PWRITEV ssize_t
+#define RETT_PWRITEV64 ssize_t
 //#define RETT_PWRITESYNC ssize_t
 #define RETT_FSYNC  int
 #define RETT_FDSYNC int
@@ -282,6 +290,10 @@
 #define INTF_PREAD64  int file,       void *buf, size_t count, off_t offset
 #define INTF_PWRITE int file, const void *buf, size_t count, off_t offset
 #define INTF_PWRITE64 int file, const void *buf, size_t count, off_t offset
+#define INTF_PREADV  int file, const struct iovec *iov, int iovcnt, off_t offset
+#define INTF_PREADV64  int file, const struct iovec *iov, int iovcnt, off64_t offset
+#define INTF_PWRITEV int file, const struct iovec *iov, int iovcnt, off_t offset
+#define INTF_PWRITEV64 int file, const struct iovec *iov, int iovcnt, off64_t offset
 //#define INTF_PWRITESYNC int file, const void *buf, size_t count, off_t offset
 #define INTF_FSYNC  int file
 #define INTF_FDSYNC int file
@@ -320,7 +332,9 @@
 						(READ) (READ2) (WRITE) (PREAD) (PREAD64) (PWRITE) (PWRITE64) (STAT) (STAT64) (FSTAT) (FSTAT64) (LSTAT) (RENAME)\
 						(MKDIR) (RMDIR) (FSTATFS) (FDATASYNC) (FCNTL) (FCNTL2) \
 						(OPENDIR) (CLOSEDIR) (READDIR) (READDIR64) (ERROR) (SYNC_FILE_RANGE) \
-						(FOPEN) (FPUTS) (FGETS) (FWRITE) (FREAD) (FCLOSE) (FSEEK) (FFLUSH)
+						(FOPEN) (FPUTS) (FGETS) (FWRITE) (FREAD) (FCLOSE) (FSEEK) (FFLUSH) \
+						(MMAP) (MMAP64) (MUNMAP) (MSYNC) \
+						(READV) (WRITEV) (PREADV) (PREADV64) (PWRITEV) (PWRITEV64)
 
 #define PREFIX(call)				(real_##call)
 
@@ -660,7 +674,7 @@ OP_DEFINE(UNLINK){
 
 OP_DEFINE(FSYNC){
 	if(file >= CT_FD_OFFSET){
-		return 0;
+		return ctfs_fsync(file - CT_FD_OFFSET);
 	}
 	else{
 		return real_ops.FSYNC(file);
@@ -755,6 +769,84 @@ OP_DEFINE(PWRITE64){
 	}
 }
 
+OP_DEFINE(READV){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_readv(file - CT_FD_OFFSET, iov, iovcnt);
+	}
+	else{
+		if(real_ops.READV == NULL){
+			insert_real_op();
+		}
+		return real_ops.READV(file, iov, iovcnt);
+	}
+}
+
+OP_DEFINE(WRITEV){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_writev(file - CT_FD_OFFSET, iov, iovcnt);
+	}
+	else{
+		if(real_ops.WRITEV == NULL){
+			insert_real_op();
+		}
+		return real_ops.WRITEV(file, iov, iovcnt);
+	}
+}
+
+OP_DEFINE(PREADV){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_preadv(file - CT_FD_OFFSET, iov, iovcnt, offset);
+	}
+	else{
+		if(real_ops.PREADV == NULL){
+			insert_real_op();
+		}
+		return real_ops.PREADV(file, iov, iovcnt, offset);
+	}
+}
+
+OP_DEFINE(PREADV64){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_preadv(file - CT_FD_OFFSET, iov, iovcnt, offset);
+	}
+	else{
+		if(real_ops.PREADV64 == NULL){
+			insert_real_op();
+		}
+		return real_ops.PREADV64(file, iov, iovcnt, offset);
+	}
+}
+
+OP_DEFINE(PWRITEV){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_pwritev(file - CT_FD_OFFSET, iov, iovcnt, offset);
+	}
+	else{
+		if(real_ops.PWRITEV == NULL){
+			insert_real_op();
+		}
+		return real_ops.PWRITEV(file, iov, iovcnt, offset);
+	}
+}
+
+OP_DEFINE(PWRITEV64){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_pwritev(file - CT_FD_OFFSET, iov, iovcnt, offset);
+	}
+	else{
+		if(real_ops.PWRITEV64 == NULL){
+			insert_real_op();
+		}
+		return real_ops.PWRITEV64(file, iov, iovcnt, offset);
+	}
+}
+
 OP_DEFINE(STAT){
 	if(*path == '\\' || *path != '/'){
 		PRINT_FUNC;
@@ -884,7 +976,7 @@ OP_DEFINE(FSTATFS){
 
 OP_DEFINE(FDATASYNC){
 	if(fd >= CT_FD_OFFSET){
-		return 0;
+		return ctfs_fsync(fd - CT_FD_OFFSET);
 	}
 	else{
 		return real_ops.FDATASYNC(fd);
@@ -1013,6 +1105,59 @@ OP_DEFINE(ERROR){
 }
 
 
+OP_DEFINE(MMAP){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_mmap(addr, len, prot, flags, file - CT_FD_OFFSET, off);
+	}
+	else{
+		// lib_dax maps the device before init
+		if(real_ops.MMAP == NULL){
+			insert_real_op();
+		}
+		return real_ops.MMAP(addr, len, prot, flags, file, off);
+	}
+}
+
+OP_DEFINE(MMAP64){
+	if(file >= CT_FD_OFFSET){
+		PRINT_FUNC;
+		return ctfs_mmap(addr, len, prot, flags, file - CT_FD_OFFSET, off);
+	}
+	else{
+		if(real_ops.MMAP64 == NULL){
+			insert_real_op();
+		}
+		return real_ops.MMAP64(addr, len, prot, flags, file, off);
+	}
+}
+
+OP_DEFINE(MUNMAP){
+	if(ctfs_mmap_owns(addr)){
+		PRINT_FUNC;
+		return ctfs_munmap(addr, len);
+	}
+	else{
+		if(real_ops.MUNMAP == NULL){
+			insert_real_op();
+		}
+		return real_ops.MUNMAP(addr, len);
+	}
+}
+
+OP_DEFINE(MSYNC){
+	if(ctfs_mmap_owns(addr)){
+		PRINT_FUNC;
+		return ctfs_msync(addr, len, flags);
+	}
+	else{
+		if(real_ops.MSYNC == NULL){
+			insert_real_op();
+		}
+		return real_ops.MSYNC(addr, len, flags);
+	}
+}
+
 OP_DEFINE(SYNC_FILE_RANGE){
 	if(fd >= CT_FD_OFFSET ){
 		PRINT_FUNC;
@@ -1114,6 +1259,43 @@ OP_DEFINE(FFLUSH){
 
 
 
+// helpers of large copies, cpy_threads=N
+static int mount_cpy_threads;
+// smallest copy they split in MB, cpy_min=N
+static uint64_t mount_cpy_min;
+
+/* mount options from CTFS_MOUNT_OPTS,
+ * comma separated: noatime, relatime, lazytime,
+ * cpy_threads=N, cpy_min=N
+ */
+static int mount_flags(){
+	const char *opts = getenv("CTFS_MOUNT_OPTS");
+	int flag = 0;
+	while(opts && *opts){
+		size_t len = strcspn(opts, ",");
+		if(len == 7 && strncmp(opts, "noatime", len) == 0){
+			flag |= CTFS_INIT_FLAG_NOATIME;
+		}
+		else if(len == 8 && strncmp(opts, "relatime", len) == 0){
+			flag |= CTFS_INIT_FLAG_RELATIME;
+		}
+		else if(len == 8 && strncmp(opts, "lazytime", len) == 0){
+			flag |= CTFS_INIT_FLAG_LAZYTIME;
+		}
+		else if(len > 12 && strncmp(opts, "cpy_threads=", 12) == 0){
+			mount_cpy_threads = atoi(opts + 12);
+		}
+		else if(len > 8 && strncmp(opts, "cpy_min=", 8) == 0){
+			mount_cpy_min = (uint64_t)atoll(opts + 8) << 20;
+		}
+		opts += len;
+		if(*opts == ','){
+			opts ++;
+		}
+	}
+	return flag;
+}
+
 static __attribute__((constructor(120) )) void init_method(void)
 {
     if(real_ops.ERROR == 0){
@@ -1127,7 +1309,10 @@ static __attribute__((constructor(120) )) void init_method(void)
 	printf("Atomic write is enabled!\n");
 #endif
 	if(real_ops.ERROR != 0){
-		ctfs_init(0);
+		ctfs_init(mount_flags());
+		if(mount_cpy_threads){
+			ctfs_cpy_pool_start(mount_cpy_threads, mount_cpy_min);
+		}
 		printf("ctFS initialized. \nNow the program begins.\n");
 		return;
 	}
@@ -1136,4 +1321,10 @@ static __attribute__((constructor(120) )) void init_method(void)
 	
 }
 
-
+static __attribute__((destructor)) void fini_method(void)
+{
+	if(inited){
+		ctfs_cpy_pool_stop();
+		ctfs_sync();
+	}
+}
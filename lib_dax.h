@@ -11,6 +11,9 @@ extern int dax_fd;
 #define DAX_MPK_DEFAULT		0
 #define DAX_MPK_META		1
 #define DAX_MPK_FILE		2
+// read views and read-only mappings, write
+// disabled outside ctfs calls
+#define DAX_MPK_VIEW		DAX_MPK_META
 
 // #define RAM_VER
 enum dax_ioctl_types{
@@ -0,0 +1,267 @@
+/* Page group allocator benchmark.
+ * Runs on an anonymous DRAM mapping, no /dev/dax0.0 needed.
+ * usage: pgg_bench [ops] [max_threads] [trace_ops] [seed]
+ */
+#define _GNU_SOURCE
+#include "../ctfs_pgg.h"
+#include "../ctfs_runtime.h"
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_MAX_LVL	PGG_LVL8
+// fragmentation is measured in 1G groups
+#define BENCH_PROBE_LVL	PGG_LVL6
+
+static uint64_t rand_next(uint64_t *s){
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* format the page group tree on
+ * a DRAM mapping, like ctfs_mkfs does
+ * on the DAX device
+ */
+static int bench_mkfs(){
+	memset(&ct_rt, 0, sizeof(ct_rt));
+	void *base = mmap(NULL, CT_DAX_ALLOC_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED){
+		return -1;
+	}
+	ct_rt.base_addr = (uint64_t)base;
+	// a spare protection key, so background paths that
+	// grant and stop access leave this mapping alone.
+	// -1 without PKU, then pkey_set is a no-op.
+	ct_rt.mpk[DAX_MPK_DEFAULT] = pkey_alloc(0, 0);
+	ct_rt.super_blk = (ct_super_blk_pt)(ct_rt.base_addr);
+	ct_super_blk_pt sb = ct_rt.super_blk;
+	strcpy(sb->magic, CT_MAGIC);
+	sb->alloc_prot_bmp = CT_OFFSET_PROT;
+	sb->first_pgg = CT_OFFSET_1_PGG;
+	sb->lvl9_bmp = CT_OFFSET_L9_BMP;
+	sb->next_sub_lvl = PGG_LVL0;
+	ct_rt.alloc_prot = CT_REL2ABS(sb->alloc_prot_bmp);
+	ct_rt.lvl9_bmp = CT_REL2ABS(sb->lvl9_bmp);
+	ct_rt.first_pgg = CT_REL2ABS(sb->first_pgg);
+	return pgg_mkfs() ? 0 : -1;
+}
+
+/* number of groups of a level
+ * to keep alive at once
+ */
+static uint64_t bench_count(pgg_level_t lvl, uint64_t ops){
+	// stay within 64G per level
+	uint64_t cap = ((uint64_t)64 << 30) / pgg_size[lvl];
+	return ops < cap ? ops : cap;
+}
+
+/* ns per allocation and free of
+ * each level, single thread
+ */
+static void bench_latency(uint64_t ops){
+	struct timespec start, stop;
+	relptr_t *live = malloc(ops * sizeof(relptr_t));
+	printf("level    count   alloc ns   free ns   pair ns\n");
+	for(pgg_level_t lvl = PGG_LVL0; lvl <= BENCH_MAX_LVL; lvl++){
+		uint64_t n = bench_count(lvl, ops), got;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(got = 0; got < n; got++){
+			live[got] = pgg_allocate(lvl);
+			if(live[got] == 0){
+				break;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		long t_alloc = calc_diff(start, stop);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(uint64_t i = 0; i < got; i++){
+			pgg_deallocate(lvl, live[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		long t_free = calc_diff(start, stop);
+		// hot path, one group in and out
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(uint64_t i = 0; i < ops; i++){
+			pgg_deallocate(lvl, pgg_allocate(lvl));
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		long t_pair = calc_diff(start, stop);
+		pgg_mag_flush();
+		printf("L%-6d %7lu %10.1f %9.1f %9.1f\n", lvl, got,
+			got ? (double)t_alloc / got : 0.0,
+			got ? (double)t_free / got : 0.0,
+			(double)t_pair / ops);
+	}
+	free(live);
+}
+
+struct bench_thread{
+	uint64_t	ops;
+	uint64_t	seed;
+	long		time;
+};
+
+/* random L0-L4 alloc/free with a
+ * small working set per thread
+ */
+static void *bench_worker(void *arg){
+	struct bench_thread *t = arg;
+	struct timespec start, stop;
+	relptr_t slot[64] = {0};
+	pgg_level_t lvl[64];
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(uint64_t i = 0; i < t->ops; i++){
+		uint64_t r = rand_next(&t->seed);
+		uint8_t s = r % 64;
+		if(slot[s]){
+			pgg_deallocate(lvl[s], slot[s]);
+			slot[s] = 0;
+		}
+		else{
+			lvl[s] = (r >> 8) % (PGG_LVL4 + 1);
+			slot[s] = pgg_allocate(lvl[s]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	for(uint8_t s = 0; s < 64; s++){
+		if(slot[s]){
+			pgg_deallocate(lvl[s], slot[s]);
+		}
+	}
+	pgg_mag_flush();
+	t->time = calc_diff(start, stop);
+	return NULL;
+}
+
+static void bench_scaling(uint64_t ops, int max_threads){
+	struct bench_thread *frames = malloc(max_threads * sizeof(struct bench_thread));
+	pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+	printf("threads   Mops/s\n");
+	for(int n = 1; n <= max_threads; n *= 2){
+		long longest = 0;
+		for(int i = 0; i < n; i++){
+			frames[i] = (struct bench_thread){.ops = ops, .seed = 0x9e3779b97f4a7c15 + i};
+			pthread_create(&threads[i], NULL, bench_worker, &frames[i]);
+		}
+		for(int i = 0; i < n; i++){
+			pthread_join(threads[i], NULL);
+			if(frames[i].time > longest){
+				longest = frames[i].time;
+			}
+		}
+		printf("%-7d %8.2f\n", n, (double)ops * n * 1000 / longest);
+	}
+	free(frames);
+	free(threads);
+}
+
+/* grab the free space greedily from 
+ * large to small groups, then give it back
+ * @param[out] large, bytes found in groups of
+ *             BENCH_PROBE_LVL and above
+ * @return free bytes, in L3 granularity
+ */
+static uint64_t bench_free_space(uint64_t *large){
+	uint64_t n = 0, cap = 1 << 16, total = 0;
+	relptr_t *got = malloc(cap * sizeof(relptr_t));
+	pgg_level_t *lvl = malloc(cap * sizeof(pgg_level_t));
+	*large = 0;
+	for(pgg_level_t l = PGG_LVL8; l >= PGG_LVL3; l--){
+		while(1){
+			if(n == cap){
+				cap *= 2;
+				got = realloc(got, cap * sizeof(relptr_t));
+				lvl = realloc(lvl, cap * sizeof(pgg_level_t));
+			}
+			if((got[n] = pgg_allocate(l)) == 0){
+				break;
+			}
+			lvl[n ++] = l;
+			total += pgg_size[l];
+			if(l >= BENCH_PROBE_LVL){
+				*large += pgg_size[l];
+			}
+		}
+	}
+	for(uint64_t i = 0; i < n; i++){
+		pgg_deallocate(lvl[i], got[i]);
+	}
+	pgg_mag_flush();
+	free(got);
+	free(lvl);
+	return total;
+}
+
+/* long random trace of mixed levels,
+ * then measure how much free space is
+ * still usable as 1G groups
+ */
+static void bench_fragmentation(uint64_t ops, uint64_t seed){
+	const uint64_t nlive = 1 << 14;
+	relptr_t *slot = calloc(nlive, sizeof(relptr_t));
+	pgg_level_t *lvl = malloc(nlive * sizeof(pgg_level_t));
+	uint64_t live_bytes = 0, free_before, free_after, large_before, large_after;
+	free_before = bench_free_space(&large_before);
+	for(uint64_t i = 0; i < ops; i++){
+		uint64_t r = rand_next(&seed);
+		uint64_t s = r % nlive;
+		if(slot[s]){
+			pgg_deallocate(lvl[s], slot[s]);
+			live_bytes -= pgg_size[lvl[s]];
+			slot[s] = 0;
+		}
+		else{
+			// mostly small files, few large ones
+			uint64_t p = (r >> 20) % 1000;
+			lvl[s] = (p < 600) ? (p % 3) : (p < 900) ? PGG_LVL3 + (p % 2) :
+				(p < 995) ? PGG_LVL5 : PGG_LVL6;
+			slot[s] = pgg_allocate(lvl[s]);
+			if(slot[s]){
+				live_bytes += pgg_size[lvl[s]];
+			}
+		}
+	}
+	pgg_mag_flush();
+	free_after = bench_free_space(&large_after);
+	printf("trace: %lu ops, live %lu MB\n", ops, live_bytes >> 20);
+	printf("\tfree before %lu MB, %.2f%% in L%d and up\n", free_before >> 20, 
+		100.0 * large_before / free_before, BENCH_PROBE_LVL);
+	printf("\tfree after  %lu MB, %.2f%% in L%d and up\n", free_after >> 20, 
+		100.0 * large_after / free_after, BENCH_PROBE_LVL);
+	printf("\tfragmentation: %.2f%%\n", 100.0 * (1.0 - (double)large_after / free_after));
+	for(uint64_t s = 0; s < nlive; s++){
+		if(slot[s]){
+			pgg_deallocate(lvl[s], slot[s]);
+		}
+	}
+	pgg_mag_flush();
+	free(slot);
+	free(lvl);
+}
+
+int main(int argc, char ** argv){
+	uint64_t ops = (argc > 1) ? atoll(argv[1]) : 100000;
+	int max_threads = (argc > 2) ? atoi(argv[2]) : 8;
+	uint64_t trace = (argc > 3) ? atoll(argv[3]) : 1000000;
+	uint64_t seed = (argc > 4) ? atoll(argv[4]) : 1;
+	if(ops == 0 || max_threads < 1 || seed == 0){
+		printf("usage: %s [ops] [max_threads] [trace_ops] [seed]\n", argv[0]);
+		return -1;
+	}
+	if(bench_mkfs()){
+		printf("Failed to map the DRAM region!\n");
+		return -1;
+	}
+	printf("pgg_bench: %lu ops, up to %d threads, trace %lu ops\n", ops, max_threads, trace);
+	bench_latency(ops);
+	bench_scaling(ops, max_threads);
+	bench_fragmentation(trace, seed);
+	return 0;
+}
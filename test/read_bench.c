@@ -0,0 +1,140 @@
+/* Many readers of one file.
+ * Each thread preads its own part of one shared
+ * file. Runs on an anonymous DRAM mapping,
+ * no /dev/dax0.0 needed.
+ * usage: read_bench [file_mb] [block_kb] [max_threads] [passes]
+ */
+#define _GNU_SOURCE
+#include "../ctfs.h"
+#include "../ctfs_pgg.h"
+#include "../ctfs_runtime.h"
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_FILE	"/read_bench"
+
+/* format the file system on a DRAM
+ * mapping, like ctfs_mkfs and ctfs_init
+ * do on the DAX device
+ */
+static int bench_mkfs(){
+	memset(&ct_rt, 0, sizeof(ct_rt));
+	void *base = mmap(NULL, CT_DAX_ALLOC_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(base == MAP_FAILED){
+		return -1;
+	}
+	ct_rt.base_addr = (uint64_t)base;
+	// a spare protection key, -1 without PKU
+	ct_rt.mpk[DAX_MPK_DEFAULT] = pkey_alloc(0, 0);
+	ct_rt.super_blk = (ct_super_blk_pt)(ct_rt.base_addr);
+	ct_super_blk_pt sb = ct_rt.super_blk;
+	strcpy(sb->magic, CT_MAGIC);
+	sb->alloc_prot_bmp = CT_OFFSET_PROT;
+	sb->first_pgg = CT_OFFSET_1_PGG;
+	sb->lvl9_bmp = CT_OFFSET_L9_BMP;
+	sb->next_sub_lvl = PGG_LVL0;
+	ct_rt.alloc_prot = CT_REL2ABS(sb->alloc_prot_bmp);
+	ct_rt.lvl9_bmp = CT_REL2ABS(sb->lvl9_bmp);
+	ct_rt.first_pgg = CT_REL2ABS(sb->first_pgg);
+	ct_rt.inode_bmp = CT_REL2ABS(CT_OFFSET_IBMP);
+	ct_rt.inode_start = CT_REL2ABS(CT_OFFSET_ITABLE);
+	ctfs_lock_init(ct_rt.open_lock);
+	ctfs_lock_init(ct_rt.inode_bmp_lock);
+	if(inode_index_rebuild()){
+		return -1;
+	}
+	inode_alloc();
+	sb->root_inode = inode_alloc();
+	inode_set_root();
+	ct_rt.current_dir = &ct_rt.inode_start[sb->root_inode];
+	dcache_init();
+	cpy_init();
+	return 0;
+}
+
+struct bench_thread{
+	uint64_t	start;
+	uint64_t	bytes;
+	size_t		block;
+	int			passes;
+	long		time;
+};
+
+static void *bench_reader(void *arg){
+	struct bench_thread *t = arg;
+	struct timespec start, stop;
+	char *buf = malloc(t->block);
+	int fd = ctfs_open(BENCH_FILE, O_RDONLY);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int p = 0; p < t->passes; p++){
+		for(uint64_t off = 0; off + t->block <= t->bytes; off += t->block){
+			ctfs_pread(fd, buf, t->block, t->start + off);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	ctfs_close(fd);
+	free(buf);
+	t->time = calc_diff(start, stop);
+	return NULL;
+}
+
+int main(int argc, char ** argv){
+	uint64_t file_size = ((argc > 1) ? atoll(argv[1]) : 256) << 20;
+	size_t block = ((argc > 2) ? atoll(argv[2]) : 64) << 10;
+	int max_threads = (argc > 3) ? atoi(argv[3]) : 64;
+	int passes = (argc > 4) ? atoi(argv[4]) : 4;
+	if(file_size == 0 || block == 0 || max_threads < 1 || passes < 1){
+		printf("usage: %s [file_mb] [block_kb] [max_threads] [passes]\n", argv[0]);
+		return -1;
+	}
+	if(bench_mkfs()){
+		printf("Failed to map the DRAM region!\n");
+		return -1;
+	}
+	// one file at its full size, then fault it in
+	const char *name = BENCH_FILE + 1;
+	if(ctfs_create_many("/", &name, 1, file_size) != 1){
+		printf("Failed to create the file!\n");
+		return -1;
+	}
+	int fd = ctfs_open(BENCH_FILE, O_RDWR);
+	char *buf = malloc(block);
+	memset(buf, 0x5a, block);
+	for(uint64_t off = 0; off < file_size; off += block){
+		ctfs_pwrite(fd, buf, block, off);
+	}
+	ctfs_close(fd);
+	free(buf);
+
+	struct bench_thread *frames = malloc(max_threads * sizeof(struct bench_thread));
+	pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+	printf("read_bench: %lu MB file, %lu KB reads, %d passes\n", file_size >> 20, block >> 10, passes);
+	struct ctfs_cpy_stat cpy;
+	ctfs_cpy_stat(&cpy);
+	printf("copy: reads %s from %lu KB, prefetch %lu\n", cpy.read, cpy.read_big >> 10, cpy.prefetch);
+	printf("threads     GB/s\n");
+	for(int n = 1; n <= max_threads; n *= 2){
+		long longest = 0;
+		uint64_t part = file_size / n / block * block;
+		for(int i = 0; i < n; i++){
+			frames[i] = (struct bench_thread){.start = part * i, .bytes = part,
+				.block = block, .passes = passes};
+			pthread_create(&threads[i], NULL, bench_reader, &frames[i]);
+		}
+		for(int i = 0; i < n; i++){
+			pthread_join(threads[i], NULL);
+			if(frames[i].time > longest){
+				longest = frames[i].time;
+			}
+		}
+		printf("%-7d %8.2f\n", n, (double)part * n * passes / longest);
+	}
+	free(frames);
+	free(threads);
+	return 0;
+}